@@ -26,6 +26,7 @@ function(minitel_lib_init)
 
   add_subdirectory(${MINITEL_LIB_DIR}/board/${MINITEL_MODEL} minitel_board)
   add_subdirectory(${MINITEL_LIB_DIR}/keyboard minitel_keyboard)
+  add_subdirectory(${MINITEL_LIB_DIR}/mailbox minitel_mailbox)
   add_subdirectory(${MINITEL_LIB_DIR}/timer minitel_timer)
   add_subdirectory(${MINITEL_LIB_DIR}/video minitel_video)
 endfunction()
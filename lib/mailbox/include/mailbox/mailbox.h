@@ -0,0 +1,35 @@
+#ifndef LIB_MAILBOX_INCLUDE_MAILBOX_MAILBOX_H
+#define LIB_MAILBOX_INCLUDE_MAILBOX_MAILBOX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mailbox-definitions.h"
+
+// Helpers for exchanging data with the ROM emulator through the mailbox in the
+// external RAM (see mailbox-definitions.h), which is only available if the
+// emulator also provides the RAM.
+//
+// The data sent by the program is interpreted by the emulator with the client
+// protocol, exactly like the data sent through the menu ROM's serial tunnel,
+// and the replies can be read back.
+
+#define MAILBOX ((__xdata MAILBOX_t*)MAILBOX_BASE_ADDRESS)
+
+// Opens (or reopens) the mailbox, discarding any data still in transit.
+// Returns false if the emulator did not respond in time, e.g. because it does
+// not provide the RAM.
+bool mailbox_open(void);
+
+// Closes the mailbox, so that the memory it occupies can be used again.
+void mailbox_close(void);
+
+// Sends the given bytes, waiting for the emulator to make room if the buffer
+// is full.
+void mailbox_write(const uint8_t* data, uint16_t size);
+
+// Receives up to `max_size` bytes, without waiting. Returns how many bytes
+// have been received.
+uint16_t mailbox_read(uint8_t* data, uint16_t max_size);
+
+#endif
@@ -0,0 +1,67 @@
+#include "mailbox/mailbox.h"
+
+// How many times the status is polled before giving up, in mailbox_open. The
+// emulator checks the mailbox several times per millisecond.
+#define OPEN_MAX_POLLS 60000
+
+bool mailbox_open(void) {
+  uint16_t i;
+
+  // Make the emulator ignore the mailbox while its state is being reset.
+  MAILBOX->magic[0] = 0;
+
+  MAILBOX->tx_head = 0;
+  MAILBOX->rx_tail = 0;
+  MAILBOX->status = 0;
+
+  // The first byte completes the magic value: write it last.
+  for (i = sizeof(MAILBOX->magic); i-- != 0;) {
+    MAILBOX->magic[i] = MAILBOX_MAGIC[i];
+  }
+
+  for (i = 0; i < OPEN_MAX_POLLS; i++) {
+    if (MAILBOX->status == MAILBOX_STATUS_READY) {
+      return true;
+    }
+  }
+
+  mailbox_close();
+  return false;
+}
+
+void mailbox_close(void) { MAILBOX->magic[0] = 0; }
+
+void mailbox_write(const uint8_t *data, uint16_t size) {
+  // Keep a local copy of the head index, which only we write.
+  uint8_t head = MAILBOX->tx_head;
+
+  while (size != 0) {
+    // Wait until there is room for at least one byte.
+    uint8_t room;
+    while ((room = (uint8_t)(MAILBOX->tx_tail - head - 1)) == 0) {
+    }
+
+    // Copy as many bytes as they fit, then publish them all at once.
+    if (room > size) {
+      room = (uint8_t)size;
+    }
+    size -= room;
+    while (room-- != 0) {
+      MAILBOX->tx_buf[head++] = *data++;
+    }
+    MAILBOX->tx_head = head;
+  }
+}
+
+uint16_t mailbox_read(uint8_t *data, uint16_t max_size) {
+  uint8_t tail = MAILBOX->rx_tail;
+  uint8_t head = MAILBOX->rx_head;
+  uint16_t count = 0;
+
+  while (tail != head && count != max_size) {
+    data[count++] = MAILBOX->rx_buf[tail++];
+  }
+
+  MAILBOX->rx_tail = tail;
+  return count;
+}
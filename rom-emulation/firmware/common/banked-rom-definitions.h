@@ -0,0 +1,23 @@
+#ifndef ROM_EMULATION_FIRMWARE_COMMON_BANKED_ROM_DEFINITIONS_H
+#define ROM_EMULATION_FIRMWARE_COMMON_BANKED_ROM_DEFINITIONS_H
+
+// Banked ROMs are larger than 64 KiB and are only supported by Minitel models
+// in which the emulator also provides the RAM.
+//
+// The ROM image is laid out as follows:
+// - The first 32 KiB are always mapped at 0x0000-0x7FFF ("common area").
+// - The following 32 KiB blocks are the banks, numbered from 0, that can be
+//   mapped one at a time at 0x8000-0xFFFF ("window"). Initially, bank 0 is
+//   mapped, i.e. the first 64 KiB of the image are seen as a regular ROM.
+//
+// To switch bank, the program must run from the common area and:
+// 1. Write the bank number into BANKED_ROM_SELECT_ADDRESS (in external RAM).
+// 2. Wait until BANKED_ROM_STATUS_ADDRESS (in external RAM) contains the same
+//    bank number.
+// These two RAM locations are reserved and must not be used for other purposes.
+#define BANKED_ROM_WINDOW_BASE 0x8000
+#define BANKED_ROM_WINDOW_SIZE 0x8000
+#define BANKED_ROM_SELECT_ADDRESS 0xFFFF
+#define BANKED_ROM_STATUS_ADDRESS 0xFFFE
+
+#endif
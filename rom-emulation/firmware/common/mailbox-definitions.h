@@ -0,0 +1,54 @@
+#ifndef ROM_EMULATION_FIRMWARE_COMMON_MAILBOX_DEFINITIONS_H
+#define ROM_EMULATION_FIRMWARE_COMMON_MAILBOX_DEFINITIONS_H
+
+#include <stdint.h>
+
+// The mailbox is a fast communication channel between the program running on
+// the Minitel and the Pico, only supported by Minitel models in which the
+// emulator also provides the RAM. It is an area of the external RAM, containing
+// two circular buffers (one for each direction), that the Pico polls while the
+// program runs. It carries the same byte stream as the magic I/O serial tunnel
+// of the menu ROM, i.e. client protocol packets and their replies, but each
+// byte only costs a MOVX instruction instead of two handshakes with the Pico.
+//
+// To open the mailbox, the program must:
+// 1. Clear magic[0], so that the Pico ignores the mailbox in the meantime.
+// 2. Set tx_head, rx_tail and status to 0.
+// 3. Write MAILBOX_MAGIC into magic, last byte first.
+// 4. Wait until status becomes MAILBOX_STATUS_READY.
+//
+// Then, in each direction, the producer writes the data into the buffer at the
+// head index and then increments the head index, and the consumer reads the
+// data at the tail index and then increments the tail index. The buffers are
+// empty when the two indices are equal, and full when the head index is one
+// less than the tail index. Indices wrap around at 256.
+//
+// The mailbox can be reopened at any time, discarding the contents of both
+// buffers. It is closed by clearing magic[0].
+//
+// The whole MAILBOX_SIZE bytes are reserved while the mailbox is open, and must
+// not be used for other purposes.
+#define MAILBOX_BASE_ADDRESS 0xFC00
+#define MAILBOX_SIZE 0x300
+
+#define MAILBOX_MAGIC "MBX1"
+#define MAILBOX_STATUS_READY 0x01
+
+typedef struct {
+  // Control block.
+  volatile uint8_t magic[4];  // MAILBOX_MAGIC, written by the program
+  volatile uint8_t status;    // written by the Pico
+  volatile uint8_t tx_head;   // written by the program
+  volatile uint8_t tx_tail;   // written by the Pico
+  volatile uint8_t rx_head;   // written by the Pico
+  volatile uint8_t rx_tail;   // written by the program
+  uint8_t reserved[247];
+
+  // Program-to-Pico direction.
+  volatile uint8_t tx_buf[256];
+
+  // Pico-to-program direction.
+  volatile uint8_t rx_buf[256];
+} MAILBOX_t;
+
+#endif
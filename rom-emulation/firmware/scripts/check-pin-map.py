@@ -0,0 +1,193 @@
+#!/usr/bin/env python3
+import argparse
+import os
+import re
+import shlex
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+# This script verifies that the lookup tables emitted by generate-pin-map.py
+# permute every possible value exactly like the branchy functions that it used
+# to emit (one conditional per bit), which are reproduced below.
+#
+# Each pinout is passed through generate-pin-map.py and compiled, together with
+# the reference functions, into a host program that compares them over all the
+# 65536 addresses and 256 data values. By default, every PINOUT string in the
+# firmware's CMakeLists.txt is checked.
+
+SCRIPTS_DIR = Path(__file__).resolve().parent
+GENERATOR_PATH = SCRIPTS_DIR / "generate-pin-map.py"
+CMAKELISTS_PATH = SCRIPTS_DIR.parent / "CMakeLists.txt"
+
+PICO_TYPES_H = """\
+#pragma once
+typedef unsigned int uint;
+"""
+
+CHECK_CPP = """\
+#include <stdio.h>
+
+#include "pin-map.h"
+#include "reference-pin-map.h"
+
+static int num_errors = 0;
+
+template <typename T>
+static void check(const char *name, unsigned int inval, T actual, T expected) {
+  if (actual != expected && num_errors++ < 10) {
+    fprintf(stderr, "%s(0x%04x) = 0x%04x, expected 0x%04x\\n", name, inval,
+            (unsigned int)actual, (unsigned int)expected);
+  }
+}
+
+int main() {
+  for (unsigned int i = 0; i < 0x10000; i++) {
+    check("pin_map_address", i, pin_map_address(i),
+          reference::pin_map_address(i));
+    check("pin_map_address_inverse", i, pin_map_address_inverse(i),
+          reference::pin_map_address_inverse(i));
+  }
+  for (unsigned int i = 0; i < 0x100; i++) {
+    check("pin_map_data", i, pin_map_data(i), reference::pin_map_data(i));
+    check("pin_map_data_inverse", i, pin_map_data_inverse(i),
+          reference::pin_map_data_inverse(i));
+  }
+  return num_errors == 0 ? 0 : 1;
+}
+"""
+
+
+# The code generator of the original, branchy, permutation functions.
+def generate_permutation_function(
+    func_name: str,
+    data_type: str,
+    mapping: list[tuple[int, int]],
+) -> str:
+    code = f"inline {data_type} {func_name}({data_type} inval) {{\n"
+    code += f"  {data_type} outval = 0;\n"
+    for src, dst in mapping:
+        code += f"  if (inval & (1 << {src})) outval |= 1 << {dst};\n"
+    code += f"  return outval;\n"
+    code += f"}}\n"
+    return code
+
+
+# Returns the reference functions for the given pinout, with the same mappings
+# that generate-pin-map.py used to compute.
+def generate_reference(pinout: str) -> str:
+    busids = {}  # gpioid -> busid, in order of increasing gpioid
+    for gpioid, busname in enumerate(pinout.split(",")):
+        if m := re.fullmatch(r"AD?(\d+)", busname):
+            busids[gpioid] = int(m.group(1))
+    ad_gpioids = [gpioid for gpioid, busid in busids.items() if busid < 8]
+
+    data_mapping = [(busids[gpioid], i) for i, gpioid in enumerate(ad_gpioids)]
+    address_mapping = [(busid, gpioid) for gpioid, busid in busids.items()]
+
+    code = "namespace reference {\n"
+    code += generate_permutation_function(
+        "pin_map_data", "uint8_t", data_mapping
+    )
+    code += generate_permutation_function(
+        "pin_map_data_inverse",
+        "uint8_t",
+        [(dst, src) for src, dst in data_mapping],
+    )
+    code += generate_permutation_function(
+        "pin_map_address", "uint16_t", address_mapping
+    )
+    code += generate_permutation_function(
+        "pin_map_address_inverse",
+        "uint16_t",
+        [(dst, src) for src, dst in address_mapping],
+    )
+    code += "}\n"
+    return code
+
+
+# Returns the generate-pin-map.py options that the given pinout needs, which are
+# the same that CMakeLists.txt passes for it.
+def generator_options(pinout: str) -> list[str]:
+    busnames = pinout.split(",")
+    options = []
+    if "BUSEN" in busnames:
+        options.append("--with-bus-switch")
+    if "NOPEN" in busnames:
+        options.append("--parking-mechanism=NOP")
+    if "RST" in busnames:
+        options.append("--parking-mechanism=RST")
+    if "WR" in busnames:
+        options.append("--with-ram-controls")
+    return options
+
+
+def check_pinout(pinout: str, cxx: list[str], workdir: Path) -> bool:
+    (workdir / "pico").mkdir(exist_ok=True)
+    (workdir / "pico" / "types.h").write_text(PICO_TYPES_H)
+    (workdir / "reference-pin-map.h").write_text(
+        "#include <stdint.h>\n" + generate_reference(pinout)
+    )
+    (workdir / "check.cpp").write_text(CHECK_CPP)
+    subprocess.run(
+        [
+            sys.executable,
+            GENERATOR_PATH,
+            pinout,
+            workdir / "pin-map.h",
+            *generator_options(pinout),
+        ],
+        check=True,
+    )
+    subprocess.run(
+        [
+            *cxx,
+            "-std=c++17",
+            "-O1",
+            "-I",
+            workdir,
+            workdir / "check.cpp",
+            "-o",
+            workdir / "check",
+        ],
+        check=True,
+    )
+    return subprocess.run([workdir / "check"]).returncode == 0
+
+
+parser = argparse.ArgumentParser()
+parser.add_argument(
+    "pinouts",
+    nargs="*",
+    help="pinouts to check, in addition to those in CMakeLists.txt",
+)
+parser.add_argument(
+    "--cxx",
+    default=os.environ.get("CXX", "c++"),
+    help="host C++ compiler (default: $CXX or c++)",
+)
+parser.add_argument("--stamp", type=Path, help="file to touch on success")
+
+args = parser.parse_args()
+
+pinouts = re.findall(
+    r'set\(PINOUT "([^"$]*)"\)', CMAKELISTS_PATH.read_text()
+)
+if not pinouts:
+    exit(f"No PINOUT found in {CMAKELISTS_PATH}")
+pinouts += [pinout for pinout in args.pinouts if pinout not in pinouts]
+
+failed = False
+for pinout in pinouts:
+    with tempfile.TemporaryDirectory() as workdir:
+        if check_pinout(pinout, shlex.split(args.cxx), Path(workdir)):
+            print(f"Pin map OK: {pinout}")
+        else:
+            print(f"Pin map MISMATCH: {pinout}")
+            failed = True
+if failed:
+    exit("The generated pin map tables do not match the reference functions")
+
+if args.stamp:
+    args.stamp.touch()
@@ -1,10 +1,67 @@
 #!/usr/bin/env python3
 import argparse
+import re
 import struct
 
 BLOCK_SIZE = 0x1000
 NUM_SUPERBLOCKS = 16
 MAX_ROM_SIZE = 64 * 1024
+NVRAM_SIZE = 32 * 1024
+
+FORMAT_LOGICAL = 0
+FORMAT_PIN_ORDER = 1
+FORMAT_CONTINUATION = 2
+
+NVRAM_ENABLED = 0x01
+NVRAM_DISABLED = 0xFF
+
+# Marker for slots that hold the tail of a banked ROM stored in a previous slot.
+CONTINUATION = object()
+
+
+class PinOrder:
+    # Parses the same PINOUT strings as generate-pin-map.py, but only the AD and
+    # A lines are relevant here.
+    def __init__(self, pinout: str):
+        self.gpioids = {}
+        for gpioid, busname in enumerate(pinout.split(",")):
+            if m := re.fullmatch(r"A(D?)(\d+)", busname):
+                busid = int(m.group(2))
+                if (m.group(1) == "D") != (busid < 8) or busid > 15:
+                    raise ValueError(f"Invalid bus line {busname}")
+                self.gpioids[busid] = gpioid
+        if sorted(self.gpioids.keys()) != list(range(16)):
+            raise ValueError("Not all bus lines have been mapped")
+        if any(gpioid > 15 for gpioid in self.gpioids.values()):
+            raise ValueError("AD and A lines must be mapped to GPIO0-15")
+        self.ad_base = min(self.gpioids[busid] for busid in range(8))
+
+    # Must match PIN_MAP_SIGNATURE, as generated by generate-pin-map.py.
+    @property
+    def signature(self) -> int:
+        return sum(gpioid << (4 * busid) for busid, gpioid in self.gpioids.items())
+
+    def permute_address(self, address: int) -> int:
+        return sum(
+            1 << gpioid
+            for busid, gpioid in self.gpioids.items()
+            if address & (1 << busid)
+        )
+
+    def permute_data(self, value: int) -> int:
+        return sum(
+            1 << (self.gpioids[busid] - self.ad_base)
+            for busid in range(8)
+            if value & (1 << busid)
+        )
+
+    # Returns the MAX_ROM_SIZE bytes that the firmware will copy as-is.
+    def permute_rom(self, contents: bytes) -> bytes:
+        data_map = [self.permute_data(value) for value in range(256)]
+        result = bytearray([0xFF]) * MAX_ROM_SIZE
+        for address, value in enumerate(contents):
+            result[self.permute_address(address)] = data_map[value]
+        return bytes(result)
 
 
 def main():
@@ -33,6 +90,24 @@ def main():
         help="Wireless network password (empty string for open networks)",
     )
 
+    parser.add_argument(
+        "--pin-order",
+        metavar="PINOUT",
+        help="Store ROMs already permuted for the given pinout, so that they "
+        "load faster (copy the PINOUT value from CMakeLists.txt)",
+    )
+
+    parser.add_argument(
+        "--nvram",
+        metavar="SLOT_ID",
+        action="append",
+        default=[],
+        type=lambda value: int(value, 16),
+        help="Persist the emulated RAM while the ROM in the given slot runs "
+        "(can be repeated; requires a model in which the emulator provides the "
+        "RAM)",
+    )
+
     parser.add_argument(
         "--output",
         metavar="PATH",
@@ -60,34 +135,80 @@ def main():
         wl_psk = b""
         wl_type = 0xFF  # not configured
 
-    # Load the requested ROM files.
-    roms = []
+    if args.pin_order is not None:
+        try:
+            pin_order = PinOrder(args.pin_order)
+        except ValueError as e:
+            parser.error(f"--pin-order is invalid: {e}")
+    else:
+        pin_order = None
+
+    # Load the requested ROM files. ROMs larger than MAX_ROM_SIZE (i.e. banked
+    # ROMs) continue into the following slots, which must be left unset.
+    roms = [(None, "")] * 16
     for slot_num in range(16):
         if slot_value := getattr(args, f"slot{slot_num:X}"):
+            if roms[slot_num] is CONTINUATION:
+                exit(f"--slot{slot_num:X} overlaps with a previous banked ROM")
             path, name = slot_value
+            max_size = MAX_ROM_SIZE * (16 - slot_num)
             with open(path, "rb") as fp:
-                # Read up to MAX_ROM_SIZE+1, so we can detect if the ROM file
-                # if larger than MAX_ROM_SIZE.
-                contents = fp.read(MAX_ROM_SIZE + 1)
-            if len(contents) > MAX_ROM_SIZE:
-                exit(f"{path} cannot be larger than {MAX_ROM_SIZE} bytes")
-            roms.append((contents, name))
-        else:
-            roms.append((None, ""))
+                # Read up to max_size+1, so we can detect if the ROM file if
+                # larger than max_size.
+                contents = fp.read(max_size + 1)
+            if len(contents) > max_size:
+                exit(f"{path} cannot be larger than {max_size} bytes")
+            roms[slot_num] = (contents, name)
+            num_slots = max(1, (len(contents) + MAX_ROM_SIZE - 1) // MAX_ROM_SIZE)
+            for i in range(slot_num + 1, slot_num + num_slots):
+                roms[i] = CONTINUATION
+
+    for slot_num in args.nvram:
+        if not (0 <= slot_num < 16) or roms[slot_num] is CONTINUATION:
+            parser.error(f"--nvram {slot_num:X} is not a valid slot")
+        if roms[slot_num][0] is None:
+            parser.error(f"--nvram {slot_num:X} refers to an empty slot")
 
     # Generate the partition image.
     with open(args.output, "wb") as fp:
         # Write the first superblock.
         fp.write(struct.pack("<I", 0xFFFFFFFE))  # generation counter
-        for contents, name in roms:
+        for rom in roms:
+            if rom is CONTINUATION:
+                contents, name = None, ""
+                size_and_format = 0 | (FORMAT_CONTINUATION << 24)
+            else:
+                contents, name = rom
+                if contents is None:
+                    size_and_format = 0xFFFFFFFF
+                elif pin_order is None or len(contents) > MAX_ROM_SIZE:
+                    # Note: banked ROMs are always stored in logical order.
+                    size_and_format = len(contents) | (FORMAT_LOGICAL << 24)
+                else:
+                    size_and_format = len(contents) | (FORMAT_PIN_ORDER << 24)
             fp.write(
                 struct.pack(
                     "<I127p",
-                    0xFFFFFFFF if contents is None else len(contents),
+                    size_and_format,
                     name.encode(),  # TODO: encode nonstandard characters too
                 )
             )
         fp.write(struct.pack("<B32sx63sx", wl_type, wl_ssid, wl_psk))
+        for rom in roms:
+            if (
+                rom is CONTINUATION
+                or rom[0] is None
+                or pin_order is None
+                or len(rom[0]) > MAX_ROM_SIZE
+            ):
+                fp.write(struct.pack("<Q", 0xFFFFFFFFFFFFFFFF))
+            else:
+                fp.write(struct.pack("<Q", pin_order.signature))
+        for slot_num in range(16):
+            if slot_num in args.nvram:
+                fp.write(struct.pack("<B", NVRAM_ENABLED))
+            else:
+                fp.write(struct.pack("<B", NVRAM_DISABLED))
 
         # Ensure all the remaining superblocks are filled with 0xFF to
         # invalidate them.
@@ -95,18 +216,29 @@ def main():
         fp.write(bytes([0xFF]) * (start_pos - fp.tell()))
 
         # Store ROM contents at the corresponding locations.
-        for contents, name in roms:
-            if contents is not None:
+        for rom in roms:
+            if rom is not CONTINUATION and rom[0] is not None:
+                contents = rom[0]
+
                 # Fill the gap until start_pos with 0xFF.
                 fp.write(bytes([0xFF]) * (start_pos - fp.tell()))
 
                 # Write ROM contents.
-                fp.write(contents)
+                if pin_order is None or len(contents) > MAX_ROM_SIZE:
+                    fp.write(contents)
+                else:
+                    fp.write(pin_order.permute_rom(contents))
 
             # Each ROM slot is as big as the MAX_ROM_SIZE, even if the actual
             # ROM is smaller.
             start_pos += MAX_ROM_SIZE
 
+        # The NVRAM images follow the ROM slots. Make sure that the enabled
+        # ones start out blank, i.e. filled with 0xFF.
+        if args.nvram:
+            nvram_end_pos = start_pos + NVRAM_SIZE * (max(args.nvram) + 1)
+            fp.write(bytes([0xFF]) * (nvram_end_pos - fp.tell()))
+
 
 if __name__ == "__main__":
     main()
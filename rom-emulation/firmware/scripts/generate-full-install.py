@@ -177,12 +177,12 @@ def main():
 
     # Partition the Pico's 4 MiB flash memory with this layout:
     # - Partition Table's own header: 1 block (first block)
-    # - Partition A: 1.5 MiB minus 10 blocks
-    # - Partition B: 1.5 MiB minus 10 blocks
-    # - Partition DATA: 1 MiB + 18 blocks
+    # - Partition A: 1.25 MiB minus 18 blocks
+    # - Partition B: 1.25 MiB minus 18 blocks
+    # - Partition DATA: 1.5 MiB + 34 blocks (ROM slots + NVRAM images + patches)
     # - Workaround for errata E10: 1 block (last block, in unpartitioned space)
-    ab_size = 1536 * 1024 - 10 * BLOCK_SIZE
-    data_size = 1024 * 1024 + 18 * BLOCK_SIZE
+    ab_size = 1280 * 1024 - 18 * BLOCK_SIZE
+    data_size = 1536 * 1024 + 34 * BLOCK_SIZE
     a_start, b_start, data_start = setup_partition_table(
         ab_size=ab_size,
         data_size=data_size,
@@ -6,7 +6,8 @@ from pathlib import Path
 
 # This script takes a comma-separated ordered list of the 16 CPU-side bus line
 # names, and generates the corresponding functions to permute them to/from
-# Pico's GPIOs, in order from 0 to 15.
+# Pico's GPIOs, in order from 0 to 15. The functions are backed by lookup
+# tables, so that permuting a value only takes one or two memory loads.
 #
 # Due to limitations of the PIO programs:
 # - AD lines must be clustered next to each other
@@ -50,16 +51,61 @@ class BusLine:
         return f"{self.gpioname}<>{self.busname}"
 
 
-def generate_permutation_function(
-    func_name: str,
+def permute(inval: int, mapping: list[tuple[int, int]]) -> int:
+    outval = 0
+    for src, dst in mapping:
+        if inval & (1 << src):
+            outval |= 1 << dst
+    return outval
+
+
+def generate_lookup_table(
+    table_name: str,
     data_type: str,
+    values: list[int],
+) -> str:
+    digits = 4 if data_type == "uint16_t" else 2
+    code = f"inline constexpr {data_type} {table_name}[{len(values)}] = {{\n"
+    for i in range(0, len(values), 8):
+        row = ", ".join(f"0x{v:0{digits}x}" for v in values[i : i + 8])
+        code += f"    {row},\n"
+    code += "};\n"
+    return code
+
+
+# Generates a permutation function for 8 bits, backed by a single table.
+def generate_permutation_function_8(
+    func_name: str,
+    table_name: str,
     mapping: list[tuple[int, int]],
 ) -> str:
-    code = f"inline {data_type} {func_name}({data_type} inval) {{\n"
-    code += f"  {data_type} outval = 0;\n"
-    for src, dst in mapping:
-        code += f"  if (inval & (1 << {src})) outval |= 1 << {dst};\n"
-    code += f"  return outval;\n"
+    code = generate_lookup_table(
+        table_name, "uint8_t", [permute(i, mapping) for i in range(256)]
+    )
+    code += f"inline constexpr uint8_t {func_name}(uint8_t inval) {{\n"
+    code += f"  return {table_name}[inval];\n"
+    code += f"}}\n"
+    return code
+
+
+# Generates a permutation function for 16 bits, backed by two tables (one for
+# each half of the input value). Since every bit is mapped independently, the
+# result is obtained by combining the permutations of the two halves.
+#
+# check-pin-map.py verifies the result against the per-bit implementation.
+def generate_permutation_function_16(
+    func_name: str,
+    table_name: str,
+    mapping: list[tuple[int, int]],
+) -> str:
+    lo_values = [permute(i, mapping) for i in range(256)]
+    hi_values = [permute(i << 8, mapping) for i in range(256)]
+
+    code = generate_lookup_table(f"{table_name}_LO", "uint16_t", lo_values)
+    code += generate_lookup_table(f"{table_name}_HI", "uint16_t", hi_values)
+    code += f"inline constexpr uint16_t {func_name}(uint16_t inval) {{\n"
+    code += f"  return {table_name}_LO[inval & 0xFF] |\n"
+    code += f"         {table_name}_HI[inval >> 8];\n"
     code += f"}}\n"
     return code
 
@@ -146,25 +192,50 @@ if args.with_ram_controls:
     if ale_gpioid + 2 != wr_gpioid or ale_gpioid + 3 != rd_gpioid:
         exit("The ALE, PSEN, WR and RD lines must be consecutive")
 
+# Emit a signature that uniquely identifies the permutation: the N-th nibble is
+# the GPIO of the N-th bus line. generate-data-partition.py computes the same
+# value when storing ROMs in pin order, so that they are only ever loaded by a
+# firmware built for the same pinout.
+signature = sum(busline.gpioid << (4 * busline.busid) for busline in a_buslines)
+mappings += "inline constexpr uint64_t PIN_MAP_SIGNATURE = 0x%016x;\n" % signature
+
+data_mapping = [(busline.busid, i) for i, busline in enumerate(ad_buslines)]
+address_mapping = [(busline.busid, busline.gpioid) for busline in a_buslines]
+address_inverse_mapping = [(dst, src) for src, dst in address_mapping]
+data_inverse_mapping = [(dst, src) for src, dst in data_mapping]
+
+# Verify that the permutations and their inverses match.
+for i in range(0x10000):
+    if permute(permute(i, address_mapping), address_inverse_mapping) != i:
+        exit("The address permutation is not invertible")
+for i in range(0x100):
+    if permute(permute(i, data_mapping), data_inverse_mapping) != i:
+        exit("The data permutation is not invertible")
+
 pin_map_data = "// Permutation function for data bits.\n"
-pin_map_data += generate_permutation_function(
+pin_map_data += generate_permutation_function_8(
     "pin_map_data",
-    "uint8_t",
-    [(busline.busid, i) for i, busline in enumerate(ad_buslines)],
+    "PIN_MAP_DATA_TABLE",
+    data_mapping,
+)
+pin_map_data += generate_permutation_function_8(
+    "pin_map_data_inverse",
+    "PIN_MAP_DATA_INVERSE_TABLE",
+    data_inverse_mapping,
 )
 
 pin_map_address = "// Permutation function for address bits.\n"
 pin_map_address += "//\n"
 pin_map_address += "// Every address bit ends up at its GPIO position.\n"
-pin_map_address += generate_permutation_function(
+pin_map_address += generate_permutation_function_16(
     "pin_map_address",
-    "uint16_t",
-    [(busline.busid, busline.gpioid) for busline in a_buslines],
+    "PIN_MAP_ADDRESS_TABLE",
+    address_mapping,
 )
-pin_map_address += generate_permutation_function(
+pin_map_address += generate_permutation_function_16(
     "pin_map_address_inverse",
-    "uint16_t",
-    [(busline.gpioid, busline.busid) for busline in a_buslines],
+    "PIN_MAP_ADDRESS_INVERSE_TABLE",
+    address_inverse_mapping,
 )
 
 with args.output_path.open("wt") as fp:
@@ -5,9 +5,13 @@ import os.path
 import random
 import struct
 import serial
+import socket
 import sys
+import time
+import zipfile
 
 PROTOCOL_TCP_PORT = 3759
+SCREEN_MIRROR_TCP_PORT = 3760
 
 PACKET_MAGIC_BEGIN = 0x5CA7
 PACKET_MAGIC_END = 0x6DE1
@@ -23,10 +27,55 @@ PACKET_TYPE_EMULATOR_OTA_BEGIN = 7
 PACKET_TYPE_EMULATOR_OTA_DATA = 8
 PACKET_TYPE_EMULATOR_OTA_END = 9
 PACKET_TYPE_EMULATOR_ERASE = 10
+PACKET_TYPE_EMULATOR_CACHE_STATS = 11
+PACKET_TYPE_EMULATOR_BANK_STATS = 12
+PACKET_TYPE_EMULATOR_NVRAM_CONFIG = 13
+PACKET_TYPE_EMULATOR_NVRAM_FLUSH = 14
+PACKET_TYPE_EMULATOR_RAM_STATS = 15
+PACKET_TYPE_EMULATOR_STATS = 16
+PACKET_TYPE_EMULATOR_TIMING_STATS = 17
+PACKET_TYPE_EMULATOR_DEBUG_STATUS = 18
+PACKET_TYPE_EMULATOR_DEBUG_BREAKPOINT = 19
+PACKET_TYPE_EMULATOR_DEBUG_RESUME = 20
+PACKET_TYPE_EMULATOR_PATCH_BEGIN = 21
+PACKET_TYPE_EMULATOR_PATCH_DATA = 22
+PACKET_TYPE_EMULATOR_PATCH_END = 23
+PACKET_TYPE_EMULATOR_PATCH_REVERT = 24
+PACKET_TYPE_EMULATOR_MISSED_DEADLINES = 25
+PACKET_TYPE_EMULATOR_MAILBOX_STATS = 26
+PACKET_TYPE_EMULATOR_VREG_CONFIG = 27
+PACKET_TYPE_EMULATOR_VREG_DATA = 28
+PACKET_TYPE_EMULATOR_SCREEN_MIRROR = 29
+PACKET_TYPE_EMULATOR_MEMORY_MAP = 30
+PACKET_TYPE_EMULATOR_RUN_BEGIN = 31
+PACKET_TYPE_EMULATOR_RUN_DATA = 32
+PACKET_TYPE_EMULATOR_RUN_END = 33
+PACKET_TYPE_EMULATOR_BOOT_STATS = 34
+PACKET_TYPE_EMULATOR_WRITE_LOG_CONFIG = 35
+PACKET_TYPE_EMULATOR_WRITE_LOG_DATA = 36
+PACKET_TYPE_EMULATOR_CAPTURE_START = 37
+PACKET_TYPE_EMULATOR_CAPTURE_DATA = 38
+PACKET_TYPE_EMULATOR_TRACE_STREAM = 39
 PACKET_TYPE_REPLY_XOR_MASK = 0x80
 
 MAX_ROM_SIZE = 64 * 1024
+NUM_SLOTS = 16
 TRANSFER_STEP = 128
+SCREEN_ROWS = 25
+SCREEN_COLUMNS = 40
+MEMORY_PAGE_SIZE = 256
+NUM_MEMORY_PAGES = 256
+FIRST_RAM_PAGE = 0x80
+MEMORY_REGIONS = ["unmapped", "rom", "ro", "ram"]  # indexed by MememuRegion
+WRITE_LOG_MAX_RANGES = 16
+WRITE_LOG_MAX_ENTRIES = 127  # per WRITE_LOG_DATA reply
+CAPTURE_MAX_SAMPLES = 8192
+CAPTURE_STATE_COMPLETE = 2  # TraceCaptureState::Complete
+CAPTURE_SIGNALS = [f"AD{n}" for n in range(8)] + [f"A{n}" for n in range(8, 16)]
+CAPTURE_SIGNALS += ["ALE", "PSEN", "WR", "RD"]  # in the order of the GPIO table
+TRACE_STREAM_ABSOLUTE = 0xC0
+TRACE_STREAM_LOST = 0xC1
+TRACE_STREAM_SUSPENDED = 0xC2
 
 
 # Sends a request packet and waits for the reply.
@@ -78,10 +127,16 @@ def do_ping(serial_port: serial.Serial, args: argparse.Namespace):
 
 
 def do_trace(serial_port: serial.Serial, args: argparse.Namespace):
+    if args.stream:
+        if args.output_file is None:
+            exit("Streaming requires an output file (-o).")
+        do_trace_stream(serial_port, args.output_file)
+        return
+
     reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_TRACE, b"")
     if len(reply) == 0:
         print(
-            "No ROM addresses were accessed during the sampling interval. "
+            "No ROM addresses were accessed since the previous trace request. "
             "Is the CPU running?",
             file=sys.stderr,
         )
@@ -90,11 +145,84 @@ def do_trace(serial_port: serial.Serial, args: argparse.Namespace):
             print(f"{addr:#06x}", file=sys.stderr)
 
 
+# Saves the compressed trace stream into the given file, until interrupted.
+def do_trace_stream(serial_port: serial.Serial, output_file):
+    num_bytes = 0
+    restart = True
+    try:
+        while True:
+            reply = transfer_packet(
+                serial_port, PACKET_TYPE_EMULATOR_TRACE_STREAM, bytes([restart])
+            )
+            restart = False
+            output_file.write(reply)
+            num_bytes += len(reply)
+
+            # Do not keep the link busy if the CPU is not fetching anything.
+            if len(reply) == 0:
+                time.sleep(0.001)
+    except KeyboardInterrupt:
+        pass
+    output_file.flush()
+    print(f"Bytes received: {num_bytes}", file=sys.stderr)
+
+
+# Decodes a compressed trace stream (see trace.h) into (address, None) tuples
+# and, for each overrun, (None, number of lost addresses). Each suspension of
+# the trace is reported as (None, None).
+def decode_trace_stream(data: bytes):
+    pos = 0
+    address = 0
+    while pos < len(data):
+        code = data[pos]
+        if code < 0x80:
+            for _ in range(code + 1):
+                address = (address + 1) & 0xFFFF
+                yield address, None
+            pos += 1
+        elif code < 0xC0:
+            address = (address + (code & 0x3F) - 32) & 0xFFFF
+            yield address, None
+            pos += 1
+        elif code == TRACE_STREAM_ABSOLUTE:
+            (address,) = struct.unpack_from("<H", data, pos + 1)
+            yield address, None
+            pos += 3
+        elif code == TRACE_STREAM_LOST:
+            (num_lost,) = struct.unpack_from("<I", data, pos + 1)
+            yield None, num_lost
+            pos += 5
+        elif code == TRACE_STREAM_SUSPENDED:
+            yield None, None
+            pos += 1
+        else:
+            exit(f"Invalid trace stream record at offset {pos}.")
+
+
+def do_trace_decode(serial_port: serial.Serial, args: argparse.Namespace):
+    num_fetches = num_lost = num_suspensions = 0
+    for address, lost in decode_trace_stream(args.input_file.read()):
+        if address is not None:
+            print(f"{address:#06x}")
+            num_fetches += 1
+        elif lost is not None:
+            print(f"# {lost} addresses lost")
+            num_lost += lost
+        else:
+            print("# trace suspended")
+            num_suspensions += 1
+    print(
+        f"Addresses: {num_fetches}, lost: {num_lost}, "
+        f"suspensions: {num_suspensions}",
+        file=sys.stderr,
+    )
+
+
 def do_boot(serial_port: serial.Serial, args: argparse.Namespace):
     reply = transfer_packet(
         serial_port,
         PACKET_TYPE_EMULATOR_BOOT,
-        struct.pack("<B", args.slot),
+        struct.pack("<BB", args.slot, args.trampoline),
     )
     if reply == b"OK":
         print("Boot command succeeded.", file=sys.stderr)
@@ -109,13 +237,22 @@ def do_store(serial_port: serial.Serial, args: argparse.Namespace):
     else:
         name = os.path.basename(args.rom_file.name)
 
-    # Read ROM binary, up to MAX_ROM_SIZE+1 so we can determine if the file is
-    # too big to be a real ROM.
+    # Read ROM binary, up to max_size+1 so we can determine if the file is too
+    # big to be a real ROM. Banked ROMs, which are larger than MAX_ROM_SIZE,
+    # continue into the following slots.
+    max_size = MAX_ROM_SIZE * (NUM_SLOTS - args.slot)
     data = b""
-    while chunk := args.rom_file.read(MAX_ROM_SIZE + 1 - len(data)):
+    while chunk := args.rom_file.read(max_size + 1 - len(data)):
         data += chunk
-    if len(data) == 0 or len(data) > MAX_ROM_SIZE:
+    if len(data) == 0 or len(data) > max_size:
         exit(f"Invalid ROM size: {len(data)}")
+    if len(data) > MAX_ROM_SIZE:
+        last_slot = args.slot + (len(data) - 1) // MAX_ROM_SIZE
+        print(
+            f"Banked ROM: slots {args.slot + 1:X}-{last_slot:X} will be "
+            "overwritten too.",
+            file=sys.stderr,
+        )
 
     transfer_packet(
         serial_port,
@@ -141,7 +278,45 @@ def do_store(serial_port: serial.Serial, args: argparse.Namespace):
     print("Store command succeeded.", file=sys.stderr)
 
     if args.boot:
-        do_boot(serial_port, argparse.Namespace(slot=args.slot))
+        do_boot(serial_port, argparse.Namespace(slot=args.slot, trampoline=False))
+
+
+RUN_ERRORS = {
+    b"TOOBIG": f"ROMs larger than {MAX_ROM_SIZE} bytes cannot be run without "
+    "storing them",
+    b"BUSY": "another ROM is being booted, or (on models without RST) the menu "
+    "is not running",
+    b"TOKEN": "interrupted by another client",
+}
+
+
+def check_run_reply(reply: bytes):
+    if reply != b"OK":
+        exit(f"Run failed: {RUN_ERRORS.get(reply, reply)}.")
+
+
+def do_run(serial_port: serial.Serial, args: argparse.Namespace):
+    data = args.rom_file.read(MAX_ROM_SIZE + 1)
+    if len(data) == 0 or len(data) > MAX_ROM_SIZE:
+        exit(f"Invalid ROM size: {len(data)}")
+
+    check_run_reply(
+        transfer_packet(
+            serial_port, PACKET_TYPE_EMULATOR_RUN_BEGIN, struct.pack("<I", len(data))
+        )
+    )
+
+    for i in range(0, len(data), TRANSFER_STEP):
+        check_run_reply(
+            transfer_packet(
+                serial_port,
+                PACKET_TYPE_EMULATOR_RUN_DATA,
+                data[i : i + TRANSFER_STEP],
+            )
+        )
+
+    check_run_reply(transfer_packet(serial_port, PACKET_TYPE_EMULATOR_RUN_END, b""))
+    print("Run command succeeded.", file=sys.stderr)
 
 
 def do_erase(serial_port: serial.Serial, args: argparse.Namespace):
@@ -156,6 +331,679 @@ def do_erase(serial_port: serial.Serial, args: argparse.Namespace):
         exit("Erase command failed.")
 
 
+def do_cache_stats(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_CACHE_STATS, b"")
+    hits, misses = struct.unpack("<II", reply[:8])
+    print(f"Hits: {hits}", file=sys.stderr)
+    print(f"Misses: {misses}", file=sys.stderr)
+    if len(reply) == 8:
+        print("The target has no cache entries.", file=sys.stderr)
+    for i, slot_num in enumerate(reply[8:]):
+        if slot_num == 0xFF:
+            print(f"Entry {i}: empty", file=sys.stderr)
+        else:
+            print(f"Entry {i}: slot {slot_num:X}", file=sys.stderr)
+
+
+def do_bank_stats(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_BANK_STATS, b"")
+    if len(reply) == 0:
+        exit("Banked ROMs are not supported by the target.")
+    num_switches, last_us, max_us, current_bank = struct.unpack("<IIIB", reply)
+    print(f"Current bank: {current_bank}", file=sys.stderr)
+    print(f"Bank switches: {num_switches}", file=sys.stderr)
+    if num_switches != 0:
+        print(f"Last switch duration: {last_us} us", file=sys.stderr)
+        print(f"Max switch duration: {max_us} us", file=sys.stderr)
+
+
+def do_boot_stats(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_BOOT_STATS, b"")
+    stats = struct.unpack("<IIIIIIBIII", reply)
+    paths = [("Trampoline", stats[0:3])]
+    if stats[6]:
+        paths.append(("Reset", stats[3:6]))
+    for name, (num_boots, last_us, max_us) in paths:
+        print(f"{name} boots: {num_boots}", file=sys.stderr)
+        if num_boots != 0:
+            print(f"  Last boot duration: {last_us} us", file=sys.stderr)
+            print(f"  Max boot duration: {max_us} us", file=sys.stderr)
+    num_loads, last_us, max_us = stats[7:10]
+    print(f"ROM loads: {num_loads}", file=sys.stderr)
+    if num_loads != 0:
+        print(f"  Last load duration: {last_us} us", file=sys.stderr)
+        print(f"  Max load duration: {max_us} us", file=sys.stderr)
+
+
+def do_nvram(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(
+        serial_port,
+        PACKET_TYPE_EMULATOR_NVRAM_CONFIG,
+        struct.pack("<BB", args.slot, args.state == "on"),
+    )
+    if reply == b"OK":
+        print(
+            "NVRAM command succeeded (it will take effect at the next boot).",
+            file=sys.stderr,
+        )
+    elif reply == b"EMPTY":
+        exit("NVRAM command failed: the slot is empty.")
+    elif reply == b"NOSPACE":
+        exit(
+            "NVRAM command failed: the data partition is too small (install "
+            "rom-emulator-full-install.uf2 again to resize it)."
+        )
+    elif reply == b"NORAM":
+        exit("NVRAM command failed: the target does not emulate the RAM.")
+    else:
+        exit("NVRAM command failed.")
+
+
+def do_nvram_flush(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_NVRAM_FLUSH, b"")
+    if reply[:2] == b"OK":
+        print(f"Sectors written: {reply[2]}", file=sys.stderr)
+    elif reply == b"NORAM":
+        exit("NVRAM flush failed: the target does not emulate the RAM.")
+    else:
+        exit("NVRAM flush failed.")
+
+
+def do_memory_map(serial_port: serial.Serial, args: argparse.Namespace):
+    request = struct.pack("<B", args.slot)
+    if args.ranges:
+        regions = [0] * FIRST_RAM_PAGE + [3] * (NUM_MEMORY_PAGES - FIRST_RAM_PAGE)
+        for first_page, end_page, region in args.ranges:
+            regions[first_page:end_page] = [region] * (end_page - first_page)
+        request += bytes(regions)
+
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_MEMORY_MAP, request)
+    if reply[:2] == b"OK":
+        if not args.ranges:
+            # Print the ranges of consecutive pages with the same type.
+            start = 0
+            for page in range(1, NUM_MEMORY_PAGES + 1):
+                if page == NUM_MEMORY_PAGES or reply[2 + page] != reply[2 + start]:
+                    print(
+                        f"{start * MEMORY_PAGE_SIZE:04X}-"
+                        f"{page * MEMORY_PAGE_SIZE - 1:04X}: "
+                        f"{MEMORY_REGIONS[reply[2 + start]]}"
+                    )
+                    start = page
+        else:
+            print(
+                "Memory map command succeeded (it will take effect at the next "
+                "boot).",
+                file=sys.stderr,
+            )
+    elif reply == b"EMPTY":
+        exit("Memory map command failed: the slot is empty.")
+    elif reply == b"INVALID":
+        exit("Memory map command failed: invalid memory map.")
+    elif reply == b"UNSUPPORTED":
+        exit(
+            "Memory map command failed: read-only pages require "
+            "-DRAM_WRITE_ENGINE=core1."
+        )
+    elif reply == b"NORAM":
+        exit("Memory map command failed: the target does not emulate the RAM.")
+    else:
+        exit("Memory map command failed.")
+
+
+def do_ram_stats(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_RAM_STATS, b"")
+    if len(reply) == 0:
+        exit("The target does not emulate the RAM.")
+    max_write_cycles, sys_clk_hz, via_core1 = struct.unpack("<IIB", reply)
+    max_write_ns = max_write_cycles * 1e9 / sys_clk_hz
+    if via_core1:
+        print("RAM write engine: core 1", file=sys.stderr)
+    else:
+        print("RAM write engine: PIO+DMA (observed by core 1)", file=sys.stderr)
+    print(
+        f"Max RAM write processing time: {max_write_cycles} cycles "
+        f"({max_write_ns:.0f} ns at {sys_clk_hz / 1e6:.0f} MHz)",
+        file=sys.stderr,
+    )
+
+
+def do_stats(serial_port: serial.Serial, args: argparse.Namespace):
+    def get_stats():
+        reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_STATS, b"")
+        uptime_us, *counters, has_ram = struct.unpack("<QIIIIB", reply)
+        return uptime_us, counters, has_ram
+
+    names = ["ALE cycles", "ROM fetches", "RAM reads", "RAM writes"]
+    uptime_us, counters, has_ram = get_stats()
+    if not has_ram:
+        names = names[:2]  # The RAM is not emulated.
+
+    if args.interval is None:
+        print(f"Uptime: {uptime_us / 1e6:.1f} s", file=sys.stderr)
+        for name, value in zip(names, counters):
+            print(f"{name}: {value}", file=sys.stderr)
+        return
+
+    # Poll periodically and print the rates (the counters wrap around at 2^32).
+    print(" | ".join(f"{name + '/s':>14}" for name in names), file=sys.stderr)
+    while True:
+        time.sleep(args.interval)
+        new_uptime_us, new_counters, _ = get_stats()
+        elapsed_s = (new_uptime_us - uptime_us) / 1e6
+        rates = [
+            ((new - old) & 0xFFFFFFFF) / elapsed_s
+            for old, new, _ in zip(counters, new_counters, names)
+        ]
+        print(" | ".join(f"{rate:14.0f}" for rate in rates), file=sys.stderr)
+        uptime_us, counters = new_uptime_us, new_counters
+
+
+def do_timing_stats(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(
+        serial_port,
+        PACKET_TYPE_EMULATOR_TIMING_STATS,
+        struct.pack("<B", args.reset),
+    )
+    if len(reply) == 0:
+        exit(
+            "The target was not built with timing diagnostics "
+            "(-DTIMING_DIAGNOSTICS=ON)."
+        )
+    sys_clk_hz, resolution, num_samples, *timestamps = struct.unpack_from(
+        "<IIIIIIIII", reply
+    )
+    histogram = [count for (count,) in struct.iter_unpack("<I", reply[36:])]
+
+    def fmt(cycles: int) -> str:
+        return f"{cycles} cycles ({cycles * 1e9 / sys_clk_hz:.0f} ns)"
+
+    print(f"System clock: {sys_clk_hz / 1e6:.0f} MHz", file=sys.stderr)
+    print(f"Samples: {num_samples}", file=sys.stderr)
+    if num_samples == 0:
+        return
+
+    print("Time since the falling edge of ALE (min / max):", file=sys.stderr)
+    names = ["Data delivered by DMA", "PSEN falling edge", "PSEN rising edge"]
+    for i, name in enumerate(names):
+        min_value, max_value = timestamps[2 * i : 2 * i + 2]
+        print(f"  {name}: {fmt(min_value)} / {fmt(max_value)}", file=sys.stderr)
+
+    print("Slack (from data delivered to PSEN rising edge):", file=sys.stderr)
+    max_count = max(histogram)
+    for i, count in enumerate(histogram):
+        if i != len(histogram) - 1:
+            label = f"{i * resolution:>4}-{(i + 1) * resolution - 1:<4}"
+        else:
+            label = f"{i * resolution:>4}+   "
+        bar = "#" * round(40 * count / max_count)
+        print(f"  {label} cycles: {count:>10} {bar}", file=sys.stderr)
+
+
+DEBUG_STATES = ["running", "stopping", "stopped"]
+
+
+def get_debug_status(serial_port: serial.Serial):
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_DEBUG_STATUS, b"")
+    state, num_breakpoints = struct.unpack_from("<BB", reply)
+    breakpoints = struct.unpack_from(f"<{num_breakpoints}H", reply, 2)
+    registers = struct.unpack_from(
+        "<HHBBBBB8s2s", reply, 2 + 2 * num_breakpoints
+    )
+    return DEBUG_STATES[state], breakpoints, registers
+
+
+def print_debug_registers(registers):
+    pc, dptr, a, b, psw, sp, ie, r, stack = registers
+    print(
+        f"PC={pc:04X} A={a:02X} B={b:02X} PSW={psw:02X} SP={sp:02X} "
+        f"DPTR={dptr:04X} IE={ie:02X}",
+        file=sys.stderr,
+    )
+    print(
+        f"Bank {(psw >> 3) & 3}: "
+        + " ".join(f"R{i}={value:02X}" for i, value in enumerate(r)),
+        file=sys.stderr,
+    )
+    print(
+        f"Return address (if any): {stack[0]:02X}{stack[1]:02X}",
+        file=sys.stderr,
+    )
+
+
+def do_debug_status(serial_port: serial.Serial, args: argparse.Namespace):
+    state, breakpoints, registers = get_debug_status(serial_port)
+    print(f"CPU state: {state}", file=sys.stderr)
+    if len(breakpoints) == 0:
+        print("No breakpoints", file=sys.stderr)
+    for address in breakpoints:
+        print(f"Breakpoint at {address:04X}", file=sys.stderr)
+    if state == "stopped":
+        print_debug_registers(registers)
+
+
+def do_debug_breakpoint(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(
+        serial_port,
+        PACKET_TYPE_EMULATOR_DEBUG_BREAKPOINT,
+        struct.pack("<HB", args.address, args.set),
+    )
+    if reply == b"OK":
+        print("Breakpoint command succeeded.", file=sys.stderr)
+    elif reply == b"MENU":
+        exit("Breakpoint command failed: the menu is running.")
+    elif reply == b"BUSY":
+        exit(
+            "Breakpoint command failed: the virtual register is using the "
+            "trace's DMA channel."
+        )
+    else:
+        exit("Breakpoint command failed.")
+
+
+def do_debug_resume(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(
+        serial_port,
+        PACKET_TYPE_EMULATOR_DEBUG_RESUME,
+        struct.pack("<B", args.single_step),
+    )
+    if reply != b"OK":
+        exit("Resume command failed (is the CPU stopped?).")
+    if not args.single_step:
+        print("Resumed.", file=sys.stderr)
+        return
+
+    # Wait for the CPU to stop again.
+    deadline = time.monotonic() + 5
+    while time.monotonic() < deadline:
+        state, _, registers = get_debug_status(serial_port)
+        if state == "stopped":
+            print_debug_registers(registers)
+            return
+        time.sleep(0.1)
+    exit("The CPU did not stop after the step.")
+
+
+PATCH_ERRORS = {
+    b"MENU": "the menu is running",
+    b"BANKED": "banked ROMs cannot be patched",
+    b"NOSLOT": "ROMs loaded with the run command cannot store patches",
+    b"NOSPACE": "the data partition has no room for patches (reinstall)",
+    b"TOOBIG": "patches larger than 4096 bytes cannot be stored",
+    b"MALFORMED": "invalid or truncated patch",
+    b"TOOMANY": "the patch changes too many bytes",
+    b"CHECKSUM": "the running ROM or the result do not match the patch",
+    b"TOKEN": "interrupted by another client",
+}
+
+
+def check_patch_reply(reply: bytes):
+    if not reply.startswith(b"OK"):
+        exit(f"Patch failed: {PATCH_ERRORS.get(reply, reply)}.")
+
+
+def do_patch(serial_port: serial.Serial, args: argparse.Namespace):
+    data = args.patch_file.read()
+    if not data.startswith(b"PATCH") and not data.startswith(b"BPS1"):
+        exit("Not an IPS or BPS patch.")
+
+    check_patch_reply(
+        transfer_packet(
+            serial_port,
+            PACKET_TYPE_EMULATOR_PATCH_BEGIN,
+            struct.pack("<IB", len(data), args.store),
+        )
+    )
+
+    for i in range(0, len(data), TRANSFER_STEP):
+        check_patch_reply(
+            transfer_packet(
+                serial_port,
+                PACKET_TYPE_EMULATOR_PATCH_DATA,
+                data[i : i + TRANSFER_STEP],
+            )
+        )
+
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_PATCH_END, b"")
+    check_patch_reply(reply)
+    (num_changes,) = struct.unpack("<I", reply[2:])
+    print(f"Patch applied: {num_changes} bytes changed.", file=sys.stderr)
+
+
+def do_patch_revert(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_PATCH_REVERT, b"")
+    check_patch_reply(reply)
+    (num_changes,) = struct.unpack("<I", reply[2:])
+    print(f"Patch reverted: {num_changes} bytes restored.", file=sys.stderr)
+
+
+def do_missed_deadlines(serial_port: serial.Serial, args: argparse.Namespace):
+    reply = transfer_packet(
+        serial_port, PACKET_TYPE_EMULATOR_MISSED_DEADLINES, b""
+    )
+    (count,) = struct.unpack_from("<I", reply)
+    addresses = [address for (address,) in struct.iter_unpack("<H", reply[4:])]
+
+    print(f"Missed deadlines: {count}", file=sys.stderr)
+    if len(addresses) != 0:
+        print("Most recent addresses (newest first):", file=sys.stderr)
+        print(" ".join(f"{address:04X}" for address in addresses), file=sys.stderr)
+
+
+def do_mailbox_stats(serial_port: serial.Serial, args: argparse.Namespace):
+    def get_stats():
+        reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_MAILBOX_STATS, b"")
+        uptime_us, *counters = struct.unpack_from("<QII", reply)
+        is_open = None
+        if len(reply) > 16:  # Otherwise, the mailbox is not supported.
+            *mailbox_counters, is_open = struct.unpack_from("<IIB", reply, 16)
+            counters += mailbox_counters
+        return uptime_us, counters, is_open
+
+    names = ["Magic I/O RX", "Magic I/O TX", "Mailbox RX", "Mailbox TX"]
+    uptime_us, counters, is_open = get_stats()
+    if is_open is None:
+        names = names[:2]
+
+    if args.interval is None:
+        if is_open is not None:
+            state = "open" if is_open else "closed"
+            print(f"Mailbox: {state}", file=sys.stderr)
+        for name, value in zip(names, counters):
+            print(f"{name}: {value} bytes", file=sys.stderr)
+        return
+
+    # Poll periodically and print the rates (the counters wrap around at 2^32).
+    print(" | ".join(f"{name + ' B/s':>16}" for name in names), file=sys.stderr)
+    while True:
+        time.sleep(args.interval)
+        new_uptime_us, new_counters, _ = get_stats()
+        elapsed_s = (new_uptime_us - uptime_us) / 1e6
+        rates = [
+            ((new - old) & 0xFFFFFFFF) / elapsed_s
+            for old, new, _ in zip(counters, new_counters, names)
+        ]
+        print(" | ".join(f"{rate:16.0f}" for rate in rates), file=sys.stderr)
+        uptime_us, counters = new_uptime_us, new_counters
+
+
+def do_vreg(serial_port: serial.Serial, args: argparse.Namespace):
+    if args.address == "off":
+        enabled, address = False, 0
+    else:
+        enabled, address = True, ADDRESS(args.address)
+    reply = transfer_packet(
+        serial_port,
+        PACKET_TYPE_EMULATOR_VREG_CONFIG,
+        struct.pack("<BH", enabled, address),
+    )
+    if reply == b"OK":
+        print("Virtual register command succeeded.", file=sys.stderr)
+    elif reply == b"MENU":
+        exit("Virtual register command failed: the menu is running.")
+    elif reply == b"ADDRESS":
+        exit("Virtual register command failed: the address must be >= 8000.")
+    elif reply == b"BUSY":
+        exit(
+            "Virtual register command failed: breakpoints are set or a capture "
+            "is armed, and they need the DMA channel that it would take."
+        )
+    elif reply == b"UNSUPPORTED":
+        exit(
+            "Virtual register command failed: the target does not emulate the "
+            "RAM, or the firmware was built with timing diagnostics."
+        )
+    else:
+        exit("Virtual register command failed.")
+
+
+def do_vreg_stream(serial_port: serial.Serial, args: argparse.Namespace):
+    data = args.input_file.read() if args.input_file is not None else b""
+    pos = 0
+    try:
+        # Without an output file, stop as soon as all the input has been sent.
+        while pos < len(data) or args.output_file is not None:
+            reply = transfer_packet(
+                serial_port,
+                PACKET_TYPE_EMULATOR_VREG_DATA,
+                data[pos : pos + TRANSFER_STEP],
+            )
+            if len(reply) < 2:
+                exit("The target does not support the virtual register.")
+            (num_enqueued,) = struct.unpack_from("<H", reply)
+            pos += num_enqueued
+            if args.output_file is not None:
+                args.output_file.write(reply[2:])
+                args.output_file.flush()
+
+            # Do not keep the link busy if neither FIFO is moving.
+            if num_enqueued == 0 and len(reply) == 2:
+                time.sleep(0.01)
+    except KeyboardInterrupt:
+        pass
+    print(f"Bytes sent: {pos}", file=sys.stderr)
+
+
+# Prints the character codes of the given (code, attributes) pairs.
+def print_screen(cells: bytes):
+    for row in range(SCREEN_ROWS):
+        start = row * SCREEN_COLUMNS * 2
+        codes = cells[start : start + SCREEN_COLUMNS * 2 : 2]
+        print("".join(chr(c) if 0x20 <= c < 0x7F else " " for c in codes))
+
+
+def do_screen(serial_port: serial.Serial, args: argparse.Namespace):
+    while True:
+        reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_SCREEN_MIRROR, b"")
+        if len(reply) == 0:
+            exit(
+                "The target does not support the screen mirror (it requires the "
+                "emulated RAM and -DRAM_WRITE_ENGINE=core1)."
+            )
+        decoded, lost, unsupported = struct.unpack_from("<III", reply)
+        if args.interval is not None:
+            print("\x1b[H\x1b[2J", end="")  # clear the terminal
+        print_screen(reply[12:])
+        print(
+            f"Decoded writes: {decoded}, lost writes: {lost}, "
+            f"unsupported commands: {unsupported}",
+            file=sys.stderr,
+        )
+        if args.interval is None:
+            return
+        time.sleep(args.interval)
+
+
+def do_screen_stream(serial_port: serial.Serial, args: argparse.Namespace):
+    if args.tcp_host is None:
+        exit("The screen mirror stream is only available over TCP (-t HOST).")
+    sock = socket.create_connection((args.tcp_host, SCREEN_MIRROR_TCP_PORT))
+    stream = sock.makefile("rb")
+    cells = bytearray(SCREEN_ROWS * SCREEN_COLUMNS * 2)
+    try:
+        while kind := stream.read(1):
+            if kind == b"F":
+                cells[:] = stream.read(len(cells))
+            elif kind == b"D":
+                (count,) = struct.unpack("<H", stream.read(2))
+                changes = stream.read(4 * count)
+                for row, col, code, attributes in struct.iter_unpack("<BBBB", changes):
+                    pos = (row * SCREEN_COLUMNS + col) * 2
+                    cells[pos : pos + 2] = bytes([code, attributes])
+            else:
+                exit("Invalid screen mirror stream.")
+            print("\x1b[H\x1b[2J", end="")  # clear the terminal
+            print_screen(cells)
+            sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+
+
+def configure_write_log(serial_port: serial.Serial, ranges, timestamps: bool):
+    if len(ranges) > WRITE_LOG_MAX_RANGES:
+        exit(f"At most {WRITE_LOG_MAX_RANGES} ranges can be logged.")
+    request = struct.pack("<B", timestamps)
+    for first, last in ranges:
+        request += struct.pack("<HH", first, last)
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_WRITE_LOG_CONFIG, request)
+    if len(reply) == 0:
+        exit(
+            "The target does not support the RAM write log (it requires the "
+            "emulated RAM and -DRAM_WRITE_ENGINE=core1)."
+        )
+    elif reply != b"OK":
+        exit("RAM write log configuration failed.")
+
+
+def do_write_log(serial_port: serial.Serial, args: argparse.Namespace):
+    configure_write_log(serial_port, args.ranges, args.timestamps)
+    try:
+        last_lost = None
+        while True:
+            reply = transfer_packet(
+                serial_port, PACKET_TYPE_EMULATOR_WRITE_LOG_DATA, b""
+            )
+            (lost,) = struct.unpack_from("<I", reply)
+            if last_lost is not None and lost != last_lost:
+                increase = (lost - last_lost) & 0xFFFFFFFF  # wraps around at 2^32
+                print(f"Lost writes: {increase}", file=sys.stderr)
+            last_lost = lost
+            for cycles, address, value, discarded in struct.iter_unpack(
+                "<IHB?", reply[4:]
+            ):
+                line = f"{address:04x}={value:02x}"
+                if discarded:
+                    line += " (read-only)"
+                if args.timestamps:
+                    line = f"{cycles:10} {line}"
+                print(line)
+            sys.stdout.flush()
+
+            # Do not keep the link busy if the ring has been drained.
+            if len(reply) < 4 + WRITE_LOG_MAX_ENTRIES * 8:
+                time.sleep(args.interval)
+    except KeyboardInterrupt:
+        pass
+    configure_write_log(serial_port, [], False)
+
+
+# Returns the header of a CAPTURE_DATA reply as a dict, and the samples.
+def get_capture_data(serial_port: serial.Serial, first: int):
+    reply = transfer_packet(
+        serial_port, PACKET_TYPE_EMULATOR_CAPTURE_DATA, struct.pack("<H", first)
+    )
+    names = ["state", "stalled", "clkdiv", "num_samples", "trigger_index"]
+    header = dict(zip(names + ["sys_clk_hz"], struct.unpack_from("<B?HHHI", reply)))
+    header["pins"] = reply[12:32]
+    samples = [sample for (sample,) in struct.iter_unpack("<I", reply[32:])]
+    return header, samples
+
+
+def write_vcd(fp, names: list[str], values: list[int], rate: float, trigger: int):
+    ids = [chr(ord("!") + i) for i in range(len(names))]
+    fp.write(b"$timescale 1 ps $end\n")
+    fp.write(f"$comment trigger at sample {trigger} $end\n".encode())
+    fp.write(b"$scope module minitel $end\n")
+    for id, name in zip(ids, names):
+        fp.write(f"$var wire 1 {id} {name} $end\n".encode())
+    fp.write(b"$upscope $end\n$enddefinitions $end\n")
+    previous = None
+    for i, value in enumerate(values):
+        if value == previous:
+            continue
+        changed = ~0 if previous is None else value ^ previous
+        lines = [f"#{round(i * 1e12 / rate)}"]
+        for bit, id in enumerate(ids):
+            if (changed >> bit) & 1:
+                lines.append(f"{(value >> bit) & 1}{id}")
+        fp.write(("\n".join(lines) + "\n").encode())
+        previous = value
+    fp.write(f"#{round(len(values) * 1e12 / rate)}\n".encode())
+
+
+# Writes a session file in the format of sigrok (e.g. PulseView).
+def write_sigrok(fp, names: list[str], values: list[int], rate: float):
+    unitsize = (len(names) + 7) // 8
+    metadata = "[global]\nsigrok version=0.5.2\n\n[device 1]\ncapturefile=logic-1\n"
+    metadata += f"total probes={len(names)}\nsamplerate={round(rate)}\n"
+    metadata += "total analog=0\n"
+    for i, name in enumerate(names):
+        metadata += f"probe{i + 1}={name}\n"
+    metadata += f"unitsize={unitsize}\n"
+    with zipfile.ZipFile(fp, "w", zipfile.ZIP_DEFLATED) as zf:
+        zf.writestr("version", "2")
+        zf.writestr("metadata", metadata)
+        data = b"".join(value.to_bytes(unitsize, "little") for value in values)
+        zf.writestr("logic-1-1", data)
+
+
+def do_capture(serial_port: serial.Serial, args: argparse.Namespace):
+    num_post_samples = args.post_samples
+    if num_post_samples is None:
+        num_post_samples = CAPTURE_MAX_SAMPLES // (2 if args.trigger is not None else 1)
+    if not (2 <= num_post_samples <= CAPTURE_MAX_SAMPLES):
+        exit(f"The number of post-trigger samples must be 2-{CAPTURE_MAX_SAMPLES}.")
+    request = struct.pack(
+        "<IHBH",
+        round(args.rate),
+        num_post_samples,
+        args.trigger is not None,
+        args.trigger or 0,
+    )
+    reply = transfer_packet(serial_port, PACKET_TYPE_EMULATOR_CAPTURE_START, request)
+    if reply == b"BUSY":
+        exit("Capture failed: the virtual register is using the DMA channel.")
+    if reply != b"OK":
+        exit("Capture failed.")
+
+    # Wait for the capture to complete.
+    deadline = time.monotonic() + args.timeout
+    try:
+        while True:
+            header, _ = get_capture_data(serial_port, 0)
+            if header["state"] == CAPTURE_STATE_COMPLETE:
+                break
+            if time.monotonic() > deadline:
+                transfer_packet(serial_port, PACKET_TYPE_EMULATOR_CAPTURE_START, b"")
+                exit("Capture failed: the trigger did not fire before the timeout.")
+            time.sleep(0.1)
+    except KeyboardInterrupt:
+        transfer_packet(serial_port, PACKET_TYPE_EMULATOR_CAPTURE_START, b"")
+        exit("Capture stopped.")
+
+    samples = []
+    while len(samples) < header["num_samples"]:
+        _, chunk = get_capture_data(serial_port, len(samples))
+        samples += chunk
+
+    # Extract the bus signals from the GPIO samples.
+    names, pins = [], []
+    for name, pin in zip(CAPTURE_SIGNALS, header["pins"]):
+        if pin != 0xFF:
+            names.append(name)
+            pins.append(pin)
+    values = [
+        sum(((sample >> pin) & 1) << i for i, pin in enumerate(pins))
+        for sample in samples
+    ]
+    rate = header["sys_clk_hz"] / (4 * header["clkdiv"])
+    if args.output_file.name.endswith(".sr"):
+        write_sigrok(args.output_file, names, values, rate)
+    else:
+        write_vcd(args.output_file, names, values, rate, header["trigger_index"])
+
+    print(
+        f"Captured {len(samples)} samples at {rate / 1e6:.3f} MHz, "
+        f"trigger at sample {header['trigger_index']}.",
+        file=sys.stderr,
+    )
+    if header["stalled"]:
+        print(
+            "Warning: the DMA did not keep up, some samples were delayed.",
+            file=sys.stderr,
+        )
+
+
 def do_wl_set(serial_port: serial.Serial, args: argparse.Namespace):
     ssid = args.ssid.encode("utf-8")
     psk = args.psk.encode("utf-8")
@@ -265,13 +1113,51 @@ def SLOT(text: str) -> int:
     return value
 
 
+def ADDRESS(text: str) -> int:
+    value = int(text, 16)
+    if value < 0 or value > 0xFFFF:
+        raise ValueError
+    return value
+
+
+# Parses START-END:TYPE, where START and END are the hex addresses of the first
+# and of the last byte. Returns (first page, end page, region).
+def MEMORY_RANGE(text: str) -> tuple[int, int, int]:
+    addresses, region = text.split(":")
+    start, end = (ADDRESS(address) for address in addresses.split("-"))
+    if (
+        start % MEMORY_PAGE_SIZE != 0
+        or (end + 1) % MEMORY_PAGE_SIZE != 0
+        or start < FIRST_RAM_PAGE * MEMORY_PAGE_SIZE
+        or start > end
+    ):
+        raise ValueError
+    return (
+        start // MEMORY_PAGE_SIZE,
+        (end + 1) // MEMORY_PAGE_SIZE,
+        MEMORY_REGIONS.index(region),
+    )
+
+
+# Parses START-END, where START and END are the hex addresses of the first and of
+# the last byte, or a single ADDRESS. Returns (first, last).
+def ADDRESS_RANGE(text: str) -> tuple[int, int]:
+    first, _, last = text.partition("-")
+    first = ADDRESS(first)
+    last = ADDRESS(last) if last else first
+    if first > last:
+        raise ValueError
+    return first, last
+
+
 def main():
     parser = argparse.ArgumentParser(
         prog="rom-emulator-cli",
         description="Interact with the Minitel ROM emulator over serial port or TCP.",
     )
 
-    serial_group = parser.add_mutually_exclusive_group(required=True)
+    # Required, except for offline commands (checked after parsing).
+    serial_group = parser.add_mutually_exclusive_group()
     serial_group.add_argument(
         "-s",
         "--serial",
@@ -301,10 +1187,36 @@ def main():
 
     parser_trace = subparsers.add_parser(
         name="trace",
-        help="Prints the most recently accessed ROM addresses.",
+        help="Prints the most recently accessed ROM addresses or, with --stream, "
+        "saves all of them into a compressed file until interrupted.",
+    )
+    parser_trace.add_argument(
+        "--stream",
+        action="store_true",
+        help="stream every fetched address (see trace-decode).",
+    )
+    parser_trace.add_argument(
+        "-o",
+        "--output",
+        dest="output_file",
+        type=argparse.FileType("wb"),
+        help="file that will receive the compressed stream.",
     )
     parser_trace.set_defaults(func=do_trace)
 
+    parser_trace_decode = subparsers.add_parser(
+        name="trace-decode",
+        help="Prints the addresses saved by trace --stream, without connecting to "
+        "the ROM emulator.",
+    )
+    parser_trace_decode.add_argument(
+        "input_file",
+        metavar="INPUT",
+        type=argparse.FileType("rb"),
+        help="compressed stream file.",
+    )
+    parser_trace_decode.set_defaults(func=do_trace_decode, offline=True)
+
     parser_boot = subparsers.add_parser(
         name="boot",
         help="Starts a ROM stored in flash memory.",
@@ -316,6 +1228,12 @@ def main():
         help="ROM slot number to boot from (hex value between 0 and F).",
         required=True,
     )
+    parser_boot.add_argument(
+        "--trampoline",
+        help="on models with RST, boot through the menu's trampoline instead of "
+        "resetting the CPU (e.g. to compare the boot times).",
+        action="store_true",
+    )
     parser_boot.set_defaults(func=do_boot)
 
     parser_store = subparsers.add_parser(
@@ -352,6 +1270,23 @@ def main():
     )
     parser_store.set_defaults(func=do_store)
 
+    parser_run = subparsers.add_parser(
+        name="run",
+        help="Loads a ROM straight into the emulated memory and boots it, "
+        "without storing it into flash memory.",
+        epilog=(
+            "Note: on models without RST, the menu must be running. The ROM is "
+            "lost at the next boot."
+        ),
+    )
+    parser_run.add_argument(
+        "rom_file",
+        metavar="rom.bin",
+        type=argparse.FileType("rb"),
+        help="ROM binary file (up to 64 KiB).",
+    )
+    parser_run.set_defaults(func=do_run)
+
     parser_erase = subparsers.add_parser(
         name="erase",
         help="Deletes a ROM stored in flash memory.",
@@ -365,6 +1300,322 @@ def main():
     )
     parser_erase.set_defaults(func=do_erase)
 
+    parser_cache_stats = subparsers.add_parser(
+        name="cache-stats",
+        help="Prints the statistics of the in-memory ROM cache.",
+    )
+    parser_cache_stats.set_defaults(func=do_cache_stats)
+
+    parser_bank_stats = subparsers.add_parser(
+        name="bank-stats",
+        help="Prints the bank switch statistics of the running banked ROM.",
+    )
+    parser_bank_stats.set_defaults(func=do_bank_stats)
+
+    parser_boot_stats = subparsers.add_parser(
+        name="boot-stats",
+        help="Prints the time from the boot requests to the first instruction "
+        "fetched from the new ROM, for each boot path.",
+    )
+    parser_boot_stats.set_defaults(func=do_boot_stats)
+
+    parser_nvram = subparsers.add_parser(
+        name="nvram",
+        help="Enables or disables the persistence of the emulated RAM for a "
+        "ROM (enabling it clears the previously saved contents).",
+    )
+    parser_nvram.add_argument(
+        "-n",
+        "--slot",
+        type=SLOT,
+        help="ROM slot number (hex value between 0 and F).",
+        required=True,
+    )
+    parser_nvram.add_argument(
+        "state",
+        choices=["on", "off"],
+    )
+    parser_nvram.set_defaults(func=do_nvram)
+
+    parser_nvram_flush = subparsers.add_parser(
+        name="nvram-flush",
+        help="Immediately saves the pending changes to the emulated RAM of the "
+        "running ROM, if its NVRAM is enabled.",
+    )
+    parser_nvram_flush.set_defaults(func=do_nvram_flush)
+
+    parser_memory_map = subparsers.add_parser(
+        name="memory-map",
+        help="Shows or sets the memory map of the emulated RAM for a ROM, in "
+        "256-byte pages.",
+    )
+    parser_memory_map.add_argument(
+        "-n",
+        "--slot",
+        type=SLOT,
+        help="ROM slot number (hex value between 0 and F).",
+        required=True,
+    )
+    parser_memory_map.add_argument(
+        "ranges",
+        metavar="START-END:TYPE",
+        type=MEMORY_RANGE,
+        nargs="*",
+        help="hex address range (e.g. 8000-9FFF) and its type: ram, ro "
+        "(read-only), rom (read-only copy of the ROM) or unmapped. Unlisted "
+        "pages are ram. If omitted, the current memory map is shown.",
+    )
+    parser_memory_map.set_defaults(func=do_memory_map)
+
+    parser_ram_stats = subparsers.add_parser(
+        name="ram-stats",
+        help="Prints how long the emulator takes to process RAM writes.",
+    )
+    parser_ram_stats.set_defaults(func=do_ram_stats)
+
+    parser_stats = subparsers.add_parser(
+        name="stats",
+        help="Prints the number of bus cycles observed by the emulator.",
+    )
+    parser_stats.add_argument(
+        "-i",
+        "--interval",
+        metavar="SECONDS",
+        type=float,
+        help="keep polling at the given interval and print the rates.",
+    )
+    parser_stats.set_defaults(func=do_stats)
+
+    parser_timing_stats = subparsers.add_parser(
+        name="timing-stats",
+        help="Prints the measured timing margins of the bus (only if built "
+        "with timing diagnostics).",
+    )
+    parser_timing_stats.add_argument(
+        "-r",
+        "--reset",
+        help="reset the statistics after printing them.",
+        action="store_true",
+    )
+    parser_timing_stats.set_defaults(func=do_timing_stats)
+
+    parser_missed_deadlines = subparsers.add_parser(
+        name="missed-deadlines",
+        help="Prints how many bus cycles were served too late, and the most "
+        "recent addresses.",
+    )
+    parser_missed_deadlines.set_defaults(func=do_missed_deadlines)
+
+    parser_mailbox_stats = subparsers.add_parser(
+        name="mailbox-stats",
+        help="Prints the number of bytes transferred through magic I/O's serial "
+        "tunnel and through the mailbox.",
+    )
+    parser_mailbox_stats.add_argument(
+        "-i",
+        "--interval",
+        metavar="SECONDS",
+        type=float,
+        help="keep polling at the given interval and print the rates.",
+    )
+    parser_mailbox_stats.set_defaults(func=do_mailbox_stats)
+
+    parser_vreg = subparsers.add_parser(
+        name="vreg",
+        help="Turns a byte of the emulated RAM into a virtual data register, "
+        "backed by FIFOs, or turns it back into plain RAM.",
+    )
+    parser_vreg.add_argument(
+        "address",
+        metavar="ADDRESS|off",
+        help="RAM address (hex value, at least 8000), or off.",
+    )
+    parser_vreg.set_defaults(func=do_vreg)
+
+    parser_vreg_stream = subparsers.add_parser(
+        name="vreg-stream",
+        help="Sends data to be read from the virtual register, and receives the "
+        "data written into it.",
+    )
+    parser_vreg_stream.add_argument(
+        "-i",
+        "--input",
+        dest="input_file",
+        type=argparse.FileType("rb"),
+        help="file whose contents will be read by the Minitel CPU.",
+    )
+    parser_vreg_stream.add_argument(
+        "-o",
+        "--output",
+        dest="output_file",
+        type=argparse.FileType("wb"),
+        help="file that will receive the data written by the Minitel CPU "
+        "(keeps running until interrupted).",
+    )
+    parser_vreg_stream.set_defaults(func=do_vreg_stream)
+
+    parser_screen = subparsers.add_parser(
+        name="screen",
+        help="Prints the screen of the Minitel, as reconstructed from the "
+        "commands sent to the video chip.",
+    )
+    parser_screen.add_argument(
+        "-i",
+        "--interval",
+        metavar="SECONDS",
+        type=float,
+        help="keep refreshing it at the given interval.",
+    )
+    parser_screen.set_defaults(func=do_screen)
+
+    parser_screen_stream = subparsers.add_parser(
+        name="screen-stream",
+        help=f"Follows the screen of the Minitel through the stream served on "
+        f"TCP port {SCREEN_MIRROR_TCP_PORT} (requires -t).",
+    )
+    parser_screen_stream.set_defaults(func=do_screen_stream)
+
+    parser_write_log = subparsers.add_parser(
+        name="write-log",
+        help="Prints the writes of the Minitel CPU to the selected addresses of "
+        "the emulated RAM, until interrupted.",
+    )
+    parser_write_log.add_argument(
+        "ranges",
+        metavar="RANGE",
+        nargs="+",
+        type=ADDRESS_RANGE,
+        help="address (hex value) or START-END range (inclusive) to log.",
+    )
+    parser_write_log.add_argument(
+        "--timestamps",
+        action="store_true",
+        help="prefix each write with the cycle counter of the emulator.",
+    )
+    parser_write_log.add_argument(
+        "-i",
+        "--interval",
+        metavar="SECONDS",
+        type=float,
+        default=0.01,
+        help="polling interval once all the logged writes have been received.",
+    )
+    parser_write_log.set_defaults(func=do_write_log)
+
+    parser_capture = subparsers.add_parser(
+        name="capture",
+        help="Samples the bus signals like a logic analyzer and saves them as a VCD "
+        "file or, if OUTPUT ends in .sr, as a sigrok session.",
+    )
+    parser_capture.add_argument(
+        "-o",
+        "--output",
+        dest="output_file",
+        type=argparse.FileType("wb"),
+        required=True,
+        help="file that will receive the samples.",
+    )
+    parser_capture.add_argument(
+        "-r",
+        "--rate",
+        metavar="HZ",
+        type=float,
+        default=10e6,
+        help="sample rate (default: 10 MHz), rounded to a divisor of a quarter of "
+        "the system clock frequency.",
+    )
+    parser_capture.add_argument(
+        "--trigger",
+        metavar="ADDRESS",
+        type=ADDRESS,
+        help="hex address whose latching by ALE triggers the capture (default: "
+        "trigger immediately).",
+    )
+    parser_capture.add_argument(
+        "-n",
+        "--post-samples",
+        metavar="N",
+        type=int,
+        help=f"samples to take after the trigger, out of {CAPTURE_MAX_SAMPLES} "
+        "(default: half, or all if there is no trigger).",
+    )
+    parser_capture.add_argument(
+        "--timeout",
+        metavar="SECONDS",
+        type=float,
+        default=10,
+        help="how long to wait for the trigger (default: 10).",
+    )
+    parser_capture.set_defaults(func=do_capture)
+
+    parser_debug_status = subparsers.add_parser(
+        name="debug-status",
+        help="Prints the breakpoints and, if the CPU is stopped at one of "
+        "them, its registers.",
+    )
+    parser_debug_status.set_defaults(func=do_debug_status)
+
+    parser_debug_break = subparsers.add_parser(
+        name="debug-break",
+        help="Sets a breakpoint in the running ROM.",
+    )
+    parser_debug_break.add_argument(
+        "address",
+        type=ADDRESS,
+        help="ROM address (hex value).",
+    )
+    parser_debug_break.set_defaults(func=do_debug_breakpoint, set=True)
+
+    parser_debug_delete = subparsers.add_parser(
+        name="debug-delete",
+        help="Removes a breakpoint from the running ROM.",
+    )
+    parser_debug_delete.add_argument(
+        "address",
+        type=ADDRESS,
+        help="ROM address (hex value).",
+    )
+    parser_debug_delete.set_defaults(func=do_debug_breakpoint, set=False)
+
+    parser_debug_continue = subparsers.add_parser(
+        name="debug-continue",
+        help="Resumes the CPU stopped at a breakpoint.",
+    )
+    parser_debug_continue.set_defaults(func=do_debug_resume, single_step=False)
+
+    parser_debug_step = subparsers.add_parser(
+        name="debug-step",
+        help="Lets the CPU stopped at a breakpoint execute one instruction.",
+    )
+    parser_debug_step.set_defaults(func=do_debug_resume, single_step=True)
+
+    parser_patch = subparsers.add_parser(
+        name="patch",
+        help="Applies an IPS or BPS patch to the running ROM, reverting the "
+        "previous one, if any.",
+    )
+    parser_patch.add_argument(
+        "-s",
+        "--store",
+        help="also store it in the ROM's slot, so that it is applied at every "
+        "boot.",
+        action="store_true",
+    )
+    parser_patch.add_argument(
+        "patch_file",
+        metavar="patch.ips",
+        type=argparse.FileType("rb"),
+        help="IPS or BPS patch file.",
+    )
+    parser_patch.set_defaults(func=do_patch)
+
+    parser_patch_revert = subparsers.add_parser(
+        name="patch-revert",
+        help="Reverts the patch applied to the running ROM, and removes it from "
+        "its slot if stored.",
+    )
+    parser_patch_revert.set_defaults(func=do_patch_revert)
+
     parser_wl_set = subparsers.add_parser(
         name="wl-set",
         help="Configures and enables the wireless client interface.",
@@ -401,6 +1652,13 @@ def main():
 
     args = parser.parse_args()
 
+    # Offline commands do not need the ROM emulator.
+    if getattr(args, "offline", False):
+        args.func(None, args)
+        return
+    if args.serial is None and args.tcp_host is None:
+        parser.error("one of the arguments -s/--serial -t/--tcp-host is required")
+
     # Initialize the link to the ROM emulator.
     if args.tcp_host is not None:
         args.serial = f"socket://{args.tcp_host}:{PROTOCOL_TCP_PORT}"
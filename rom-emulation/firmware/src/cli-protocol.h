@@ -18,6 +18,35 @@ constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_OTA_BEGIN = 7;
 constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_OTA_DATA = 8;
 constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_OTA_END = 9;
 constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_ERASE = 10;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_CACHE_STATS = 11;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_BANK_STATS = 12;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_NVRAM_CONFIG = 13;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_NVRAM_FLUSH = 14;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_RAM_STATS = 15;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_STATS = 16;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_TIMING_STATS = 17;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_DEBUG_STATUS = 18;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_DEBUG_BREAKPOINT = 19;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_DEBUG_RESUME = 20;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_PATCH_BEGIN = 21;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_PATCH_DATA = 22;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_PATCH_END = 23;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_PATCH_REVERT = 24;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_MISSED_DEADLINES = 25;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_MAILBOX_STATS = 26;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_VREG_CONFIG = 27;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_VREG_DATA = 28;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_SCREEN_MIRROR = 29;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_MEMORY_MAP = 30;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_RUN_BEGIN = 31;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_RUN_DATA = 32;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_RUN_END = 33;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_BOOT_STATS = 34;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_WRITE_LOG_CONFIG = 35;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_WRITE_LOG_DATA = 36;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_CAPTURE_START = 37;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_CAPTURE_DATA = 38;
+constexpr uint8_t CLI_PACKET_TYPE_EMULATOR_TRACE_STREAM = 39;
 constexpr uint8_t CLI_PACKET_TYPE_REPLY_XOR_MASK = 0x80;
 
 constexpr uint CLI_PACKET_MAX_DATA_LENGTH = 1024;
@@ -0,0 +1,588 @@
+#include "debug-monitor.h"
+
+#include <assert.h>
+
+#include <initializer_list>
+
+#include "mememu.h"
+
+// Layout of the monitor stub: two tables of 256 bytes (see emit_report_loop),
+// followed by the code.
+static constexpr uint16_t TABLE_ADDRESS[2] = {DEBUG_MONITOR_BASE,
+                                              DEBUG_MONITOR_BASE + 0x100};
+static constexpr uint16_t CODE_ADDRESS = DEBUG_MONITOR_BASE + 0x200;
+
+// Each site (i.e. patched location) jumps to its own entry point of the stub,
+// so that the stub can tell us which one was hit. The first sites belong to the
+// breakpoints, the last two are only armed temporarily, to stop at the
+// instruction that follows the current one.
+static constexpr uint NUM_SITES = DEBUG_MONITOR_MAX_BREAKPOINTS + 2;
+static constexpr uint FIRST_TEMPORARY_SITE = DEBUG_MONITOR_MAX_BREAKPOINTS;
+static constexpr uint SITE_SIZE = 3;  // LJMP
+static constexpr uint ENTRY_POINT_SIZE = 6;
+static constexpr uint16_t COMMON_CODE_ADDRESS =
+    CODE_ADDRESS + NUM_SITES * ENTRY_POINT_SIZE;
+
+// Values sent by the stub, in order.
+enum Report : uint {
+  REPORT_R0,
+  REPORT_SITE,
+  REPORT_DPH,
+  REPORT_DPL,
+  REPORT_IE,
+  REPORT_A,
+  REPORT_STACK0,
+  REPORT_STACK1,
+  REPORT_R1,
+  REPORT_R7 = REPORT_R1 + 6,
+  REPORT_PSW,
+  REPORT_B,
+  REPORT_SP,
+  NUM_REPORTS,
+};
+
+// Number of bytes pushed by the stub before sending the value of SP.
+static constexpr uint8_t STUB_STACK_USAGE = 5;
+
+// Size of the code that restores the registers and jumps back to the program.
+static constexpr uint RESUME_CODE_SIZE = 16;
+
+// Lengths of the 8051 instructions, indexed by opcode.
+static constexpr uint8_t INSTRUCTION_LENGTHS[256] = {
+    1, 2, 3, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x00
+    3, 2, 3, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x10
+    3, 2, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x20
+    3, 2, 1, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x30
+    2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x40
+    2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x50
+    2, 2, 2, 3, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x60
+    2, 2, 2, 1, 2, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,  // 0x70
+    2, 2, 2, 1, 1, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,  // 0x80
+    3, 2, 2, 1, 2, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0x90
+    2, 2, 2, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,  // 0xA0
+    2, 2, 2, 1, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,  // 0xB0
+    2, 2, 2, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0xC0
+    2, 2, 2, 1, 1, 3, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2,  // 0xD0
+    1, 2, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0xE0
+    1, 2, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,  // 0xF0
+};
+
+struct Site {
+  bool in_use;
+  bool armed;
+  uint16_t address;
+  uint8_t original[SITE_SIZE];  // contents replaced by the LJMP
+};
+
+static Site sites[NUM_SITES];
+static bool stub_installed = false;
+static uint16_t park_address, resume_address;
+
+static DebugMonitorState state = DebugMonitorState::Running;
+static uint next_report = 0;
+static uint8_t reports[NUM_REPORTS];
+static DebugMonitorRegisters registers;
+
+// Whether to resume again, instead of stopping, when a temporary site is hit.
+static bool continue_after_step = false;
+
+static uint8_t hi(uint16_t value) { return value >> 8; }
+static uint8_t lo(uint16_t value) { return value & 0xFF; }
+
+// Returns the offset of a relative jump, whose next instruction is at `from`.
+static uint8_t rel(uint16_t from, uint16_t to) {
+  int offset = (int)to - (int)from;
+  assert(offset >= -128 && offset <= 127);
+  return (uint8_t)offset;
+}
+
+// Whether two LJMP sites (or an LJMP site and the given range) overlap.
+static bool overlaps(uint16_t site_address, uint address, uint size) {
+  return site_address < address + size && address < site_address + SITE_SIZE;
+}
+
+// Writes the given 8051 code into the emulated ROM and advances `pc`.
+static void emit(uint16_t &pc, std::initializer_list<uint8_t> code) {
+  for (uint8_t value : code) {
+    mememu_write_rom(pc++, value);
+  }
+}
+
+// Emits a loop that sends a value to us, by reading the byte at the offset of
+// the value, in the table that belongs to the report, until we set it to zero.
+// Consecutive reports alternate between the two tables, so that we can restore
+// the byte of the previous report as soon as we see the next one.
+static void emit_report_loop(uint16_t &pc, Report report,
+                             std::initializer_list<uint8_t> load_value_into_a) {
+  uint16_t table_address = TABLE_ADDRESS[report % 2];
+  emit(pc, {0x90, hi(table_address), lo(table_address)});  // MOV DPTR, #table
+  uint16_t loop_address = pc;
+  emit(pc, load_value_into_a);
+  emit(pc, {0x93});                             // MOVC A, @A+DPTR
+  emit(pc, {0x70, rel(pc + 2, loop_address)});  // JNZ loop
+}
+
+static void install_stub() {
+  for (uint16_t table_address : TABLE_ADDRESS) {
+    for (uint i = 0; i < 256; i++) {
+      mememu_write_rom(table_address + i, 1);
+    }
+  }
+
+  uint16_t pc = CODE_ADDRESS;
+  for (uint i = 0; i < NUM_SITES; i++) {
+    uint16_t next_address = pc + ENTRY_POINT_SIZE;
+    emit(pc, {0xC0, 0xE0});                                    // PUSH ACC
+    emit(pc, {0x74, (uint8_t)i});                              // MOV A, #site
+    emit(pc, {0x80, rel(next_address, COMMON_CODE_ADDRESS)});  // SJMP common
+  }
+  assert(pc == COMMON_CODE_ADDRESS);
+
+  // Save the registers that are going to be modified and disable interrupts.
+  // Note that none of the instructions of the stub alters the flags, except
+  // for the parity flag, which always reflects the value of A.
+  emit(pc, {0xC0, 0xA8,    // PUSH IE
+            0xC2, 0xAF,    // CLR EA
+            0xC0, 0x82,    // PUSH DPL
+            0xC0, 0x83,    // PUSH DPH
+            0xC0, 0xE0});  // PUSH ACC (i.e. the site number)
+
+  // Send R0, then use it to send the values saved on the stack (and the two
+  // bytes below them), then send the other registers.
+  emit_report_loop(pc, REPORT_R0, {0xE8});    // MOV A, R0
+  emit(pc, {0xA8, 0x81});                     // MOV R0, SP
+  emit_report_loop(pc, REPORT_SITE, {0xE6});  // MOV A, @R0
+  for (Report report : {REPORT_DPH, REPORT_DPL, REPORT_IE, REPORT_A,
+                        REPORT_STACK0, REPORT_STACK1}) {
+    emit(pc, {0x18});                      // DEC R0
+    emit_report_loop(pc, report, {0xE6});  // MOV A, @R0
+  }
+  for (uint n = 1; n < 8; n++) {
+    emit_report_loop(pc, (Report)(REPORT_R1 + n - 1),
+                     {(uint8_t)(0xE8 + n)});  // MOV A, Rn
+  }
+  emit_report_loop(pc, REPORT_PSW, {0xE5, 0xD0});  // MOV A, PSW
+  emit_report_loop(pc, REPORT_B, {0xE5, 0xF0});    // MOV A, B
+  emit_report_loop(pc, REPORT_SP, {0xE5, 0x81});   // MOV A, SP
+
+  // Spin until debug_monitor_resume patches the jump offset.
+  park_address = pc;
+  emit(pc, {0x80, 0xFE});  // SJMP $
+  resume_address = pc;
+  assert(resume_address + RESUME_CODE_SIZE <=
+         DEBUG_MONITOR_BASE + DEBUG_MONITOR_SIZE);
+
+  stub_installed = true;
+}
+
+// Writes the LJMP into the site's entry point. The opcode is written last and,
+// in disarm, restored first, so that the CPU never executes a partial LJMP
+// (as long as it is not executing the site itself while it changes).
+static void write_ljmp(uint site_index) {
+  const Site &site = sites[site_index];
+  uint16_t entry_point = CODE_ADDRESS + site_index * ENTRY_POINT_SIZE;
+  mememu_write_rom(site.address + 1, hi(entry_point));
+  mememu_write_rom(site.address + 2, lo(entry_point));
+  mememu_write_rom(site.address, 0x02);  // LJMP entry_point
+}
+
+static void arm(uint site_index) {
+  Site &site = sites[site_index];
+  for (uint i = 0; i < SITE_SIZE; i++) {
+    site.original[i] = mememu_read_rom(site.address + i);
+  }
+  write_ljmp(site_index);
+  site.armed = true;
+}
+
+static void disarm(uint site_index) {
+  Site &site = sites[site_index];
+  for (uint i = 0; i < SITE_SIZE; i++) {
+    mememu_write_rom(site.address + i, site.original[i]);
+  }
+  site.armed = false;
+}
+
+// Whether an LJMP can be placed at the given address.
+static bool is_valid_site_address(uint16_t address) {
+  return address <= MAX_MEM_SIZE - SITE_SIZE &&
+         !overlaps(address, DEBUG_MONITOR_BASE, DEBUG_MONITOR_SIZE);
+}
+
+// Computes the addresses of the instructions that can be executed after the
+// one at the current PC, and returns how many they are.
+static uint get_next_instructions(uint16_t next[2]) {
+  uint16_t pc = registers.pc;
+  uint8_t opcode = debug_monitor_read_rom(pc);
+  uint8_t operand1 = debug_monitor_read_rom(pc + 1);
+  uint8_t operand2 = debug_monitor_read_rom(pc + 2);
+  uint16_t fallthrough = pc + INSTRUCTION_LENGTHS[opcode];
+
+  if ((opcode & 0x1F) == 0x01 || (opcode & 0x1F) == 0x11) {  // AJMP, ACALL
+    next[0] = (fallthrough & 0xF800) | ((opcode >> 5) << 8) | operand1;
+    return 1;
+  }
+
+  switch (opcode) {
+    case 0x02:    // LJMP addr16
+    case 0x12: {  // LCALL addr16
+      next[0] = (operand1 << 8) | operand2;
+      return 1;
+    }
+    case 0x80: {  // SJMP rel
+      next[0] = fallthrough + (int8_t)operand1;
+      return 1;
+    }
+    case 0x73: {  // JMP @A+DPTR
+      next[0] = registers.dptr + registers.a;
+      return 1;
+    }
+    case 0x22:    // RET
+    case 0x32: {  // RETI
+      next[0] = (registers.stack[0] << 8) | registers.stack[1];
+      return 1;
+    }
+    case 0x40:             // JC rel
+    case 0x50:             // JNC rel
+    case 0x60:             // JZ rel
+    case 0x70:             // JNZ rel
+    case 0xD8 ... 0xDF: {  // DJNZ Rn, rel
+      next[0] = fallthrough;
+      next[1] = fallthrough + (int8_t)operand1;
+      return 2;
+    }
+    case 0x10:           // JBC bit, rel
+    case 0x20:           // JB bit, rel
+    case 0x30:           // JNB bit, rel
+    case 0xB4 ... 0xBF:  // CJNE ..., rel
+    case 0xD5: {         // DJNZ direct, rel
+      next[0] = fallthrough;
+      next[1] = fallthrough + (int8_t)operand2;
+      return 2;
+    }
+    default: {
+      next[0] = fallthrough;
+      return 1;
+    }
+  }
+}
+
+// Arms temporary sites at the given addresses, except where a breakpoint is
+// already armed. Breakpoints that overlap them are disarmed until the next
+// stop. Returns false, without arming anything, if it is not possible.
+static bool arm_temporary_sites(const uint16_t *addresses, uint count) {
+  uint16_t to_arm[2];
+  uint num_to_arm = 0;
+  for (uint i = 0; i < count; i++) {
+    bool already_armed = false;
+    for (uint j = 0; j < FIRST_TEMPORARY_SITE; j++) {
+      already_armed |= sites[j].armed && sites[j].address == addresses[i];
+    }
+    if (already_armed) {
+      continue;
+    }
+
+    if (!is_valid_site_address(addresses[i])) {
+      return false;
+    }
+    bool duplicate = false;
+    for (uint j = 0; j < num_to_arm; j++) {
+      if (to_arm[j] == addresses[i]) {
+        duplicate = true;
+      } else if (overlaps(to_arm[j], addresses[i], SITE_SIZE)) {
+        return false;  // Both cannot be armed at the same time.
+      }
+    }
+    if (!duplicate) {
+      to_arm[num_to_arm++] = addresses[i];
+    }
+  }
+
+  for (uint i = 0; i < num_to_arm; i++) {
+    for (uint j = 0; j < FIRST_TEMPORARY_SITE; j++) {
+      if (sites[j].armed && overlaps(sites[j].address, to_arm[i], SITE_SIZE)) {
+        disarm(j);
+      }
+    }
+
+    uint site_index = FIRST_TEMPORARY_SITE + i;
+    sites[site_index].in_use = true;
+    sites[site_index].address = to_arm[i];
+    arm(site_index);
+  }
+  return true;
+}
+
+static void on_stopped() {
+  uint site_index = reports[REPORT_SITE];
+  registers.pc = site_index < NUM_SITES ? sites[site_index].address : 0;
+  registers.dptr = (reports[REPORT_DPH] << 8) | reports[REPORT_DPL];
+  registers.a = reports[REPORT_A];
+  registers.b = reports[REPORT_B];
+  registers.psw = reports[REPORT_PSW];
+  registers.sp = reports[REPORT_SP] - STUB_STACK_USAGE;
+  registers.ie = reports[REPORT_IE];
+  registers.r[0] = reports[REPORT_R0];
+  for (uint n = 1; n < 8; n++) {
+    registers.r[n] = reports[REPORT_R1 + n - 1];
+  }
+  registers.stack[0] = reports[REPORT_STACK0];
+  registers.stack[1] = reports[REPORT_STACK1];
+  state = DebugMonitorState::Stopped;
+
+  // Remove the temporary sites and arm all the breakpoints again.
+  for (uint i = FIRST_TEMPORARY_SITE; i < NUM_SITES; i++) {
+    if (sites[i].armed) {
+      disarm(i);
+    }
+    sites[i].in_use = false;
+  }
+  bool is_breakpoint = false;
+  for (uint i = 0; i < FIRST_TEMPORARY_SITE; i++) {
+    if (sites[i].in_use && !sites[i].armed) {
+      arm(i);
+    }
+    is_breakpoint |= sites[i].in_use && sites[i].address == registers.pc;
+  }
+
+  // If we only stopped to arm the breakpoint that was being continued from,
+  // resume immediately.
+  bool resume = continue_after_step && !is_breakpoint;
+  continue_after_step = false;
+  if (resume) {
+    debug_monitor_resume(false);
+  }
+}
+
+void debug_monitor_reset() {
+  for (Site &site : sites) {
+    site = {};
+  }
+  stub_installed = false;
+  state = DebugMonitorState::Running;
+  next_report = 0;
+  continue_after_step = false;
+}
+
+bool debug_monitor_set_breakpoint(uint16_t address) {
+  if (!is_valid_site_address(address)) {
+    return false;
+  }
+
+  int free_index = -1;
+  for (uint i = 0; i < FIRST_TEMPORARY_SITE; i++) {
+    if (!sites[i].in_use) {
+      free_index = free_index == -1 ? i : free_index;
+    } else if (sites[i].address == address) {
+      return true;  // Already present.
+    } else if (overlaps(sites[i].address, address, SITE_SIZE)) {
+      return false;
+    }
+  }
+  if (free_index == -1) {
+    return false;
+  }
+
+  if (!stub_installed) {
+    install_stub();
+  }
+
+  sites[free_index].in_use = true;
+  sites[free_index].address = address;
+
+  // If it overlaps a temporary site, it will be armed at the next stop.
+  bool overlaps_temporary_site = false;
+  for (uint i = FIRST_TEMPORARY_SITE; i < NUM_SITES; i++) {
+    overlaps_temporary_site |=
+        sites[i].armed && overlaps(sites[i].address, address, SITE_SIZE);
+  }
+  if (!overlaps_temporary_site) {
+    arm(free_index);
+  }
+  return true;
+}
+
+bool debug_monitor_clear_breakpoint(uint16_t address) {
+  for (uint i = 0; i < FIRST_TEMPORARY_SITE; i++) {
+    if (sites[i].in_use && sites[i].address == address) {
+      if (sites[i].armed) {
+        disarm(i);
+      }
+      sites[i].in_use = false;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint debug_monitor_get_breakpoints(
+    uint16_t addresses[DEBUG_MONITOR_MAX_BREAKPOINTS]) {
+  uint count = 0;
+  for (uint i = 0; i < FIRST_TEMPORARY_SITE; i++) {
+    if (sites[i].in_use) {
+      addresses[count++] = sites[i].address;
+    }
+  }
+  return count;
+}
+
+bool debug_monitor_is_active() {
+  if (state != DebugMonitorState::Running) {
+    return true;
+  }
+  for (const Site &site : sites) {
+    if (site.in_use) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void debug_monitor_analyze_traces(const uint16_t *samples, uint num_samples) {
+  if (!stub_installed || state == DebugMonitorState::Stopped) {
+    return;
+  }
+
+  // Was there a clear single accessed location in the table of the next
+  // report? Like magic_io_analyze_traces, only act if it has been accessed at
+  // least 3 times.
+  uint16_t table_address = TABLE_ADDRESS[next_report % 2];
+  uint16_t address;
+  uint num_hits = 0;
+  for (uint i = 0; i < num_samples; i++) {
+    if (table_address <= samples[i] && samples[i] < table_address + 256) {
+      if (num_hits != 0 && address != samples[i]) {
+        return;
+      }
+
+      address = samples[i];
+      num_hits++;
+    }
+  }
+  if (num_hits < 3) {
+    return;
+  }
+
+  if (next_report == 0) {
+    // The CPU has just entered the stub: it is no longer spinning in the
+    // parking loop, which can be restored.
+    mememu_write_rom(park_address + 1, 0xFE);
+    state = DebugMonitorState::Stopping;
+  } else {
+    // The CPU is no longer reading the table of the previous report.
+    uint16_t previous_table_address = TABLE_ADDRESS[(next_report - 1) % 2];
+    mememu_write_rom(previous_table_address + reports[next_report - 1], 1);
+  }
+
+  // Acknowledge the value.
+  mememu_write_rom(address, 0);
+  reports[next_report++] = address - table_address;
+
+  if (next_report == NUM_REPORTS) {
+    on_stopped();
+  }
+}
+
+DebugMonitorState debug_monitor_get_state() { return state; }
+
+const DebugMonitorRegisters &debug_monitor_get_registers() {
+  return registers;
+}
+
+bool debug_monitor_resume(bool single_step) {
+  if (state != DebugMonitorState::Stopped) {
+    return false;
+  }
+
+  // To execute the instruction at a breakpoint, the breakpoint must be
+  // disarmed until the next instruction is reached.
+  int breakpoint_index = -1;
+  for (uint i = 0; i < FIRST_TEMPORARY_SITE; i++) {
+    if (sites[i].armed && sites[i].address == registers.pc) {
+      breakpoint_index = i;
+      disarm(i);
+    }
+  }
+
+  if (single_step || breakpoint_index != -1) {
+    uint16_t next[2];
+    uint num_next = get_next_instructions(next);
+    if (arm_temporary_sites(next, num_next)) {
+      continue_after_step = !single_step;
+    } else if (single_step) {
+      if (breakpoint_index != -1) {
+        arm(breakpoint_index);
+      }
+      return false;
+    } else {
+      // Continue anyway. The breakpoint will be armed again at the next stop.
+    }
+  }
+
+  // The CPU is spinning in the parking loop: restore the byte acknowledged by
+  // the last report, write the code that restores the registers and jumps back
+  // to the program, and finally make the parking loop jump to it.
+  uint16_t last_table_address = TABLE_ADDRESS[(NUM_REPORTS - 1) % 2];
+  mememu_write_rom(last_table_address + reports[NUM_REPORTS - 1], 1);
+
+  uint16_t pc = resume_address;
+  emit(pc, {0x75, 0x81, registers.sp});                      // MOV SP, #sp
+  emit(pc, {0x78, registers.r[0]});                          // MOV R0, #r0
+  emit(pc, {0x90, hi(registers.dptr), lo(registers.dptr)});  // MOV DPTR, #dptr
+  emit(pc, {0x74, registers.a});                             // MOV A, #a
+  emit(pc, {0x75, 0xA8, registers.ie});                      // MOV IE, #ie
+  emit(pc, {0x02, hi(registers.pc), lo(registers.pc)});      // LJMP pc
+  assert(pc == resume_address + RESUME_CODE_SIZE);
+  mememu_write_rom(park_address + 1, rel(park_address + 2, resume_address));
+
+  state = DebugMonitorState::Running;
+  next_report = 0;
+  return true;
+}
+
+uint8_t debug_monitor_read_rom(uint16_t address) {
+  for (const Site &site : sites) {
+    if (site.armed && overlaps(site.address, address, 1)) {
+      return site.original[address - site.address];
+    }
+  }
+  return mememu_read_rom(address);
+}
+
+void debug_monitor_write_rom(uint16_t address, uint8_t value) {
+  for (Site &site : sites) {
+    if (site.armed && overlaps(site.address, address, 1)) {
+      site.original[address - site.address] = value;
+      return;
+    }
+  }
+  mememu_write_rom(address, value);
+}
+
+void debug_monitor_on_rom_reloaded(uint16_t address, size_t size) {
+  if (!stub_installed) {
+    return;
+  }
+
+  // Note: this can only happen while the CPU is running the program, i.e. not
+  // in the stub.
+  if (DEBUG_MONITOR_BASE < address + size &&
+      address < DEBUG_MONITOR_BASE + DEBUG_MONITOR_SIZE) {
+    install_stub();
+  }
+
+  // Take the new original contents of the sites from the reloaded range and
+  // write the LJMPs again.
+  for (uint i = 0; i < NUM_SITES; i++) {
+    Site &site = sites[i];
+    if (site.armed && overlaps(site.address, address, size)) {
+      for (uint j = 0; j < SITE_SIZE; j++) {
+        uint offset = site.address + j;
+        if (address <= offset && offset < address + size) {
+          site.original[j] = mememu_read_rom(offset);
+        }
+      }
+      write_ljmp(i);
+    }
+  }
+}
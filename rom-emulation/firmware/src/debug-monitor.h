@@ -0,0 +1,91 @@
+#ifndef ROM_EMULATION_FIRMWARE_SRC_DEBUG_MONITOR_H
+#define ROM_EMULATION_FIRMWARE_SRC_DEBUG_MONITOR_H
+
+#include <pico/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "magic-io.h"
+
+// Breakpoints for the program running on the Minitel CPU.
+//
+// A breakpoint is armed by replacing the 3 bytes at its address in the emulated
+// ROM with an LJMP into a small monitor stub, which is written into the magic
+// range when the first breakpoint is set. The stub stops the CPU and sends the
+// values of its registers to us, one byte at a time, by repeatedly reading a
+// location (selected by the value) until we acknowledge it. The locations are
+// observed through the trace of ROM accesses. Then, it spins until we patch it
+// to resume execution, either freely or for a single instruction.
+//
+// Limitations:
+// - The ROM must not use the addresses from DEBUG_MONITOR_BASE to
+//   DEBUG_MONITOR_BASE + DEBUG_MONITOR_SIZE - 1, nor jump into the 2 bytes that
+//   follow the address of a breakpoint (e.g. as a loop target).
+// - Interrupts are disabled while the CPU is stopped, but interrupt handlers
+//   can still be entered before the breakpoint is reached.
+constexpr uint16_t DEBUG_MONITOR_BASE = MAGIC_RANGE_BASE + 0xA00;
+constexpr uint16_t DEBUG_MONITOR_SIZE = 0x300;
+constexpr uint DEBUG_MONITOR_MAX_BREAKPOINTS = 8;
+
+// Registers of the CPU when it stopped.
+struct [[gnu::packed]] DebugMonitorRegisters {
+  uint16_t pc;
+  uint16_t dptr;
+  uint8_t a, b, psw, sp, ie;
+  uint8_t r[8];      // of the register bank selected by PSW
+  uint8_t stack[2];  // at SP and SP - 1, i.e. the return address, if any
+};
+
+enum class DebugMonitorState : uint8_t {
+  Running,   // Not in the monitor stub.
+  Stopping,  // Sending the values of the registers.
+  Stopped,   // Waiting to be resumed.
+};
+
+// Forgets all the breakpoints, without touching the emulated ROM. It must be
+// called when a new ROM is loaded.
+void debug_monitor_reset();
+
+// Adds a breakpoint at the given address. Returns false if there are already
+// DEBUG_MONITOR_MAX_BREAKPOINTS, or if it is too close to another breakpoint
+// or to the monitor stub.
+bool debug_monitor_set_breakpoint(uint16_t address);
+
+// Removes the breakpoint at the given address. Returns false if not present.
+bool debug_monitor_clear_breakpoint(uint16_t address);
+
+// Returns the addresses of the current breakpoints.
+uint debug_monitor_get_breakpoints(
+    uint16_t addresses[DEBUG_MONITOR_MAX_BREAKPOINTS]);
+
+// Whether the traces must be passed to debug_monitor_analyze_traces, i.e. if
+// there are breakpoints or if the CPU is in the monitor stub.
+bool debug_monitor_is_active();
+
+// Follows the progress of the monitor stub by looking at the most recent ROM
+// accesses.
+void debug_monitor_analyze_traces(const uint16_t *samples, uint num_samples);
+
+DebugMonitorState debug_monitor_get_state();
+
+// Returns the registers of the CPU. Only valid in the Stopped state.
+const DebugMonitorRegisters &debug_monitor_get_registers();
+
+// Resumes the execution, if in the Stopped state. If `single_step` is true, it
+// stops again before the next instruction. Returns false if not stopped, or if
+// the next instruction cannot be determined for single stepping.
+bool debug_monitor_resume(bool single_step);
+
+// Returns one byte of the active emulated ROM, as it would be without the
+// breakpoints.
+uint8_t debug_monitor_read_rom(uint16_t address);
+
+// Sets one byte of the active emulated ROM. If it is covered by an armed
+// breakpoint, the change only takes effect when the breakpoint is removed.
+void debug_monitor_write_rom(uint16_t address, uint8_t value);
+
+// Must be called after reloading part of the active emulated ROM (e.g. when
+// switching ROM bank), to arm the breakpoints in it again.
+void debug_monitor_on_rom_reloaded(uint16_t address, size_t size);
+
+#endif
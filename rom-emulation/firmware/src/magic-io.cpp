@@ -107,16 +107,9 @@ MagicIoSignal magic_io_analyze_traces(const uint16_t *samples,
     }
   }
   if (in_trampoline) {
-    // Fill the whole ROM with NOPs.
-    for (uint16_t i = 0; i < TRAMPOLINE_ADDRESS; i++) {
-      mememu_write_rom(i, 0x00);
-    }
-    // Override the SJMP target address first.
-    mememu_write_rom(TRAMPOLINE_ADDRESS + 1, 0x00);
-    sleep_us(200);
-    // Then the opcode.
-    mememu_write_rom(TRAMPOLINE_ADDRESS + 0, 0x00);
-    sleep_us(200);
+    // Note: there is no need to break the loop here, because
+    // mememu_switch_bank will make the CPU slide to address 0x0000 by serving
+    // NOPs.
     return MagicIoSignal::InTrampoline;
   }
 
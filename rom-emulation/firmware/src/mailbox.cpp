@@ -0,0 +1,114 @@
+#include "mailbox.h"
+
+#include <stddef.h>
+
+#include "cli-protocol.h"
+#include "mememu.h"
+
+static_assert(sizeof(MAILBOX_t) == MAILBOX_SIZE);
+static_assert(MAILBOX_BASE_ADDRESS + MAILBOX_SIZE <= MAX_MEM_SIZE);
+
+// Helper macros for manipulating the mailbox.
+#define ADDRESS_OF(field_name) \
+  (MAILBOX_BASE_ADDRESS + offsetof(MAILBOX_t, field_name))
+#define GET_FIELD(field_name) mememu_read_ram(ADDRESS_OF(field_name))
+#define SET_FIELD(field_name, new_value) \
+  mememu_write_ram(ADDRESS_OF(field_name), new_value)
+
+static bool is_open = false;
+
+// Local copies of the indices. The ones written by the Minitel CPU are only
+// refreshed when needed.
+static uint8_t tx_head, tx_tail, rx_head, rx_tail;
+
+// Bytes waiting to be moved into the Pico-to-program buffer.
+static uint8_t pending_buf[CLI_PACKET_MAX_ENCODED_LENGTH];
+static uint pending_rpos = 0, pending_cnt = 0;
+
+static MailboxCounters counters = {};
+
+// Whether the magic value is present.
+static bool has_magic() {
+  for (uint i = 0; i < sizeof(MAILBOX_t::magic); i++) {
+    if (mememu_read_ram(ADDRESS_OF(magic) + i) != (uint8_t)MAILBOX_MAGIC[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void mailbox_reset() {
+  is_open = false;
+  pending_rpos = pending_cnt = 0;
+}
+
+bool mailbox_poll() {
+  if (!has_magic()) {
+    is_open = false;
+    return false;
+  }
+
+  // The program clears the status when it (re)opens the mailbox.
+  if (!is_open || GET_FIELD(status) != MAILBOX_STATUS_READY) {
+    tx_head = tx_tail = GET_FIELD(tx_head);
+    rx_head = rx_tail = GET_FIELD(rx_tail);
+    SET_FIELD(tx_tail, tx_tail);
+    SET_FIELD(rx_head, rx_head);
+    pending_rpos = pending_cnt = 0;
+    SET_FIELD(status, MAILBOX_STATUS_READY);
+    is_open = true;
+    return true;
+  }
+
+  // Move as many queued bytes as will fit.
+  if (pending_cnt != 0) {
+    rx_tail = GET_FIELD(rx_tail);
+    uint moved = 0;
+    while (pending_cnt != 0 && (uint8_t)(rx_head + 1) != rx_tail) {
+      mememu_write_ram(ADDRESS_OF(rx_buf) + rx_head++,
+                       pending_buf[pending_rpos++]);
+      if (pending_rpos == sizeof(pending_buf)) {
+        pending_rpos = 0;
+      }
+      pending_cnt--;
+      moved++;
+    }
+
+    // Publish the new head only after the data.
+    if (moved != 0) {
+      SET_FIELD(rx_head, rx_head);
+      counters.tx_bytes += moved;
+    }
+  }
+
+  return false;
+}
+
+bool mailbox_is_open() { return is_open; }
+
+std::optional<uint8_t> mailbox_receive() {
+  if (!is_open || pending_cnt != 0) {
+    return std::nullopt;
+  }
+
+  if (tx_tail == tx_head) {
+    tx_head = GET_FIELD(tx_head);
+    if (tx_tail == tx_head) {
+      return std::nullopt;
+    }
+  }
+
+  uint8_t data = mememu_read_ram(ADDRESS_OF(tx_buf) + tx_tail++);
+  SET_FIELD(tx_tail, tx_tail);
+  counters.rx_bytes++;
+  return data;
+}
+
+void mailbox_enqueue(uint8_t data) {
+  if (pending_cnt != sizeof(pending_buf)) {
+    uint wpos = (pending_rpos + pending_cnt++) % sizeof(pending_buf);
+    pending_buf[wpos] = data;
+  }
+}
+
+MailboxCounters mailbox_get_counters() { return counters; }
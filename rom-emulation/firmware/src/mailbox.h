@@ -0,0 +1,53 @@
+#ifndef ROM_EMULATION_FIRMWARE_SRC_MAILBOX_H
+#define ROM_EMULATION_FIRMWARE_SRC_MAILBOX_H
+
+#include <pico/types.h>
+#include <stdint.h>
+
+#include <optional>
+
+#include "mailbox-definitions.h"
+
+// Pico side of the mailbox in the emulated RAM (see mailbox-definitions.h).
+//
+// The mailbox is polled, because writes into the emulated RAM cannot be
+// observed as they happen if they are performed by the PIO+DMA engine.
+//
+// These functions are only available if ROM_EMULATOR_PROVIDES_RAM is 1.
+
+// Number of bytes transferred through the mailbox since the emulator was
+// started. They wrap around at 2^32.
+struct MailboxCounters {
+  uint32_t rx_bytes;  // from the Minitel CPU to the Pico
+  uint32_t tx_bytes;  // from the Pico to the Minitel CPU
+};
+
+// Forgets the state of the mailbox, including the queued bytes. It must be
+// called when a new ROM is loaded.
+void mailbox_reset();
+
+// Detects whether the running ROM has opened (or reopened) the mailbox, and
+// moves the queued bytes into the Pico-to-program buffer. It must be called
+// frequently while a ROM is running.
+//
+// Returns true if the mailbox has just been (re)opened, i.e. if the state of
+// the protocol carried by it should be reset.
+bool mailbox_poll();
+
+// Whether the mailbox is currently open.
+bool mailbox_is_open();
+
+// Returns the next byte sent by the Minitel CPU, if any.
+//
+// In order not to overflow the queue, nothing is returned until the bytes
+// previously enqueued with mailbox_enqueue have been moved into the mailbox.
+std::optional<uint8_t> mailbox_receive();
+
+// Enqueues a byte so that it will eventually be read by the Minitel CPU. It is
+// discarded if the queue is full.
+void mailbox_enqueue(uint8_t data);
+
+// Returns the current values of the counters.
+MailboxCounters mailbox_get_counters();
+
+#endif
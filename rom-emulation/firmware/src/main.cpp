@@ -1,3 +1,5 @@
+#include <hardware/clocks.h>
+#include <hardware/dma.h>
 #include <hardware/gpio.h>
 #include <hardware/structs/busctrl.h>
 #include <pico/binary_info.h>
@@ -13,15 +15,26 @@
 #endif
 
 #include <algorithm>
+#include <iterator>
 #include <memory>
+#include <optional>
 
+#include "banked-rom-definitions.h"
 #include "cli-protocol.h"
+#include "debug-monitor.h"
 #include "embedded-rom-array.h"
 #include "led.h"
 #include "magic-io.h"
+#include "mailbox.h"
 #include "mememu.h"
+#include "nvram.h"
 #include "partition.h"
 #include "pin-map.h"
+#include "rom-cache.h"
+#include "rom-patch.h"
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+#include "screen-mirror.h"
+#endif
 #include "trace.h"
 
 bi_decl(bi_program_feature(MINITEL_MODEL_FEATURE));
@@ -38,6 +51,12 @@ static_assert(sizeof(EMBEDDED_ROM) <= MAGIC_RANGE_BASE);
 
 #if ROM_EMULATOR_HAS_RST == 1
 bi_decl(bi_1pin_with_name(PIN_RST, "RST"));
+
+// How long the CPU is kept in reset after the emulated memory is ready, at
+// power on, and at least when booting another ROM (the CPU only needs 2 machine
+// cycles).
+constexpr uint32_t RST_HOLD_US = 500;
+constexpr uint32_t RST_MIN_PULSE_US = 10;
 #endif
 
 static bool in_menu = false;
@@ -45,8 +64,13 @@ static bool can_accept_boot_command = false;
 
 constexpr uint TRACE_MAX_SAMPLES = 128;
 static uint16_t trace_buf[TRACE_MAX_SAMPLES];
+static uint32_t trace_analyzed_index;  // end of the last analyzed samples
+static uint32_t trace_sent_index;      // end of the last TRACE reply
 
 static CliProtocolDecoder magic_io_decoder;
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+static CliProtocolDecoder mailbox_decoder;
+#endif
 static CliProtocolDecoder stdio_decoder;
 static CliProtocolDecoder tcp_decoder;
 static CliProtocolEncoder encoder;
@@ -55,6 +79,90 @@ static ConfigurationPartition data_partition;
 static OtaPartition ota_partition;
 static uint selected_boot_slot_num;
 
+// Boot time statistics, reported over the client protocol: for each boot path,
+// the time from the boot request to the first fetch of the new ROM.
+struct [[gnu::packed]] BootPathStats {
+  uint32_t num_boots;
+  uint32_t last_duration_us;
+  uint32_t max_duration_us;
+};
+static struct [[gnu::packed]] {
+  BootPathStats trampoline;
+  BootPathStats reset;  // only on models with RST
+} boot_stats = {};
+static uint32_t boot_request_time;
+constexpr uint32_t BOOT_MEASURE_TIMEOUT_MS = 10;
+
+// Bulk load statistics, reported along with the boot time statistics: the
+// time taken by each mememu_load_* call that fills the emulated ROM (with the
+// embedded ROM, a slot's ROM or a banked ROM's window).
+static struct [[gnu::packed]] {
+  uint32_t num_loads;
+  uint32_t last_duration_us;
+  uint32_t max_duration_us;
+} load_stats = {};
+
+static void record_load_time(uint32_t duration) {
+  load_stats.num_loads++;
+  load_stats.last_duration_us = duration;
+  load_stats.max_duration_us = std::max(load_stats.max_duration_us, duration);
+}
+
+// Whether the running ROM was received with the RUN_* packets and streamed
+// straight into the emulated memory, without storing it. If so, it has no slot
+// and selected_boot_slot_num is meaningless.
+static bool running_rom_is_transient = false;
+
+// Maximum number of address ranges selected for the RAM write log.
+constexpr uint WRITE_LOG_MAX_RANGES = 16;
+
+// Progress of the ROM being received with the RUN_* packets.
+static uint32_t run_size, run_cursor;
+static bool run_is_pending = false;  // waiting for the trampoline
+
+// Not zeroed at boot (see mem in mememu.cpp): the constructor initializes all
+// the state, and each entry is filled with 0xFF when it is assigned a slot.
+static RomCache __uninitialized_ram(rom_cache)(data_partition);
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+// Contents of the banked ROM being run, if any (banked_rom_size == 0 if none).
+static const uint8_t *banked_rom_contents;
+static uint32_t banked_rom_size = 0;
+
+// Bank switch statistics, reported over the client protocol.
+static struct [[gnu::packed]] {
+  uint32_t num_switches;
+  uint32_t last_duration_us;
+  uint32_t max_duration_us;
+  uint8_t current_bank;
+} bank_switch_stats = {};
+
+static Nvram nvram(data_partition);
+#endif
+
+// Number of bytes transferred through magic I/O's serial tunnel, reported over
+// the client protocol for comparison with the mailbox.
+static uint32_t magic_io_rx_bytes = 0, magic_io_tx_bytes = 0;
+
+// Copies the most recent TRACE_MAX_SAMPLES addresses into trace_buf, provided
+// that they have all been traced since the previous successful call, so that
+// the same fetches are never analyzed twice.
+static bool read_new_traces() {
+  uint32_t end = trace_get_write_index();
+  if (end - trace_analyzed_index < TRACE_MAX_SAMPLES ||
+      !trace_read(end - TRACE_MAX_SAMPLES, TRACE_MAX_SAMPLES, trace_buf)) {
+    return false;
+  }
+  trace_analyzed_index = end;
+  return true;
+}
+
+// Whether the given slot contains a ROM that can be loaded. ROMs stored in pin
+// order for a different pinout are treated as if the slot was empty.
+static bool is_slot_bootable(uint slot_num) {
+  return data_partition.is_rom_loadable(slot_num, PIN_MAP_SIGNATURE);
+}
+
 #if ROM_EMULATOR_WITH_WIRELESS == 1
 static void on_status_changed(netif *) {
   if (in_menu) {
@@ -93,11 +201,193 @@ static void reload_wireless_config() {
 enum class PacketSource {
   Uninitialized,
   MagicIo,
+  Mailbox,
   Stdio,
   TcpClient,
 };
 static PacketSource write_token = PacketSource::Uninitialized;
 static PacketSource ota_token = PacketSource::Uninitialized;
+static PacketSource patch_token = PacketSource::Uninitialized;
+static PacketSource run_token = PacketSource::Uninitialized;
+
+// Copy of the patch being received, if it has to be stored into the slot of the
+// running ROM once complete.
+static bool patch_must_be_stored;
+static uint32_t patch_stored_size;
+static uint8_t patch_stored_data[ConfigurationPartition::PATCH_MAX_SIZE];
+
+static void push_patch_result(RomPatchResult result) {
+  switch (result) {
+    case RomPatchResult::Ok: {
+      encoder.push("OK", 2);
+      break;
+    }
+    case RomPatchResult::Malformed: {
+      encoder.push("MALFORMED", 9);
+      break;
+    }
+    case RomPatchResult::TooManyChanges: {
+      encoder.push("TOOMANY", 7);
+      break;
+    }
+    case RomPatchResult::WrongChecksum: {
+      encoder.push("CHECKSUM", 8);
+      break;
+    }
+  }
+}
+
+// Loads the selected ROM into the staging bank.
+static void load_rom_from_data_partition() {
+  // Breakpoints only apply to the ROM they were set in.
+  debug_monitor_reset();
+  running_rom_is_transient = false;
+
+  // Note: is_slot_bootable has already verified that the slot can be loaded.
+  record_load_time(rom_cache.load(selected_boot_slot_num, MememuBank::Staging));
+
+  // Apply the stored patch, if any. If it fails, it is reverted.
+  rom_patch_reset();
+  uint32_t patch_size = data_partition.get_patch_size(selected_boot_slot_num);
+  if (patch_size != 0) {
+    rom_patch_begin(patch_size, MememuBank::Staging);
+    rom_patch_push(data_partition.get_patch_contents(selected_boot_slot_num),
+                   patch_size);
+    rom_patch_end();
+  }
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  // The new ROM has to open the mailbox again, if it uses it.
+  mailbox_reset();
+  mailbox_decoder.reset();
+
+  // Restore the NVRAM image, if enabled. Note: this must happen before
+  // initializing the banked ROM state, which also lives in the emulated RAM.
+  nvram.begin(selected_boot_slot_num);
+
+  // Apply the stored memory map. If the RAM write engine cannot honor it, the
+  // default one is used instead.
+  MememuRegion memory_map[MEMEMU_NUM_PAGES];
+  data_partition.get_memory_map(selected_boot_slot_num, memory_map);
+  if (!mememu_set_memory_map(memory_map, MememuBank::Staging)) {
+    mememu_get_default_memory_map(memory_map);
+    mememu_set_memory_map(memory_map, MememuBank::Staging);
+  }
+
+  // If it is a banked ROM, bank 0 is now mapped. Remember where to load the
+  // other banks from.
+  const ConfigurationPartition::RomInfo &info =
+      data_partition.get_rom_info(selected_boot_slot_num);
+  banked_rom_size = 0;
+  bank_switch_stats = {};
+  if (info.size > MAX_MEM_SIZE) {
+    banked_rom_contents =
+        data_partition.get_rom_contents(selected_boot_slot_num);
+    banked_rom_size = info.size;
+    mememu_write_ram(BANKED_ROM_SELECT_ADDRESS, 0, MememuBank::Staging);
+    mememu_write_ram(BANKED_ROM_STATUS_ADDRESS, 0, MememuBank::Staging);
+    mememu_take_bank_select_request();  // discard any stale request
+  }
+#endif
+}
+
+// Whether a ROM received with the RUN_* packets can be booted now. On models
+// with RST, the CPU can be reset at any time, unless the menu is already
+// booting another ROM. Elsewhere, the menu has to be running, because only its
+// trampoline lets the CPU safely switch to another ROM.
+static bool can_run_transient_rom() {
+#if ROM_EMULATOR_HAS_RST == 1
+  return can_accept_boot_command || !in_menu;
+#else
+  return can_accept_boot_command;
+#endif
+}
+
+// Forgets the state of the previous ROM, before switching to the one received
+// with the RUN_* packets, whose contents are already in the staging bank. Since
+// it has no slot, it has no NVRAM, stored patch or memory map either.
+static void prepare_transient_rom() {
+  // Breakpoints and patches only apply to the ROM they were set in.
+  debug_monitor_reset();
+  rom_patch_reset();
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  // The new ROM has to open the mailbox again, if it uses it.
+  mailbox_reset();
+  mailbox_decoder.reset();
+
+  nvram.end();
+  banked_rom_size = 0;
+  bank_switch_stats = {};
+#endif
+
+  running_rom_is_transient = true;
+}
+
+// Loads the selected slot's ROM into the staging bank, aborting the reception
+// of the ROM being received with the RUN_* packets, if any, which uses the same
+// bank.
+static void prepare_selected_slot() {
+  run_token = PacketSource::Uninitialized;
+  mememu_clear_staging_bank();
+  load_rom_from_data_partition();
+}
+
+// Waits for the CPU to fetch the first instruction of the ROM in the active
+// bank, which has just been switched to, and adds the time elapsed since
+// boot_request_time to the given statistics.
+static void measure_boot_time(BootPathStats &stats) {
+  absolute_time_t timeout = make_timeout_time_ms(BOOT_MEASURE_TIMEOUT_MS);
+  while (!mememu_is_serving_new_bank()) {
+    if (absolute_time_diff_us(timeout, get_absolute_time()) >= 0) {
+      return;  // The CPU is not running (e.g. the Minitel is being reset).
+    }
+  }
+
+  uint32_t duration = time_us_32() - boot_request_time;
+  stats.num_boots++;
+  stats.last_duration_us = duration;
+  stats.max_duration_us = std::max(stats.max_duration_us, duration);
+}
+
+#if ROM_EMULATOR_HAS_RST == 1
+// Boots the ROM that `prepare` loads into the staging bank, keeping the CPU in
+// reset meanwhile instead of going through the trampoline.
+static void boot_with_rst(void (*prepare)()) {
+  gpio_put(PIN_RST, 1);
+  uint32_t rst_start_time = time_us_32();
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  // The old ROM is stopped now: save its pending NVRAM changes, if any.
+  nvram.flush();
+#endif
+
+  prepare();
+  mememu_switch_bank();
+  in_menu = false;
+  can_accept_boot_command = false;
+
+  while (time_us_32() - rst_start_time < RST_MIN_PULSE_US) {
+    tight_loop_contents();
+  }
+  gpio_put(PIN_RST, 0);
+
+  measure_boot_time(boot_stats.reset);
+}
+#endif
+
+// Starts booting the selected slot, which must be bootable. On models with RST,
+// the trampoline is only used if explicitly requested.
+static void boot_selected_slot(bool via_trampoline) {
+  boot_request_time = time_us_32();
+#if ROM_EMULATOR_HAS_RST == 1
+  if (!via_trampoline) {
+    boot_with_rst(prepare_selected_slot);
+    return;
+  }
+#endif
+  magic_io_set_desired_state(MAGIC_IO_DESIRED_STATE_BOOT_TRAMPOLINE);
+}
 
 static std::pair<const uint8_t *, uint> handle_packet(
     uint8_t packet_type, const void *packet_data, uint packet_length,
@@ -110,26 +400,37 @@ static std::pair<const uint8_t *, uint> handle_packet(
       return encoder.finalize();
     }
     case CLI_PACKET_TYPE_EMULATOR_TRACE: {
-      uint num_samples = trace_collect(TRACE_MAX_SAMPLES,
-                                       make_timeout_time_us(150), trace_buf);
+      // Reply with the most recent addresses traced since the previous
+      // request, as many as they fit.
+      uint16_t samples[CLI_PACKET_MAX_DATA_LENGTH / sizeof(uint16_t)];
+      uint32_t end = trace_get_write_index();
+      uint num_samples = std::min<uint32_t>(std::size(samples),
+                                            end - trace_sent_index);
+      if (!trace_read(end - num_samples, num_samples, samples)) {
+        num_samples = 0;
+      }
+      trace_sent_index = end;
+
       encoder.begin(CLI_PACKET_TYPE_EMULATOR_TRACE ^
                     CLI_PACKET_TYPE_REPLY_XOR_MASK);
-      encoder.push(trace_buf, num_samples * sizeof(uint16_t));
+      encoder.push(samples, num_samples * sizeof(uint16_t));
       return encoder.finalize();
     }
     case CLI_PACKET_TYPE_EMULATOR_BOOT: {
-      if (packet_length != 1 || *(uint8_t *)packet_data >= 16) {
+      if ((packet_length != 1 && packet_length != 2) ||
+          *(uint8_t *)packet_data >= 16) {
         return {nullptr, 0};  // Malformed request: do not reply.
       }
 
       encoder.begin(CLI_PACKET_TYPE_EMULATOR_BOOT ^
                     CLI_PACKET_TYPE_REPLY_XOR_MASK);
       selected_boot_slot_num = *(const uint8_t *)packet_data;
-      bool slot_is_present =
-          data_partition.get_rom_info(selected_boot_slot_num).is_present();
+      bool via_trampoline =
+          packet_length == 2 && ((const uint8_t *)packet_data)[1] != 0;
+      bool slot_is_present = is_slot_bootable(selected_boot_slot_num);
       if (can_accept_boot_command) {
         if (slot_is_present) {
-          magic_io_set_desired_state(MAGIC_IO_DESIRED_STATE_BOOT_TRAMPOLINE);
+          boot_selected_slot(via_trampoline);
           encoder.push("OK", 2);
         } else {
           magic_io_set_desired_state(MAGIC_IO_DESIRED_STATE_EMPTY_SLOT_ERROR);
@@ -150,6 +451,10 @@ static std::pair<const uint8_t *, uint> handle_packet(
                     CLI_PACKET_TYPE_REPLY_XOR_MASK);
       uint8_t slot_num = *(const uint8_t *)packet_data;
       const char *name = (const char *)packet_data + 1;
+      // Note: there is no need to invalidate the cache again in write_end,
+      // because the slot is not present (and, therefore, cannot be cached)
+      // until then.
+      rom_cache.invalidate(slot_num);
       data_partition.write_begin(slot_num, packet_length - 1, name);
       write_token = packet_source;
 
@@ -275,6 +580,7 @@ static std::pair<const uint8_t *, uint> handle_packet(
       write_token = packet_source;
 
       if (data_partition.get_rom_info(slot_num).is_present()) {
+        rom_cache.invalidate(slot_num);
         data_partition.erase(slot_num);
         encoder.push("OK", 2);
 
@@ -287,6 +593,620 @@ static std::pair<const uint8_t *, uint> handle_packet(
       }
       return encoder.finalize();
     }
+    case CLI_PACKET_TYPE_EMULATOR_CACHE_STATS: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_CACHE_STATS ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      uint32_t hits = rom_cache.get_hits();
+      uint32_t misses = rom_cache.get_misses();
+      encoder.push(&hits, sizeof(hits));
+      encoder.push(&misses, sizeof(misses));
+      for (uint i = 0; i < RomCache::NUM_ENTRIES; i++) {
+        encoder.push(rom_cache.get_entry_slot_num(i).value_or(0xFF));
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_BANK_STATS: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_BANK_STATS ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+      // Note: an empty reply means that banked ROMs are not supported.
+      encoder.push(&bank_switch_stats, sizeof(bank_switch_stats));
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_NVRAM_CONFIG: {
+      if (packet_length != 2 || *(uint8_t *)packet_data >= 16) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_NVRAM_CONFIG ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+      uint8_t slot_num = ((const uint8_t *)packet_data)[0];
+      bool enabled = ((const uint8_t *)packet_data)[1] != 0;
+
+      if (!data_partition.has_nvram_area()) {
+        encoder.push("NOSPACE", 7);
+      } else if (!data_partition.get_rom_info(slot_num).is_present() ||
+                 data_partition.get_rom_info(slot_num).is_continuation()) {
+        encoder.push("EMPTY", 5);
+      } else {
+        // Note: the new setting will take effect at the next boot.
+        write_token = packet_source;
+        data_partition.set_nvram_enabled(slot_num, enabled);
+        encoder.push("OK", 2);
+      }
+#else
+      encoder.push("NORAM", 5);
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_NVRAM_FLUSH: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_NVRAM_FLUSH ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+      uint8_t num_written = nvram.flush();
+      encoder.push("OK", 2);
+      encoder.push(num_written);
+#else
+      encoder.push("NORAM", 5);
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_RAM_STATS: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_RAM_STATS ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+      // Note: an empty reply means that the RAM is not emulated.
+      uint32_t max_write_cycles = mememu_get_max_ram_write_cycles();
+      uint32_t sys_clk_hz = clock_get_hz(clk_sys);
+      encoder.push(&max_write_cycles, sizeof(max_write_cycles));
+      encoder.push(&sys_clk_hz, sizeof(sys_clk_hz));
+      encoder.push(ROM_EMULATOR_RAM_WRITES_VIA_CORE1);
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_STATS: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_STATS ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      uint64_t uptime_us = time_us_64();
+      MememuBusCounters counters = mememu_get_bus_counters();
+      encoder.push(&uptime_us, sizeof(uptime_us));
+      encoder.push(&counters.ale_cycles, sizeof(counters.ale_cycles));
+      encoder.push(&counters.psen_fetches, sizeof(counters.psen_fetches));
+      encoder.push(&counters.ram_reads, sizeof(counters.ram_reads));
+      encoder.push(&counters.ram_writes, sizeof(counters.ram_writes));
+      encoder.push(ROM_EMULATOR_PROVIDES_RAM);
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_TIMING_STATS: {
+      if (packet_length != 1) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_TIMING_STATS ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+      // Note: an empty reply means that timing diagnostics are not enabled.
+      bool reset = *(const uint8_t *)packet_data != 0;
+      uint32_t sys_clk_hz = clock_get_hz(clk_sys);
+      uint32_t resolution_cycles = MEMEMU_TIMING_RESOLUTION_CYCLES;
+      const MememuTimingStats &stats = mememu_get_timing_stats();
+      encoder.push(&sys_clk_hz, sizeof(sys_clk_hz));
+      encoder.push(&resolution_cycles, sizeof(resolution_cycles));
+      encoder.push(&stats, sizeof(stats));
+      if (reset) {
+        mememu_reset_timing_stats();
+      }
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_MISSED_DEADLINES: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_MISSED_DEADLINES ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      MememuMissedDeadlines missed = mememu_get_missed_deadlines();
+      uint32_t num_logged =
+          std::min<uint32_t>(missed.count, MEMEMU_MISSED_DEADLINES_LOG_SIZE);
+      encoder.push(&missed.count, sizeof(missed.count));
+      encoder.push(missed.addresses, num_logged * sizeof(uint16_t));
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_MAILBOX_STATS: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_MAILBOX_STATS ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      uint64_t uptime_us = time_us_64();
+      encoder.push(&uptime_us, sizeof(uptime_us));
+      encoder.push(&magic_io_rx_bytes, sizeof(magic_io_rx_bytes));
+      encoder.push(&magic_io_tx_bytes, sizeof(magic_io_tx_bytes));
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+      // Note: if these are missing, the mailbox is not supported.
+      MailboxCounters counters = mailbox_get_counters();
+      encoder.push(&counters.rx_bytes, sizeof(counters.rx_bytes));
+      encoder.push(&counters.tx_bytes, sizeof(counters.tx_bytes));
+      encoder.push(mailbox_is_open());
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_VREG_CONFIG: {
+      if (packet_length != 3) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_VREG_CONFIG ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if MEMEMU_HAS_VREG == 1
+      bool enabled = ((const uint8_t *)packet_data)[0] != 0;
+      uint16_t address;
+      memcpy(&address, (const uint8_t *)packet_data + 1, sizeof(address));
+
+      if (in_menu) {
+        // The menu ROM uses the emulated RAM for its own purposes.
+        encoder.push("MENU", 4);
+      } else if (!enabled) {
+        mememu_vreg_disable();
+        encoder.push("OK", 2);
+      } else if (address < 0x8000) {
+        encoder.push("ADDRESS", 7);
+#if MEMEMU_LENDS_VREG_DMA_CHANNEL == 1
+      } else if (debug_monitor_is_active() ||
+                 trace_capture_poll().state == TraceCaptureState::Armed) {
+        // The breakpoints and the capture need the DMA channel, which the
+        // virtual register would take.
+        encoder.push("BUSY", 4);
+#endif
+      } else {
+#if MEMEMU_LENDS_VREG_DMA_CHANNEL == 1
+        trace_suspend();  // give the DMA channel back (see the main loop)
+#endif
+        mememu_vreg_enable(address);
+        encoder.push("OK", 2);
+      }
+#else
+      encoder.push("UNSUPPORTED", 11);
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_VREG_DATA: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_VREG_DATA ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if MEMEMU_HAS_VREG == 1
+      // Note: an empty reply means that the virtual register is not supported.
+      // Otherwise, the reply contains how many of the given bytes have been
+      // enqueued, followed by the bytes written by the Minitel CPU.
+      uint16_t num_enqueued =
+          mememu_vreg_enqueue((const uint8_t *)packet_data, packet_length);
+      uint8_t written[CLI_PACKET_MAX_DATA_LENGTH - sizeof(num_enqueued)];
+      size_t num_written = mememu_vreg_dequeue(written, sizeof(written));
+      encoder.push(&num_enqueued, sizeof(num_enqueued));
+      encoder.push(written, num_written);
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_SCREEN_MIRROR: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_SCREEN_MIRROR ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+      // Note: an empty reply means that the screen mirror is not supported.
+      ScreenMirrorCounters counters = screen_mirror_get_counters();
+      ScreenMirrorCell screen[SCREEN_MIRROR_ROWS][SCREEN_MIRROR_COLUMNS];
+      screen_mirror_get(screen);
+      encoder.push(&counters, sizeof(counters));
+      encoder.push(screen, sizeof(screen));
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_MEMORY_MAP: {
+      if ((packet_length != 1 && packet_length != 1 + MEMEMU_NUM_PAGES) ||
+          *(uint8_t *)packet_data >= 16) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_MEMORY_MAP ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+      uint8_t slot_num = ((const uint8_t *)packet_data)[0];
+      const uint8_t *values = (const uint8_t *)packet_data + 1;
+
+      MememuRegion regions[MEMEMU_NUM_PAGES];
+      bool valid = true, supported = true;
+      if (packet_length != 1) {
+        constexpr uint first_page =
+            ConfigurationPartition::NVRAM_BASE_ADDRESS / MEMEMU_PAGE_SIZE;
+        for (uint page = 0; page < MEMEMU_NUM_PAGES; page++) {
+          regions[page] = (MememuRegion)values[page];
+          if (values[page] > (uint8_t)MememuRegion::Ram ||
+              (page < first_page && regions[page] != MememuRegion::Unmapped)) {
+            valid = false;
+          }
+#if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+          if (regions[page] == MememuRegion::ReadOnlyRam ||
+              regions[page] == MememuRegion::Rom) {
+            supported = false;  // see mememu_set_memory_map
+          }
+#endif
+        }
+      }
+
+      if (!data_partition.get_rom_info(slot_num).is_present() ||
+          data_partition.get_rom_info(slot_num).is_continuation()) {
+        encoder.push("EMPTY", 5);
+      } else if (!valid) {
+        encoder.push("INVALID", 7);
+      } else if (!supported) {
+        encoder.push("UNSUPPORTED", 11);
+      } else if (packet_length != 1) {
+        // Note: the new memory map will take effect at the next boot.
+        write_token = packet_source;
+        data_partition.set_memory_map(slot_num, regions);
+        encoder.push("OK", 2);
+      } else {
+        data_partition.get_memory_map(slot_num, regions);
+        encoder.push("OK", 2);
+        encoder.push(regions, sizeof(regions));
+      }
+#else
+      encoder.push("NORAM", 5);
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_DEBUG_STATUS: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_DEBUG_STATUS ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      uint16_t breakpoints[DEBUG_MONITOR_MAX_BREAKPOINTS];
+      uint8_t num_breakpoints = debug_monitor_get_breakpoints(breakpoints);
+      encoder.push((uint8_t)debug_monitor_get_state());
+      encoder.push(num_breakpoints);
+      encoder.push(breakpoints, num_breakpoints * sizeof(uint16_t));
+      encoder.push(&debug_monitor_get_registers(),
+                   sizeof(DebugMonitorRegisters));
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_DEBUG_BREAKPOINT: {
+      if (packet_length != 3) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_DEBUG_BREAKPOINT ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      uint16_t address;
+      memcpy(&address, packet_data, sizeof(address));
+      bool set = ((const uint8_t *)packet_data)[2] != 0;
+
+      if (in_menu) {
+        // The menu ROM uses the magic range, which the monitor stub lives in.
+        encoder.push("MENU", 4);
+      } else if (trace_is_suspended()) {
+        // Hits are detected from the trace, which the virtual register has
+        // stopped by taking its DMA channel.
+        encoder.push("BUSY", 4);
+      } else if (set ? debug_monitor_set_breakpoint(address)
+                     : debug_monitor_clear_breakpoint(address)) {
+        encoder.push("OK", 2);
+      } else {
+        encoder.push("ERROR", 5);
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_DEBUG_RESUME: {
+      if (packet_length != 1) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_DEBUG_RESUME ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      bool single_step = *(const uint8_t *)packet_data != 0;
+      if (debug_monitor_resume(single_step)) {
+        encoder.push("OK", 2);
+      } else {
+        encoder.push("ERROR", 5);
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_PATCH_BEGIN: {
+      if (packet_length != 5) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_PATCH_BEGIN ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      uint32_t length;
+      memcpy(&length, packet_data, sizeof(length));
+      bool store = ((const uint8_t *)packet_data)[4] != 0;
+
+      if (in_menu) {
+        encoder.push("MENU", 4);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+      } else if (banked_rom_size != 0) {
+        // Bank switches would overwrite the patched bytes.
+        encoder.push("BANKED", 6);
+#endif
+      } else if (store && running_rom_is_transient) {
+        encoder.push("NOSLOT", 6);
+      } else if (store && !data_partition.has_patch_area()) {
+        encoder.push("NOSPACE", 7);
+      } else if (store && length > ConfigurationPartition::PATCH_MAX_SIZE) {
+        encoder.push("TOOBIG", 6);
+      } else {
+        rom_patch_begin(length);
+        patch_token = packet_source;
+        patch_must_be_stored = store;
+        patch_stored_size = 0;
+        encoder.push("OK", 2);
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_PATCH_DATA: {
+      if (packet_length == 0) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_PATCH_DATA ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      if (patch_token == packet_source) {
+        const uint8_t *buf = (const uint8_t *)packet_data;
+        if (patch_must_be_stored) {
+          uint32_t room = sizeof(patch_stored_data) - patch_stored_size;
+          uint32_t size = std::min<uint32_t>(packet_length, room);
+          memcpy(patch_stored_data + patch_stored_size, buf, size);
+          patch_stored_size += size;
+        }
+        push_patch_result(rom_patch_push(buf, packet_length));
+      } else {
+        encoder.push("TOKEN", 5);
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_PATCH_END: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_PATCH_END ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      if (patch_token == packet_source) {
+        RomPatchResult result = rom_patch_end();
+        if (result == RomPatchResult::Ok && patch_must_be_stored) {
+          write_token = packet_source;
+          data_partition.set_patch(selected_boot_slot_num, patch_stored_data,
+                                   patch_stored_size);
+        }
+        patch_token = PacketSource::Uninitialized;
+
+        push_patch_result(result);
+        if (result == RomPatchResult::Ok) {
+          uint32_t num_changes = rom_patch_get_num_changes();
+          encoder.push(&num_changes, sizeof(num_changes));
+        }
+      } else {
+        encoder.push("TOKEN", 5);
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_PATCH_REVERT: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_PATCH_REVERT ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      if (in_menu) {
+        encoder.push("MENU", 4);
+      } else {
+        // Also abort the patch being received, if any.
+        patch_token = PacketSource::Uninitialized;
+        uint32_t num_reverted = rom_patch_revert();
+
+        // Do not apply it again at the next boot either.
+        if (!running_rom_is_transient && data_partition.has_patch_area() &&
+            data_partition.get_patch_size(selected_boot_slot_num) != 0) {
+          write_token = packet_source;
+          data_partition.set_patch(selected_boot_slot_num, nullptr, 0);
+        }
+
+        encoder.push("OK", 2);
+        encoder.push(&num_reverted, sizeof(num_reverted));
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_RUN_BEGIN: {
+      if (packet_length != 4) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_RUN_BEGIN ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      uint32_t size;
+      memcpy(&size, packet_data, sizeof(size));
+
+      if (size > MAX_MEM_SIZE) {
+        encoder.push("TOOBIG", 6);
+      } else if (!can_run_transient_rom()) {
+        encoder.push("BUSY", 4);
+      } else {
+        // Note: nothing is written to flash. The ROM is received directly
+        // into the staging bank, which is not in use while the menu or another
+        // ROM run.
+        mememu_clear_staging_bank();
+        run_token = packet_source;
+        run_size = size;
+        run_cursor = 0;
+        encoder.push("OK", 2);
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_RUN_DATA: {
+      if (packet_length == 0) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_RUN_DATA ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      if (run_token == packet_source) {
+        const uint8_t *buf = (const uint8_t *)packet_data;
+        for (uint i = 0; i < packet_length && run_cursor < run_size; i++) {
+          mememu_write_rom(run_cursor++, buf[i], MememuBank::Staging);
+        }
+        encoder.push("OK", 2);
+      } else {
+        encoder.push("TOKEN", 5);
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_RUN_END: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_RUN_END ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      if (run_token != packet_source) {
+        encoder.push("TOKEN", 5);
+      } else if (!can_run_transient_rom()) {
+        encoder.push("BUSY", 4);
+      } else {
+        run_token = PacketSource::Uninitialized;
+        boot_request_time = time_us_32();
+#if ROM_EMULATOR_HAS_RST == 1
+        boot_with_rst(prepare_transient_rom);
+#else
+        // The bank will be switched once the CPU is in the trampoline.
+        run_is_pending = true;
+        magic_io_set_desired_state(MAGIC_IO_DESIRED_STATE_BOOT_TRAMPOLINE);
+        can_accept_boot_command = false;
+#endif
+        encoder.push("OK", 2);
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_WRITE_LOG_CONFIG: {
+      // Request: timestamps flag, followed by up to WRITE_LOG_MAX_RANGES pairs
+      // of (first, last) addresses. No ranges disable the log.
+      if (packet_length % 4 != 1 ||
+          packet_length / 4 > WRITE_LOG_MAX_RANGES) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_WRITE_LOG_CONFIG ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+      // Note: an empty reply means that the write log is not supported.
+      bool with_timestamps = ((const uint8_t *)packet_data)[0] != 0;
+      MememuAddressRange ranges[WRITE_LOG_MAX_RANGES];
+      uint num_ranges = packet_length / 4;
+      memcpy(ranges, (const uint8_t *)packet_data + 1, num_ranges * 4);
+      mememu_set_ram_write_log(ranges, num_ranges, with_timestamps);
+      encoder.push("OK", 2);
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_WRITE_LOG_DATA: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_WRITE_LOG_DATA ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+      // Note: an empty reply means that the write log is not supported.
+      MememuRamWrite writes[(CLI_PACKET_MAX_DATA_LENGTH - 4) /
+                            sizeof(MememuRamWrite)];
+      uint32_t lost = mememu_get_lost_ram_writes();
+      size_t count = mememu_take_ram_writes(writes, std::size(writes));
+      encoder.push(&lost, sizeof(lost));
+      encoder.push(writes, count * sizeof(MememuRamWrite));
+#endif
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_CAPTURE_START: {
+      // Request: sample rate (Hz), number of post-trigger samples, whether to
+      // wait for the trigger address and the trigger address itself. An empty
+      // request stops the capture instead.
+      if (packet_length == 0) {
+        trace_capture_stop();
+        encoder.begin(CLI_PACKET_TYPE_EMULATOR_CAPTURE_START ^
+                      CLI_PACKET_TYPE_REPLY_XOR_MASK);
+        encoder.push("OK", 2);
+        return encoder.finalize();
+      }
+      if (packet_length != 9) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+      const uint8_t *request = (const uint8_t *)packet_data;
+      uint32_t sample_rate;
+      uint16_t num_post_samples, address;
+      memcpy(&sample_rate, request, sizeof(sample_rate));
+      memcpy(&num_post_samples, request + 4, sizeof(num_post_samples));
+      memcpy(&address, request + 7, sizeof(address));
+      if (sample_rate == 0 || num_post_samples < 2 ||
+          num_post_samples > TRACE_CAPTURE_MAX_SAMPLES) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+
+      // Each sample takes 4 cycles of the state machine.
+      uint32_t sys_clk_hz = clock_get_hz(clk_sys);
+      uint32_t clkdiv = (sys_clk_hz / 4 + sample_rate / 2) / sample_rate;
+      clkdiv = std::clamp<uint32_t>(clkdiv, 1, 0xFFFF);
+
+      std::optional<uint16_t> trigger_address;
+      if (request[6] != 0) {
+        trigger_address = address;
+      }
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_CAPTURE_START ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      if (trace_capture_start(clkdiv, num_post_samples, trigger_address)) {
+        encoder.push("OK", 2);
+      } else {
+        encoder.push("BUSY", 4);  // the virtual register has the DMA channel
+      }
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_CAPTURE_DATA: {
+      if (packet_length != 2) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+      uint16_t first;
+      memcpy(&first, packet_data, sizeof(first));
+
+      // GPIO of each bus line (AD0-AD7, A8-A15), followed by those of ALE,
+      // PSEN, WR and RD (0xFF if not connected).
+      uint8_t pins[16 + 4];
+      for (uint i = 0; i < 16; i++) {
+        pins[i] = __builtin_ctz(pin_map_address(1 << i));
+      }
+      pins[16] = PIN_ALE;
+      pins[17] = PIN_PSEN;
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+      pins[18] = PIN_WR;
+      pins[19] = PIN_RD;
+#else
+      pins[18] = pins[19] = 0xFF;
+#endif
+
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_CAPTURE_DATA ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      TraceCaptureStatus status = trace_capture_poll();
+      uint32_t sys_clk_hz = clock_get_hz(clk_sys);
+      encoder.push(&status, sizeof(status));
+      encoder.push(&sys_clk_hz, sizeof(sys_clk_hz));
+      encoder.push(pins, sizeof(pins));
+
+      // Followed by as many samples as they fit, starting from `first`.
+      uint32_t samples[(CLI_PACKET_MAX_DATA_LENGTH - sizeof(status) -
+                        sizeof(sys_clk_hz) - sizeof(pins)) /
+                       sizeof(uint32_t)];
+      uint count = trace_capture_read(first, std::size(samples), samples);
+      encoder.push(samples, count * sizeof(uint32_t));
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_TRACE_STREAM: {
+      // Request: whether to restart the stream from the next traced address.
+      if (packet_length != 1) {
+        return {nullptr, 0};  // Malformed request: do not reply.
+      }
+      if (*(const uint8_t *)packet_data != 0) {
+        trace_stream_restart();
+      }
+
+      uint8_t stream[CLI_PACKET_MAX_DATA_LENGTH];
+      uint length = trace_stream_read(stream, sizeof(stream));
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_TRACE_STREAM ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      encoder.push(stream, length);
+      return encoder.finalize();
+    }
+    case CLI_PACKET_TYPE_EMULATOR_BOOT_STATS: {
+      encoder.begin(CLI_PACKET_TYPE_EMULATOR_BOOT_STATS ^
+                    CLI_PACKET_TYPE_REPLY_XOR_MASK);
+      encoder.push(&boot_stats, sizeof(boot_stats));
+      encoder.push((uint8_t)ROM_EMULATOR_HAS_RST);
+      encoder.push(&load_stats, sizeof(load_stats));
+      return encoder.finalize();
+    }
     default: {  // Unknown packet_type.
       return {0, 0};
     }
@@ -389,14 +1309,34 @@ err_t on_tcp_client_accepted(void *arg, tcp_pcb *pcb, err_t err) {
 }
 #endif
 
-static void load_rom_from_data_partition() {
-  const ConfigurationPartition::RomInfo &info =
-      data_partition.get_rom_info(selected_boot_slot_num);
-  const uint8_t *src = data_partition.get_rom_contents(selected_boot_slot_num);
-  for (uint32_t i = 0; i < MAX_MEM_SIZE && i < info.size; i++) {
-    mememu_write_rom(i, src[i]);
-  }
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+static void switch_rom_bank(uint8_t bank_num) {
+  uint32_t start_time = time_us_32();
+
+  // Banks that are (partially) beyond the end of the ROM are padded with 0xFF.
+  uint32_t offset = BANKED_ROM_WINDOW_SIZE * (1 + bank_num);
+  uint32_t data_size =
+      offset < banked_rom_size
+          ? std::min<uint32_t>(banked_rom_size - offset, BANKED_ROM_WINDOW_SIZE)
+          : 0;
+  record_load_time(mememu_load_rom_window(BANKED_ROM_WINDOW_BASE,
+                                          BANKED_ROM_WINDOW_SIZE,
+                                          banked_rom_contents + offset,
+                                          data_size));
+  debug_monitor_on_rom_reloaded(BANKED_ROM_WINDOW_BASE,
+                                BANKED_ROM_WINDOW_SIZE);
+
+  // Signal completion to the CPU.
+  mememu_write_ram(BANKED_ROM_STATUS_ADDRESS, bank_num);
+
+  uint32_t duration = time_us_32() - start_time;
+  bank_switch_stats.num_switches++;
+  bank_switch_stats.last_duration_us = duration;
+  bank_switch_stats.max_duration_us =
+      std::max(bank_switch_stats.max_duration_us, duration);
+  bank_switch_stats.current_bank = bank_num;
 }
+#endif
 
 int main() {
 #if ROM_EMULATOR_HAS_RST == 1
@@ -406,28 +1346,42 @@ int main() {
   gpio_set_dir(PIN_RST, GPIO_OUT);
 #endif
 
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  // Give DMA reads (that will serve the emulated ROM and RAM) and writes (that
+  // will write into the emulated RAM) priority access, so that they are never
+  // stalled.
+  busctrl_hw->priority =
+      BUSCTRL_BUS_PRIORITY_DMA_R_BITS | BUSCTRL_BUS_PRIORITY_DMA_W_BITS;
+#else
   // Give core 1 (that will write into the emulated RAM) and DMA reads (that
   // will serve the emulated ROM and RAM) priority access, so that they are
   // never stalled.
   busctrl_hw->priority =
       BUSCTRL_BUS_PRIORITY_PROC1_BITS | BUSCTRL_BUS_PRIORITY_DMA_R_BITS;
+#endif
+
+  // Run at the system clock frequency that the bus timings have been selected
+  // for.
+  set_sys_clock_khz(ROM_EMULATOR_SYS_CLK_KHZ, true);
 
   // Take over the duty of responding to PSEN requests from the SN74HCT541 to
   // ourselves.
   mememu_setup();
 
-  // Start recording requested ROM addresses. Since nothing is consuming them,
-  // the FIFO will overflow and stay that way until trace_collect is called.
-  trace_setup();
+  // Start recording requested ROM addresses into the trace ring buffer, from
+  // which the main loop reads the most recent ones without blocking.
+#if MEMEMU_LENDS_VREG_DMA_CHANNEL == 1
+  trace_setup(mememu_get_lendable_dma_channel());
+#else
+  trace_setup(dma_claim_unused_channel(true));
+#endif
 
   // Initialize the status LED.
   led_setup();
   led_set(true);
 
   // Fill the emulated ROM.
-  for (size_t i = 0; i < sizeof(EMBEDDED_ROM); i++) {
-    mememu_write_rom(i, EMBEDDED_ROM[i]);
-  }
+  record_load_time(mememu_load_rom_image(EMBEDDED_ROM, sizeof(EMBEDDED_ROM)));
 
 #if ROM_EMULATOR_IS_INTERACTIVE == 1
   // Locate and open the partitions.
@@ -442,7 +1396,7 @@ int main() {
   mememu_start();
 #if ROM_EMULATOR_HAS_RST == 1
   // Start the CPU.
-  sleep_us(500);
+  sleep_us(RST_HOLD_US);
   gpio_put(PIN_RST, 0);
 #endif
 
@@ -460,12 +1414,24 @@ int main() {
     pcb = tcp_listen(pcb);
     assert(pcb != nullptr);
     tcp_accept(pcb, on_tcp_client_accepted);
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+    screen_mirror_listen();
+#endif
   }
 #endif
 
   absolute_time_t next_toggle = get_absolute_time();
   bool led_on = true;
   while (1) {
+#if MEMEMU_LENDS_VREG_DMA_CHANNEL == 1
+    // The trace ring buffer can have the virtual register's DMA channel back as
+    // soon as the latter is disabled (including by mememu_switch_bank).
+    if (!mememu_vreg_is_enabled()) {
+      trace_resume();
+    }
+#endif
+
     // Blink at 1 Hz (if in menu) or 2 Hz (otherwise).
     absolute_time_t now = get_absolute_time();
     if (absolute_time_diff_us(next_toggle, now) >= 0) {
@@ -476,11 +1442,13 @@ int main() {
 
     // Process magic I/O protocol if running the menu ROM.
     if (in_menu) {
-      uint num_samples = trace_collect(TRACE_MAX_SAMPLES,
-                                       make_timeout_time_us(150), trace_buf);
+      // Meanwhile, preload ROMs into the cache, so that booting them will be
+      // faster.
+      rom_cache.warm_up_step();
+
       MagicIoSignal signal = MagicIoSignal::None;
-      if (num_samples == TRACE_MAX_SAMPLES) {
-        signal = magic_io_analyze_traces(trace_buf, num_samples);
+      if (read_new_traces()) {
+        signal = magic_io_analyze_traces(trace_buf, TRACE_MAX_SAMPLES);
       }
 
       switch (signal) {
@@ -491,12 +1459,14 @@ int main() {
             UserRequestedBoot15: {
           selected_boot_slot_num =
               (uint)signal - (uint)MagicIoSignal::UserRequestedBoot0;
-          bool slot_is_present =
-              data_partition.get_rom_info(selected_boot_slot_num).is_present();
+          bool slot_is_present = is_slot_bootable(selected_boot_slot_num);
           if (can_accept_boot_command) {
-            magic_io_set_desired_state(
-                slot_is_present ? MAGIC_IO_DESIRED_STATE_BOOT_TRAMPOLINE
-                                : MAGIC_IO_DESIRED_STATE_EMPTY_SLOT_ERROR);
+            if (slot_is_present) {
+              boot_selected_slot(false);
+            } else {
+              magic_io_set_desired_state(
+                  MAGIC_IO_DESIRED_STATE_EMPTY_SLOT_ERROR);
+            }
             can_accept_boot_command = false;
           }
           break;
@@ -506,18 +1476,26 @@ int main() {
           break;
         }
         case MagicIoSignal::InTrampoline: {
-          mememu_stop();
           in_menu = false;
 
-          load_rom_from_data_partition();
+          // The CPU keeps spinning in the trampoline of the active bank while
+          // we prepare the other one.
+          if (run_is_pending) {
+            run_is_pending = false;
+            prepare_transient_rom();
+          } else {
+            prepare_selected_slot();
+          }
 
-          mememu_start();
+          mememu_switch_bank();
+          measure_boot_time(boot_stats.trampoline);
           break;
         }
         // Interpret bytes received over magic I/O's serial tunnel with the
         // client protocol.
         case MagicIoSignal::SerialRx00... MagicIoSignal::SerialRxFF: {
           uint8_t rx_byte = (uint)signal - (uint)MagicIoSignal::SerialRx00;
+          magic_io_rx_bytes++;
           switch (magic_io_decoder.push(rx_byte)) {
             case CliProtocolDecoder::PushResult::Idle: {
               break;
@@ -534,6 +1512,7 @@ int main() {
               for (uint i = 0; i < reply_length; i++) {
                 magic_io_enqueue_serial_tx(reply_data[i]);
               }
+              magic_io_tx_bytes += reply_length;
               break;
             }
           }
@@ -547,7 +1526,7 @@ int main() {
           const ConfigurationPartition::RomInfo &src =
               data_partition.get_rom_info(slot_num);
           MAGIC_IO_CONFIGURATION_DATA_t buf = {};
-          if (src.is_present()) {
+          if (is_slot_bootable(slot_num)) {
             buf.rom.is_present = 1;
             buf.rom.name_length = src.name_length;
             memcpy(buf.rom.name, src.name,
@@ -581,6 +1560,64 @@ int main() {
       }
     }
 
+    // Follow the monitor stub, if breakpoints are being used.
+    if (!in_menu && debug_monitor_is_active()) {
+      if (read_new_traces()) {
+        debug_monitor_analyze_traces(trace_buf, TRACE_MAX_SAMPLES);
+      }
+    }
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+    // Serve bank switch requests, if running a banked ROM.
+    if (banked_rom_size != 0) {
+      if (std::optional<uint8_t> bank_num =
+              mememu_take_bank_select_request()) {
+        switch_rom_bank(*bank_num);
+      }
+    }
+
+    // Interpret bytes received through the mailbox with the client protocol,
+    // if the running ROM uses it.
+    if (!in_menu) {
+      if (mailbox_poll()) {
+        mailbox_decoder.reset();
+      }
+      while (std::optional<uint8_t> rx_byte = mailbox_receive()) {
+        switch (mailbox_decoder.push(*rx_byte)) {
+          case CliProtocolDecoder::PushResult::Idle: {
+            break;
+          }
+          case CliProtocolDecoder::PushResult::Error: {
+            mailbox_decoder.reset();
+            break;
+          }
+          case CliProtocolDecoder::PushResult::PacketAvailable: {
+            auto [reply_data, reply_length] = handle_packet(
+                mailbox_decoder.get_packet_type(),
+                mailbox_decoder.get_packet_data(),
+                mailbox_decoder.get_packet_length(), PacketSource::Mailbox);
+            for (uint i = 0; i < reply_length; i++) {
+              mailbox_enqueue(reply_data[i]);
+            }
+            break;
+          }
+        }
+      }
+    }
+
+    // Persist the changes to the emulated RAM, if the NVRAM is enabled.
+    nvram.poll();
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+    // Follow what is being displayed, including while in the menu.
+    screen_mirror_poll();
+#endif
+
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+    mememu_collect_timing_samples();
+#endif
+
     // Interpret bytes received over USB with the client protocol.
     uint32_t r = stdio_getchar_timeout_us(0);
     if (r != PICO_ERROR_TIMEOUT) {
@@ -2,12 +2,21 @@
 
 #include <hardware/dma.h>
 #include <hardware/pio.h>
+#include <hardware/structs/m33.h>
 #include <pico/binary_info.h>
 #include <pico/multicore.h>
 #include <pico/stdlib.h>
 
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <initializer_list>
+#include <utility>
 
+#include "banked-rom-definitions.h"
 #include "mememu-common.pio.h"
 #include "pin-map.h"
 
@@ -31,6 +40,11 @@ static constexpr uint32_t PIN_ADDR_ALL_MASK =
 static_assert(PIN_ADDR_ALL_MASK == 0xffff,
               "Address lines must start from GPIO0 and be consecutive");
 
+// The A8-A15 lines take the 8 GPIOs that are not taken by the AD lines.
+static constexpr uint PIN_A_BASE = PIN_AD_BASE ^ 8;
+static_assert(PIN_ADDR_A_MASK >> PIN_A_BASE == 0xff,
+              "High address lines must be consecutive");
+
 bi_decl(bi_pin_mask_with_names(PIN_ADDR_ALL_MASK, PIN_ADDR_ALL_NAMES));
 bi_decl(bi_1pin_with_name(PIN_ALE, "ALE"));
 bi_decl(bi_1pin_with_name(PIN_PSEN, "~PSEN"));
@@ -56,97 +70,767 @@ static_assert(PIN_WR == PIN_PSEN + 1 && PIN_RD == PIN_PSEN + 2,
               "PSEN, WR and RD must be consecutive");
 #endif
 
+// Number of cycles that mememu_dir waits, after detecting that PSEN (or RD) is
+// low, for the Minitel's CPU to release the bus before driving it, including
+// the 3 instructions that update the bus counters. They depend on the system
+// clock frequency and on the Minitel model, and they are selected by the build
+// system (see the table in CMakeLists.txt).
+static_assert(ROM_EMULATOR_PSEN_RELEASE_CYCLES >= 3 &&
+                  ROM_EMULATOR_PSEN_RELEASE_CYCLES <= 3 + 31,
+              "Unsupported PSEN release delay");
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+static_assert(ROM_EMULATOR_RD_RELEASE_CYCLES >= 3 &&
+                  ROM_EMULATOR_RD_RELEASE_CYCLES <= 3 + 31,
+              "Unsupported RD release delay");
+#endif
+
 // PIO resources.
 static const PIO pio_serve = pio0;
 static constexpr uint sm_out = 0;
 static constexpr uint sm_dira = 1;
 static constexpr uint sm_dirb = 2;
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+static constexpr uint sm_page = 3;
+#endif
 static const PIO pio_sense = pio1;
 static constexpr uint sm_latch = 0;
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+static constexpr uint sm_write = 1;
+#endif
+static constexpr uint sm_deadline = 2;
+static const PIO pio_count = pio2;  // shared with trace.cpp, which uses SM 0
+static constexpr uint sm_count_ale = 1;
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+static constexpr uint sm_count_wr = 2;
+#endif
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+static constexpr uint sm_timing = 3;
+#endif
+#if MEMEMU_HAS_VREG == 1
+static constexpr uint sm_vreg = 3;
+#endif
 
 // DMA resources.
 static constexpr uint dma_addr = 0;
 static constexpr uint dma_data = 1;
+#if MEMEMU_HAS_VREG == 1
+static constexpr uint dma_vreg_pop = 2;
+static constexpr uint dma_vreg_push = 3;
+static_assert(dma_vreg_pop == 2 && dma_vreg_push == 3,
+              "The mememu_vreg PIO program emits triggers for these channels");
+#endif
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+static constexpr uint dma_timing = 4;
+
+// The mememu_timing PIO program requires PSEN to follow ALE.
+static_assert(PIN_PSEN == PIN_ALE + 1, "PSEN and ALE must be consecutive");
+#endif
+static constexpr uint dma_deadline = 5;
+static constexpr uint dma_missed_count = 6;
+static constexpr uint dma_missed_log = 7;
+#if MEMEMU_HAS_VREG == 1
+static constexpr uint dma_vreg_addr = 8;
+static constexpr uint dma_vreg_event = 9;
+#endif
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+static constexpr uint dma_write_addr = 10;
+static constexpr uint dma_write_data = 11;
+#endif
+#if MEMEMU_HAS_VREG == 1
+static constexpr uint dma_vreg_fill = 12;
+#endif
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+static constexpr uint dma_page_addr = 13;
+static constexpr uint dma_page_data = 14;
+#endif
 
 // ROM and RAM contents, stored as consecutive pairs:
 // - (2 * pin-mapped address + 0) -> (pin-mapped RAM value)
 // - (2 * pin-mapped address + 1) -> (pin-mapped ROM value)
+//
+// There are two banks: the active one, which is being served, and the staging
+// one, which can be filled in the background and then swapped with the active
+// one by mememu_switch_bank.
+//
+// Because of its alignment, the linker cannot place mem before 0x20020000, and
+// the space below it only receives the RAM vector table, .uninitialized_data
+// and .data. Large buffers that do not need to be zeroed at boot are therefore
+// declared with __uninitialized_ram, so that they fill that space instead of
+// taking room from .bss and the heap, which come after mem.
 static constexpr uint MEMARRAY_SHIFT = 17;
 static constexpr uint MEMARRAY_SIZE = 2 * MAX_MEM_SIZE;  // ROM + RAM
-static std::atomic<uint8_t> mem[MEMARRAY_SIZE] [[gnu::aligned(MEMARRAY_SIZE)]];
+static std::atomic<uint8_t> mem[2][MEMARRAY_SIZE]
+    [[gnu::aligned(MEMARRAY_SIZE)]];
 static_assert(MEMARRAY_SIZE == 1 << MEMARRAY_SHIFT);
 
-// PC values to jump to activate/pause the sm_latch state machine.
-static uint pc_latch_paused, pc_latch_active;
+// Index of the active bank in the mem array.
+static uint active_bank = 0;
+
+static uint get_bank_index(MememuBank bank) {
+  return bank == MememuBank::Active ? active_bank : 1 - active_bank;
+}
+
+static std::atomic<uint8_t> *get_bank(MememuBank bank) {
+  return mem[get_bank_index(bank)];
+}
+
+// Value stored into sm_latch's OSR to serve the given bank.
+static uint32_t get_bank_prefix(uint bank_index) {
+  return (uintptr_t)mem[bank_index] >> MEMARRAY_SHIFT;
+}
+
+// PC values to jump to activate/pause the sm_latch state machine, and from
+// which it serves all the addresses.
+static uint pc_latch_paused, pc_latch_active, pc_latch_operational;
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+// Memory map of each bank, indexed by logical page.
+static MememuRegion memory_maps[2][MEMEMU_NUM_PAGES];
+
+// Instruction to be executed by sm_dira and sm_dirb in RD cycles (at the
+// `rd_drive` label) for each page of the active bank, indexed by the values of
+// the A8-A15 pins. If the memory map contains both mapped and unmapped pages,
+// sm_page emits the pointer to the entry of each page being accessed, which
+// dma_page_addr and dma_page_data use to patch the instruction in pio_serve's
+// memory. Otherwise, the instruction is patched only once.
+static constexpr uint PAGE_TABLE_SHIFT = 9;  // log2 of its size, in bytes
+static uint16_t page_rd_instructions[256]
+    [[gnu::aligned(1 << PAGE_TABLE_SHIFT)]];
+static_assert(sizeof(page_rd_instructions) == 1 << PAGE_TABLE_SHIFT);
+
+// Address, in pio_serve's memory, of the instruction at the `rd_drive` label.
+static uint pc_rd_drive;
+
+// PC value to jump to restart sm_page.
+static uint pc_page_entry_point;
+
+// The emulated RAM is selected by A15: the pages below this one are never
+// mapped.
+static constexpr uint FIRST_RAM_PAGE = 0x8000 / MEMEMU_PAGE_SIZE;
+
+#if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+// Non-zero if core 1 stores the writes into the page, for each page of the
+// active bank, indexed like page_rd_instructions.
+static std::atomic<uint8_t> page_is_writable[256];
+#endif
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+// Offset, within each bank, of the RAM byte that receives bank switch requests.
+static constexpr uint32_t BANK_SELECT_OFFSET =
+    2 * pin_map_address(BANKED_ROM_SELECT_ADDRESS) + 0;
+
+#if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+// Most recent (pin-mapped) value written into BANKED_ROM_SELECT_ADDRESS, or -1
+// if it has already been consumed.
+static std::atomic<int> bank_select_request = -1;
+#else
+// Writes performed by the PIO+DMA engine cannot be observed as they happen:
+// the BANKED_ROM_SELECT_ADDRESS byte is polled instead, and this is the
+// (pin-mapped) value that was seen last.
+static uint8_t last_bank_select_value;
+
+// Time that sm_write lets the value on the bus settle for, after detecting the
+// WR falling edge, before sampling it (i.e. 8 cycles at 150 MHz).
+static constexpr uint32_t PIO_RAM_WRITE_SETTLE_NS = 53;
+static constexpr uint32_t PIO_RAM_WRITE_SETTLE_CYCLES =
+    (PIO_RAM_WRITE_SETTLE_NS * ROM_EMULATOR_SYS_CLK_KHZ + 999999) / 1000000;
+static_assert(PIO_RAM_WRITE_SETTLE_CYCLES >= 1 &&
+              PIO_RAM_WRITE_SETTLE_CYCLES <= 31);
+#endif
+#endif
+
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+// Value written by dma_timing into the IRQ_FORCE register of pio_count, to set
+// the IRQ flag that sm_timing waits for. It is not const so that it is placed
+// in SRAM, like the mem array, and reading it never stalls the DMA chain.
+static uint32_t timing_irq_force_value = 1u << 0;
+
+static MememuTimingStats timing_stats;
+#endif
+
+// Value written by dma_deadline into the IRQ_FORCE register of pio_sense, to
+// set the IRQ flag that sm_deadline checks. Like timing_irq_force_value, it is
+// not const so that it is placed in SRAM.
+static uint32_t deadline_irq_force_value = 1u << 0;
+
+// Number of missed deadlines, copied by dma_missed_count from sm_deadline's
+// FIFO, and the DMA pointers (see the mem array below) that were being served
+// in the most recent ones, written by dma_missed_log in a ring buffer.
+static std::atomic<uint32_t> missed_deadlines_count;
+static constexpr uint MISSED_LOG_RING_SHIFT = 6;  // log2 of its size, in bytes
+static std::atomic<uint32_t>
+    missed_deadlines_log[MEMEMU_MISSED_DEADLINES_LOG_SIZE]
+    [[gnu::aligned(1 << MISSED_LOG_RING_SHIFT)]];
+static_assert(sizeof(missed_deadlines_log) == 1 << MISSED_LOG_RING_SHIFT);
+
+#if MEMEMU_HAS_VREG == 1
+// The FIFOs of the virtual register, containing pin-mapped values. They are
+// ring buffers, read by dma_vreg_pop and written by dma_vreg_push, whose
+// current read and write addresses are the positions of the Minitel CPU.
+static constexpr uint VREG_RING_SHIFT = 12;  // log2 of their size, in bytes
+static_assert(MEMEMU_VREG_FIFO_SIZE == 1 << VREG_RING_SHIFT);
+static uint8_t vreg_read_fifo[MEMEMU_VREG_FIFO_SIZE]
+    [[gnu::aligned(MEMEMU_VREG_FIFO_SIZE)]];
+static uint8_t vreg_write_fifo[MEMEMU_VREG_FIFO_SIZE]
+    [[gnu::aligned(MEMEMU_VREG_FIFO_SIZE)]];
+
+// Next value to be returned by the virtual register, prefetched from the read
+// FIFO by dma_vreg_pop and copied into the mem array by dma_vreg_fill (again
+// after each write, which overwrites it).
+static uint8_t vreg_next_value;
+
+// Whether the virtual register is enabled.
+static bool vreg_enabled = false;
+
+// Our positions in the FIFOs, i.e. where the next byte will be enqueued and
+// dequeued, respectively.
+static uint32_t vreg_read_fifo_wpos, vreg_write_fifo_rpos;
+
+// Number of valid bytes in the read FIFO, as of the last check, including the
+// one currently returned by the virtual register (see vreg_read_fifo_level).
+static uint32_t vreg_read_fifo_last_level;
+
+// Value loaded into sm_vreg's Y register while the virtual register is
+// disabled. It never matches, because sm_vreg only compares 17-bit offsets.
+static constexpr uint32_t VREG_NO_OFFSET = UINT32_MAX;
+
+// PC value to jump to restart sm_vreg.
+static uint pc_vreg_entry_point;
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+// Maximum number of cycles spent processing a single RAM write, as measured by
+// core 1 (see core1_worker_task and core1_write_monitor_task).
+static std::atomic<uint32_t> max_ram_write_cycles = 0;
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+// Logical address of each pin-mapped address, split into the contributions of
+// its low and high byte. They are copies of the PIN_MAP_ADDRESS_INVERSE_TABLE_*
+// tables that are not const, so that they are placed in SRAM, because core 1
+// cannot afford to wait for flash accesses.
+static constexpr std::array<uint16_t, 256> make_address_table(
+    const uint16_t (&inverse_table)[256]) {
+  std::array<uint16_t, 256> result = {};
+  for (uint i = 0; i < 256; i++) {
+    result[i] = inverse_table[i];
+  }
+  return result;
+}
+static std::array<uint16_t, 256> address_of_pin_address_lo =
+    make_address_table(PIN_MAP_ADDRESS_INVERSE_TABLE_LO);
+static std::array<uint16_t, 256> address_of_pin_address_hi =
+    make_address_table(PIN_MAP_ADDRESS_INVERSE_TABLE_HI);
+
+// Non-zero if the corresponding logical page of the active RAM has been written
+// since the last call to mememu_take_dirty_ram_pages. There is one byte per
+// page, instead of one bit, so that core 1 can mark a page with a single store
+// instead of a read-modify-write.
+static std::atomic<uint8_t> dirty_ram_pages[MEMEMU_NUM_PAGES];
+
+// Writes into the registers of the video chip, captured by core 1 in a ring
+// buffer with a single producer (core 1) and a single consumer (core 0). Each
+// entry contains the register index (0-15) in the high byte and the written
+// pin-mapped value in the low byte. The head and tail indices are
+// free-running.
+static_assert(ROM_EMULATOR_VIDEO_BASE_ADDRESS % MEMEMU_VIDEO_NUM_REGISTERS == 0,
+              "The video chip's registers must be aligned");
+static constexpr uint32_t VIDEO_WRITES_RING_SIZE = 1024;
+static std::atomic<uint16_t> video_writes_ring[VIDEO_WRITES_RING_SIZE];
+static std::atomic<uint32_t> video_writes_head = 0;  // written by core 1
+static std::atomic<uint32_t> video_writes_tail = 0;  // written by core 0
+static std::atomic<uint32_t> video_writes_lost = 0;  // written by core 1
+
+// Writes into the emulated RAM, logged by core 1 in a ring buffer like the
+// one above if their address is selected in write_log_filter (one bit per
+// address). Each entry is split across two arrays: the first contains whether
+// the write was discarded (bit 24), the logical address (bits 8-23) and the
+// written pin-mapped value (bits 0-7), and the second contains the value of
+// core 1's cycle counter at the falling edge of WR, if enabled. Only the
+// entries between the tail and the head are ever read, so the two arrays are
+// left uninitialized (see mem).
+static constexpr uint32_t WRITE_LOG_RING_SIZE = 1024;
+static std::atomic<uint32_t> write_log_filter[65536 / 32];
+static std::atomic<bool> write_log_timestamps = false;
+static std::atomic<uint32_t> __uninitialized_ram(
+    write_log_ring)[WRITE_LOG_RING_SIZE];
+static std::atomic<uint32_t> __uninitialized_ram(
+    write_log_cycles)[WRITE_LOG_RING_SIZE];
+static std::atomic<uint32_t> write_log_head = 0;  // written by core 1
+static std::atomic<uint32_t> write_log_tail = 0;  // written by core 0
+static std::atomic<uint32_t> write_log_lost = 0;  // written by core 1
 
 [[gnu::noinline, gnu::noreturn]]
 static void __scratch_x("core1_worker_task") core1_worker_task() {
+  // Enable core 1's cycle counter, to measure how long each write takes.
+  m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+  m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+
   while (true) {
-#if ROM_EMULATOR_PROVIDES_RAM == 1
     // Wait for WR to go low.
     uint32_t value;
     do {
       value = gpio_get_all();
     } while ((value & (1 << PIN_WR)) != 0);
+    uint32_t start_cycles = m33_hw->dwt_cyccnt;
 
     // Get the latched address.
     auto storage = (std::atomic<uint8_t>*)dma_hw->ch[dma_data].al1_read_addr;
+    uint32_t offset = (uintptr_t)storage & (MEMARRAY_SIZE - 1);
+    uint32_t address_pin_values = offset / 2;
+
+    // Write the new RAM value into the mem array, unless the memory map says
+    // that the page is not writable.
+    uint32_t page_pin_values = (address_pin_values >> PIN_A_BASE) & 0xFF;
+    bool writable =
+        page_is_writable[page_pin_values].load(std::memory_order_relaxed);
+    if (writable) {
+      *storage = value >> PIN_AD_BASE;
+    }
 
-    // Write the new RAM value into the mem array.
-    *storage = value >> PIN_AD_BASE;
+    // Mark the corresponding logical page as dirty.
+    uint16_t address = address_of_pin_address_lo[address_pin_values & 0xFF] |
+                       address_of_pin_address_hi[address_pin_values >> 8];
+    dirty_ram_pages[address / MEMEMU_PAGE_SIZE].store(
+        1, std::memory_order_relaxed);
+
+    // Capture the writes into the registers of the video chip. They are not
+    // directed at the emulated RAM, but they cross the bus all the same.
+    uint16_t video_reg = address - ROM_EMULATOR_VIDEO_BASE_ADDRESS;
+    if (video_reg < MEMEMU_VIDEO_NUM_REGISTERS) {
+      uint32_t head = video_writes_head.load(std::memory_order_relaxed);
+      if (head - video_writes_tail.load(std::memory_order_acquire) <
+          VIDEO_WRITES_RING_SIZE) {
+        video_writes_ring[head % VIDEO_WRITES_RING_SIZE].store(
+            video_reg << 8 | ((value >> PIN_AD_BASE) & 0xFF),
+            std::memory_order_relaxed);
+        video_writes_head.store(head + 1, std::memory_order_release);
+      } else {
+        video_writes_lost.store(
+            video_writes_lost.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+      }
+    }
+
+    // Log the write, if its address is selected.
+    if ((write_log_filter[address / 32].load(std::memory_order_relaxed) >>
+         (address % 32)) &
+        1) {
+      uint32_t head = write_log_head.load(std::memory_order_relaxed);
+      if (head - write_log_tail.load(std::memory_order_acquire) <
+          WRITE_LOG_RING_SIZE) {
+        uint32_t index = head % WRITE_LOG_RING_SIZE;
+        write_log_ring[index].store(
+            !writable << 24 | address << 8 | ((value >> PIN_AD_BASE) & 0xFF),
+            std::memory_order_relaxed);
+        write_log_cycles[index].store(
+            write_log_timestamps.load(std::memory_order_relaxed) ? start_cycles
+                                                                 : 0,
+            std::memory_order_relaxed);
+        write_log_head.store(head + 1, std::memory_order_release);
+      } else {
+        write_log_lost.store(write_log_lost.load(std::memory_order_relaxed) + 1,
+                             std::memory_order_relaxed);
+      }
+    }
+
+    // Notify core 0 if this was a bank switch request.
+    if (offset == BANK_SELECT_OFFSET) {
+      bank_select_request.store((value >> PIN_AD_BASE) & 0xFF,
+                                std::memory_order_relaxed);
+    }
+
+    // Keep track of the worst case. Note that the WR pulse is much longer than
+    // the time spent here, so this does not delay the wait below.
+    uint32_t cycles = m33_hw->dwt_cyccnt - start_cycles;
+    if (cycles > max_ram_write_cycles.load(std::memory_order_relaxed)) {
+      max_ram_write_cycles.store(cycles, std::memory_order_relaxed);
+    }
 
     // Wait for WR to go high.
     do {
       value = gpio_get_all();
     } while ((value & (1 << PIN_WR)) == 0);
-#else
-    __wfe();
+  }
+}
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+// Core 1 is otherwise idle when the PIO+DMA engine processes the writes: use it
+// to measure how long each write takes, from the WR falling edge until
+// dma_write_data takes the sampled value out of sm_write's FIFO (its store into
+// the mem array follows within a few cycles). Writes whose value is dequeued
+// between two polls of the FIFO are not measured, which cannot hide the worst
+// case. pio_sense is only polled while WR is low, when the DMA chain is not
+// serving any address, so that the emulation is never delayed.
+[[gnu::noinline, gnu::noreturn]]
+static void __scratch_x("core1_write_monitor_task") core1_write_monitor_task() {
+  m33_hw->demcr |= M33_DEMCR_TRCENA_BITS;
+  m33_hw->dwt_ctrl |= M33_DWT_CTRL_CYCCNTENA_BITS;
+
+  while (true) {
+    // Wait for WR to go low.
+    while ((gpio_get_all() & (1 << PIN_WR)) != 0) {
+    }
+    uint32_t start_cycles = m33_hw->dwt_cyccnt;
+
+    // Wait for sm_write to push the value, and then for the DMA to drain it.
+    bool pushed = false;
+    while (true) {
+      bool empty = pio_sm_is_rx_fifo_empty(pio_sense, sm_write);
+      uint32_t cycles = m33_hw->dwt_cyccnt - start_cycles;
+      if (!empty) {
+        pushed = true;
+      } else if (pushed) {
+        if (cycles > max_ram_write_cycles.load(std::memory_order_relaxed)) {
+          max_ram_write_cycles.store(cycles, std::memory_order_relaxed);
+        }
+        break;
+      } else if ((gpio_get_all() & (1 << PIN_WR)) != 0) {
+        break;  // missed
+      }
+    }
+
+    // Wait for WR to go high.
+    while ((gpio_get_all() & (1 << PIN_WR)) == 0) {
+    }
+  }
+}
 #endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+// Copies the emulated ROM into the emulated RAM of the pages, within the given
+// range, that are MememuRegion::Rom in the memory map of the given bank.
+static void mirror_rom_pages(uint bank_index, size_t first_page,
+                             size_t end_page) {
+  static_assert(MEMEMU_PAGE_SIZE == 256);
+  std::atomic<uint8_t> *bank_mem = mem[bank_index];
+  for (size_t page = first_page; page < end_page; page++) {
+    if (memory_maps[bank_index][page] != MememuRegion::Rom) {
+      continue;
+    }
+
+    uint16_t address_hi_pin_values = PIN_MAP_ADDRESS_TABLE_HI[page];
+    for (size_t i = 0; i < MEMEMU_PAGE_SIZE; i++) {
+      uint16_t address_pin_values =
+          address_hi_pin_values | PIN_MAP_ADDRESS_TABLE_LO[i];
+      bank_mem[2 * address_pin_values + 0].store(
+          bank_mem[2 * address_pin_values + 1].load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
   }
 }
+#endif
+
+// Sets `size` bytes, starting from the given address (that must be a multiple
+// of 256), of either the emulated ROM (Offset = 1) or the emulated RAM
+// (Offset = 0). The first `data_size` bytes are copied from `data`, and the
+// remaining ones are set to `fill_value`.
+//
+// If PinOrder is true, `data` must already be permuted in pin order (i.e. each
+// byte at offset N contains the pin-mapped value for the pin-mapped address N)
+// and it is copied as-is.
+//
+// When loading the ROM, it is also mirrored into the RAM of the affected
+// MememuRegion::Rom pages, if any.
+template <uint Offset, bool PinOrder = false>
+static uint32_t bulk_load(MememuBank bank, uint32_t address,
+                          const uint8_t *data, size_t data_size,
+                          uint8_t fill_value, size_t size) {
+  uint32_t start_time = time_us_32();
+  assert(address % 256 == 0);
+
+  // Process one block of 256 bytes at a time, so that the high half of the
+  // permuted address stays constant in the inner loop.
+  alignas(uint32_t) uint8_t block[256];
+
+  size_t end = std::min<size_t>(address + size, MAX_MEM_SIZE);
+  for (size_t base = address; base < end; base += sizeof(block)) {
+    size_t block_size = std::min<size_t>(end - base, sizeof(block));
+    size_t offset = base - address;
+    size_t copy_size =
+        offset < data_size ? std::min(block_size, data_size - offset) : 0;
+
+    // The source is often in uncached flash memory: fetching it with a single
+    // memcpy lets it be read in words instead of individual bytes.
+    if (copy_size != 0) {
+      memcpy(block, data + offset, copy_size);
+    }
+    memset(block + copy_size, fill_value, block_size - copy_size);
+
+    std::atomic<uint8_t> *dest = &get_bank(bank)[Offset];
+    if constexpr (PinOrder) {
+      dest += 2 * base;
+      for (size_t i = 0; i < block_size; i++) {
+        dest[2 * i].store(block[i], std::memory_order_relaxed);
+      }
+    } else {
+      uint16_t address_hi_pin_values = PIN_MAP_ADDRESS_TABLE_HI[base >> 8];
+      for (size_t i = 0; i < block_size; i++) {
+        uint16_t address_pin_values =
+            address_hi_pin_values | PIN_MAP_ADDRESS_TABLE_LO[i];
+        dest[2 * address_pin_values].store(PIN_MAP_DATA_TABLE[block[i]],
+                                           std::memory_order_relaxed);
+      }
+    }
+  }
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  if constexpr (Offset == 1) {
+    mirror_rom_pages(get_bank_index(bank), address / MEMEMU_PAGE_SIZE,
+                     (end + MEMEMU_PAGE_SIZE - 1) / MEMEMU_PAGE_SIZE);
+  }
+#endif
+
+  return time_us_32() - start_time;
+}
+
+#if MEMEMU_HAS_VREG == 1
+// Loads the given offset, within each bank of the mem array, into sm_vreg's Y
+// register and (re)starts it. The value is shifted in one bit at a time, so
+// that the pointers in its TX FIFO are not disturbed.
+static void vreg_set_offset(uint32_t offset) {
+  pio_sm_set_enabled(pio_count, sm_vreg, false);
+  pio_sm_exec(pio_count, sm_vreg, pio_encode_mov(pio_isr, pio_null));
+  for (int bit = 31; bit >= 0; bit--) {
+    pio_sm_exec(pio_count, sm_vreg, pio_encode_set(pio_x, (offset >> bit) & 1));
+    pio_sm_exec(pio_count, sm_vreg, pio_encode_in(pio_x, 1));
+  }
+  pio_sm_exec(pio_count, sm_vreg, pio_encode_mov(pio_y, pio_isr));
+  pio_sm_exec(pio_count, sm_vreg, pio_encode_mov(pio_isr, pio_null));
+  pio_sm_exec(pio_count, sm_vreg, pio_encode_jmp(pc_vreg_entry_point));
+  pio_sm_set_enabled(pio_count, sm_vreg, true);
+}
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+// Rebuilds the lookup tables from the memory map of the active bank and, if
+// reads have to be answered for some pages but not for others, (re)starts
+// sm_page. Otherwise, it stops sm_page and patches the instruction just once.
+static void apply_memory_map() {
+  const uint16_t instr_drive = pio_encode_set(pio_pindirs, 0b1111);
+  const uint16_t instr_release = pio_encode_set(pio_pindirs, 0b0000);
+
+  bool any_mapped = false, any_unmapped = false;
+  for (uint page_pin_values = 0; page_pin_values < 256; page_pin_values++) {
+    uint page = pin_map_address_inverse(page_pin_values << PIN_A_BASE) /
+                MEMEMU_PAGE_SIZE;
+    MememuRegion region = memory_maps[active_bank][page];
+    bool mapped = region != MememuRegion::Unmapped;
+    page_rd_instructions[page_pin_values] =
+        mapped ? instr_drive : instr_release;
+#if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+    page_is_writable[page_pin_values].store(region == MememuRegion::Ram,
+                                            std::memory_order_relaxed);
+#endif
+
+    // sm_dira and sm_dirb never answer below FIRST_RAM_PAGE anyway, because
+    // they also check A15.
+    if (page >= FIRST_RAM_PAGE) {
+      any_mapped |= mapped;
+      any_unmapped |= !mapped;
+    }
+  }
+
+  // Stop sm_page and wait for the lookup in progress, if any, to complete.
+  pio_sm_set_enabled(pio_serve, sm_page, false);
+  while (!pio_sm_is_rx_fifo_empty(pio_serve, sm_page) ||
+         dma_channel_is_busy(dma_page_data) ||
+         dma_channel_hw_addr(dma_page_addr)->transfer_count != 1) {
+    tight_loop_contents();
+  }
+
+  if (any_mapped && any_unmapped) {
+    // Restart it from a clean state. The OSR still contains the address of the
+    // table.
+    pio_sm_exec(pio_serve, sm_page, pio_encode_mov(pio_isr, pio_null));
+    pio_sm_exec(pio_serve, sm_page, pio_encode_jmp(pc_page_entry_point));
+    pio_sm_set_enabled(pio_serve, sm_page, true);
+  } else {
+    pio_serve->instr_mem[pc_rd_drive] =
+        any_mapped ? instr_drive : instr_release;
+  }
+}
+#endif
+
+// Loads a copy of the given PIO program, in which the delay of the instruction
+// at each given offset has been set to the given number of cycles.
+static uint add_program_with_delays(
+    PIO pio, const pio_program_t *program,
+    std::initializer_list<std::pair<uint, uint>> delays) {
+  uint16_t instructions[PIO_INSTRUCTION_COUNT];
+  assert(program->length <= PIO_INSTRUCTION_COUNT);
+  memcpy(instructions, program->instructions,
+         program->length * sizeof(uint16_t));
+  for (auto [offset, cycles] : delays) {
+    instructions[offset] |= pio_encode_delay(cycles);
+  }
+
+  pio_program_t patched_program = *program;
+  patched_program.instructions = instructions;
+  return pio_add_program(pio, &patched_program);
+}
+
+#if MEMEMU_HAS_VREG == 1
+// Configures dma_vreg_fill to store the next value at the given location. The
+// whole configuration is applied, because the channel may have been lent (see
+// mememu_get_lendable_dma_channel).
+static void vreg_configure_fill(std::atomic<uint8_t> *storage) {
+  dma_channel_config_t cfg = dma_channel_get_default_config(dma_vreg_fill);
+  channel_config_set_transfer_data_size(&cfg, DMA_SIZE_8);
+  channel_config_set_read_increment(&cfg, false);
+  channel_config_set_write_increment(&cfg, false);
+  dma_channel_configure(dma_vreg_fill, &cfg, storage, &vreg_next_value,
+                        dma_encode_transfer_count(1), false);
+}
+#endif
 
 void mememu_setup() {
   // Initially fill the emulated ROM and RAM contents with 0xFF. Note that, in
   // fact, we will keep serving 0x00 until mememu_start is called.
-  for (uint i = 0; i < MAX_MEM_SIZE; i++) {
-    mememu_write_rom(i, 0xFF);
-    mememu_write_ram(i, 0xFF);
-  }
+  // Since 0xFF is not affected by the pin permutation and core 1 is not running
+  // yet, we can simply set all the bytes of the mem array at once.
+  static_assert(MEMARRAY_SIZE == 2 * MAX_MEM_SIZE);
+  memset((void *)mem, 0xFF, sizeof(mem));  // both banks
 
   // Claim the resources that we will need.
   pio_sm_claim(pio_serve, sm_out);
   pio_sm_claim(pio_serve, sm_dira);
   pio_sm_claim(pio_serve, sm_dirb);
   pio_sm_claim(pio_sense, sm_latch);
+  pio_sm_claim(pio_sense, sm_deadline);
+  pio_sm_claim(pio_count, sm_count_ale);
   dma_channel_claim(dma_addr);
   dma_channel_claim(dma_data);
+  dma_channel_claim(dma_deadline);
+  dma_channel_claim(dma_missed_count);
+  dma_channel_claim(dma_missed_log);
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  pio_sm_claim(pio_sense, sm_write);
+  dma_channel_claim(dma_write_addr);
+  dma_channel_claim(dma_write_data);
+#endif
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  pio_sm_claim(pio_serve, sm_page);
+  pio_sm_claim(pio_count, sm_count_wr);
+  dma_channel_claim(dma_page_addr);
+  dma_channel_claim(dma_page_data);
+#endif
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+  pio_sm_claim(pio_count, sm_timing);
+  dma_channel_claim(dma_timing);
+#endif
+#if MEMEMU_HAS_VREG == 1
+  pio_sm_claim(pio_count, sm_vreg);
+  dma_channel_claim(dma_vreg_addr);
+  dma_channel_claim(dma_vreg_event);
+  dma_channel_claim(dma_vreg_pop);
+  dma_channel_claim(dma_vreg_push);
+  dma_channel_claim(dma_vreg_fill);
+#endif
 
   // Load the programs into the PIO engine.
   uint prog_out = pio_add_program(pio_serve, &mememu_out_program);
-  uint prog_dir = pio_add_program(pio_serve, &mememu_dir_program);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  uint prog_dir = add_program_with_delays(
+      pio_serve, &mememu_dir_program,
+      {{mememu_dir_offset_psen_release_delay,
+        ROM_EMULATOR_PSEN_RELEASE_CYCLES - 3},
+       {mememu_dir_offset_rd_release_delay,
+        ROM_EMULATOR_RD_RELEASE_CYCLES - 3}});
+#else
+  uint prog_dir = add_program_with_delays(
+      pio_serve, &mememu_dir_program,
+      {{mememu_dir_offset_psen_release_delay,
+        ROM_EMULATOR_PSEN_RELEASE_CYCLES - 3}});
+#endif
   uint prog_latch = pio_add_program(pio_sense, &mememu_latch_program);
+  uint prog_deadline = pio_add_program(pio_sense, &mememu_deadline_program);
+  uint prog_count = pio_add_program(pio_count, &mememu_count_program);
   pio_sm_config cfg_out = mememu_out_program_get_default_config(prog_out);
   pio_sm_config cfg_dira = mememu_dir_program_get_default_config(prog_dir);
   pio_sm_config cfg_dirb = mememu_dir_program_get_default_config(prog_dir);
   pio_sm_config cfg_latch = mememu_latch_program_get_default_config(prog_latch);
+  pio_sm_config cfg_deadline =
+      mememu_deadline_program_get_default_config(prog_deadline);
+  pio_sm_config cfg_count_ale =
+      mememu_count_program_get_default_config(prog_count);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  pio_sm_config cfg_count_wr =
+      mememu_count_program_get_default_config(prog_count);
+  uint prog_page = pio_add_program(pio_serve, &mememu_page_program);
+  pio_sm_config cfg_page = mememu_page_program_get_default_config(prog_page);
+#endif
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+  uint prog_timing = pio_add_program(pio_count, &mememu_timing_program);
+  pio_sm_config cfg_timing =
+      mememu_timing_program_get_default_config(prog_timing);
+#endif
+#if MEMEMU_HAS_VREG == 1
+  uint prog_vreg = pio_add_program(pio_count, &mememu_vreg_program);
+  pio_sm_config cfg_vreg = mememu_vreg_program_get_default_config(prog_vreg);
+#endif
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  uint prog_write = add_program_with_delays(
+      pio_sense, &mememu_write_program,
+      {{mememu_write_offset_settle_delay, PIO_RAM_WRITE_SETTLE_CYCLES}});
+  pio_sm_config cfg_write = mememu_write_program_get_default_config(prog_write);
+#endif
 
-  // Remember the addresses of these two labels.
+  // Remember the addresses of these labels.
   pc_latch_paused = prog_latch + mememu_latch_offset_paused;
   pc_latch_active = prog_latch + mememu_latch_offset_active;
+  pc_latch_operational = prog_latch + mememu_latch_offset_operational;
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  pc_rd_drive = prog_dir + mememu_dir_offset_rd_drive;
+  pc_page_entry_point = prog_page + mememu_page_offset_entry_point;
+#endif
 
   // Assign pin numbers.
   sm_config_set_out_pin_base(&cfg_out, PIN_AD_BASE);
   sm_config_set_in_pin_base(&cfg_dira, PIN_PSEN);
   sm_config_set_in_pin_base(&cfg_dirb, PIN_PSEN);
-  sm_config_set_sideset_pins(&cfg_dira, PIN_AD_BASE);
-  sm_config_set_sideset_pins(&cfg_dirb, PIN_AD_BASE + 4);
+  sm_config_set_set_pins(&cfg_dira, PIN_AD_BASE, 4);
+  sm_config_set_set_pins(&cfg_dirb, PIN_AD_BASE + 4, 4);
   sm_config_set_jmp_pin(&cfg_latch, PIN_ALE);
+  sm_config_set_jmp_pin(&cfg_deadline, PIN_PSEN);
+  sm_config_set_mov_status(&cfg_deadline, STATUS_IRQ_SET, 0);
   pio_sm_set_consecutive_pindirs(pio_serve, sm_dira, PIN_AD_BASE, 4, false);
   pio_sm_set_consecutive_pindirs(pio_serve, sm_dirb, PIN_AD_BASE + 4, 4, false);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  sm_config_set_in_pin_base(&cfg_deadline, PIN_RD);
+#else
+  sm_config_set_in_pin_base(&cfg_deadline, PIN_PSEN);
+#endif
 #if ROM_EMULATOR_PROVIDES_RAM == 1
   sm_config_set_jmp_pin(&cfg_out, PIN_RD);
   sm_config_set_jmp_pin(&cfg_dira, PIN_RAM_EN);
   sm_config_set_jmp_pin(&cfg_dirb, PIN_RAM_EN);
+#if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  sm_config_set_in_pin_base(&cfg_write, PIN_AD_BASE);
+  sm_config_set_jmp_pin(&cfg_write, PIN_WR);
+#endif
+#endif
+  sm_config_set_in_pin_base(&cfg_count_ale, PIN_ALE);
+  sm_config_set_jmp_pin(&cfg_count_ale, PIN_ALE);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  // Only count the writes into the emulated RAM. Note that A15 stays valid
+  // until the next ALE cycle, i.e. well after the rising edge of WR.
+  sm_config_set_in_pin_base(&cfg_count_wr, PIN_WR);
+  sm_config_set_jmp_pin(&cfg_count_wr, PIN_RAM_EN);
+  sm_config_set_in_pin_base(&cfg_page, PIN_A_BASE);
+  sm_config_set_jmp_pin(&cfg_page, PIN_ALE);
+#endif
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+  sm_config_set_in_pin_base(&cfg_timing, PIN_ALE);
+  sm_config_set_jmp_pin(&cfg_timing, PIN_PSEN);
+  sm_config_set_mov_status(&cfg_timing, STATUS_IRQ_SET, 0);
+#endif
+#if MEMEMU_HAS_VREG == 1
+  sm_config_set_in_pin_base(&cfg_vreg, PIN_WR);
+  sm_config_set_jmp_pin(&cfg_vreg, PIN_RD);
+  sm_config_set_mov_status(&cfg_vreg, STATUS_TX_LESSTHAN, 1);
 #endif
 
   // Set the initial output value to zero, for two reasons:
@@ -176,14 +860,200 @@ void mememu_setup() {
   channel_config_set_read_increment(&cfg_data, false);
   channel_config_set_write_increment(&cfg_data, false);
   channel_config_set_dreq(&cfg_data, pio_get_dreq(pio_serve, sm_out, true));
-  channel_config_set_chain_to(&cfg_data, dma_addr);
+  channel_config_set_chain_to(&cfg_data, dma_deadline);
   channel_config_set_high_priority(&cfg_data, true);
   dma_channel_configure(
       dma_addr, &cfg_addr, &dma_hw->ch[dma_data].al3_read_addr_trig,
       &pio_sense->rxf[sm_latch], dma_encode_transfer_count(1), false);
   dma_channel_configure(dma_data, &cfg_data, &pio_serve->rxf_putget[sm_out][0],
-                        &mem /* set at runtime by dma_addr */,
+                        mem /* set at runtime by dma_addr */,
+                        dma_encode_transfer_count(1), false);
+
+  // Setup the missed-deadline detector: after dma_data has delivered the value
+  // to be served, dma_deadline signals it to sm_deadline and then continues the
+  // chain. For each late cycle, sm_deadline emits the updated count, which
+  // dma_missed_count copies before triggering dma_missed_log, which logs the
+  // pointer used by dma_data and then re-arms dma_missed_count. These last two
+  // are not part of the chain and have normal priority.
+  dma_channel_config_t cfg_deadline_dma =
+      dma_channel_get_default_config(dma_deadline);
+  dma_channel_config_t cfg_missed_count =
+      dma_channel_get_default_config(dma_missed_count);
+  dma_channel_config_t cfg_missed_log =
+      dma_channel_get_default_config(dma_missed_log);
+  channel_config_set_transfer_data_size(&cfg_deadline_dma, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg_deadline_dma, false);
+  channel_config_set_write_increment(&cfg_deadline_dma, false);
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+  channel_config_set_chain_to(&cfg_deadline_dma, dma_timing);
+#elif ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  channel_config_set_chain_to(&cfg_deadline_dma, dma_write_addr);
+#elif MEMEMU_HAS_VREG == 1
+  channel_config_set_chain_to(&cfg_deadline_dma, dma_vreg_addr);
+#else
+  channel_config_set_chain_to(&cfg_deadline_dma, dma_addr);
+#endif
+  channel_config_set_high_priority(&cfg_deadline_dma, true);
+  channel_config_set_transfer_data_size(&cfg_missed_count, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg_missed_count, false);
+  channel_config_set_write_increment(&cfg_missed_count, false);
+  channel_config_set_dreq(&cfg_missed_count,
+                          pio_get_dreq(pio_sense, sm_deadline, false));
+  channel_config_set_chain_to(&cfg_missed_count, dma_missed_log);
+  channel_config_set_transfer_data_size(&cfg_missed_log, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg_missed_log, false);
+  channel_config_set_write_increment(&cfg_missed_log, true);
+  channel_config_set_ring(&cfg_missed_log, true, MISSED_LOG_RING_SHIFT);
+  channel_config_set_chain_to(&cfg_missed_log, dma_missed_count);
+  dma_channel_configure(dma_deadline, &cfg_deadline_dma, &pio_sense->irq_force,
+                        &deadline_irq_force_value, dma_encode_transfer_count(1),
+                        false);
+  dma_channel_configure(dma_missed_log, &cfg_missed_log, missed_deadlines_log,
+                        &dma_hw->ch[dma_data].read_addr,
+                        dma_encode_transfer_count(1), false);
+  dma_channel_configure(dma_missed_count, &cfg_missed_count,
+                        &missed_deadlines_count, &pio_sense->rxf[sm_deadline],
+                        dma_encode_transfer_count(1), true);
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  // Setup the RAM write engine: after serving each address, dma_write_addr
+  // copies the pointer used by dma_data (which points to the RAM byte of the
+  // pair) into the destination of dma_write_data and then continues the chain.
+  // dma_write_data endlessly copies each value sampled by sm_write to the
+  // current destination.
+  dma_channel_config_t cfg_write_addr =
+      dma_channel_get_default_config(dma_write_addr);
+  dma_channel_config_t cfg_write_data =
+      dma_channel_get_default_config(dma_write_data);
+  channel_config_set_transfer_data_size(&cfg_write_addr, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg_write_addr, false);
+  channel_config_set_write_increment(&cfg_write_addr, false);
+#if MEMEMU_HAS_VREG == 1
+  channel_config_set_chain_to(&cfg_write_addr, dma_vreg_addr);
+#else
+  channel_config_set_chain_to(&cfg_write_addr, dma_addr);
+#endif
+  channel_config_set_high_priority(&cfg_write_addr, true);
+  channel_config_set_transfer_data_size(&cfg_write_data, DMA_SIZE_8);
+  channel_config_set_read_increment(&cfg_write_data, false);
+  channel_config_set_write_increment(&cfg_write_data, false);
+  channel_config_set_dreq(&cfg_write_data,
+                          pio_get_dreq(pio_sense, sm_write, false));
+  channel_config_set_high_priority(&cfg_write_data, true);
+  dma_channel_configure(dma_write_addr, &cfg_write_addr,
+                        &dma_hw->ch[dma_write_data].write_addr,
+                        &dma_hw->ch[dma_data].read_addr,
+                        dma_encode_transfer_count(1), false);
+  dma_channel_configure(dma_write_data, &cfg_write_data,
+                        mem /* set at runtime by dma_write_addr */,
+                        &pio_sense->rxf[sm_write],
+                        dma_encode_endless_transfer_count(), true);
+#endif
+
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+  // Setup the timing diagnostics: after dma_data has delivered the value to be
+  // served (and dma_deadline has signaled it), dma_timing signals it to
+  // sm_timing and then continues the chain.
+  dma_channel_config_t cfg_timing_dma =
+      dma_channel_get_default_config(dma_timing);
+  channel_config_set_transfer_data_size(&cfg_timing_dma, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg_timing_dma, false);
+  channel_config_set_write_increment(&cfg_timing_dma, false);
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  channel_config_set_chain_to(&cfg_timing_dma, dma_write_addr);
+#else
+  channel_config_set_chain_to(&cfg_timing_dma, dma_addr);
+#endif
+  channel_config_set_high_priority(&cfg_timing_dma, true);
+  dma_channel_configure(dma_timing, &cfg_timing_dma, &pio_count->irq_force,
+                        &timing_irq_force_value, dma_encode_transfer_count(1),
+                        false);
+#endif
+
+#if MEMEMU_HAS_VREG == 1
+  // Setup the virtual register: at the end of the chain, dma_vreg_addr copies
+  // the pointer used by dma_data to sm_vreg and then re-arms dma_addr. It is
+  // not paced, so that the chain never waits for sm_vreg: if its FIFO were
+  // full, the pointer would be dropped (which cannot happen in practice,
+  // because sm_vreg only lingers on a pointer until the next one arrives).
+  // sm_vreg emits a bitmask for each access to the virtual register, which
+  // dma_vreg_event writes into the MULTI_CHAN_TRIGGER register, triggering
+  // either dma_vreg_pop (reads) or dma_vreg_push (writes). The former fetches
+  // the next value from the read FIFO, the latter appends the written value to
+  // the write FIFO, and then both chain to dma_vreg_fill, which stores the next
+  // value into the mem array. Their addresses are set by mememu_vreg_enable.
+  dma_channel_config_t cfg_vreg_addr =
+      dma_channel_get_default_config(dma_vreg_addr);
+  dma_channel_config_t cfg_vreg_event =
+      dma_channel_get_default_config(dma_vreg_event);
+  dma_channel_config_t cfg_vreg_pop =
+      dma_channel_get_default_config(dma_vreg_pop);
+  dma_channel_config_t cfg_vreg_push =
+      dma_channel_get_default_config(dma_vreg_push);
+  channel_config_set_transfer_data_size(&cfg_vreg_addr, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg_vreg_addr, false);
+  channel_config_set_write_increment(&cfg_vreg_addr, false);
+  channel_config_set_chain_to(&cfg_vreg_addr, dma_addr);
+  channel_config_set_high_priority(&cfg_vreg_addr, true);
+  channel_config_set_transfer_data_size(&cfg_vreg_event, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg_vreg_event, false);
+  channel_config_set_write_increment(&cfg_vreg_event, false);
+  channel_config_set_dreq(&cfg_vreg_event,
+                          pio_get_dreq(pio_count, sm_vreg, false));
+  channel_config_set_transfer_data_size(&cfg_vreg_pop, DMA_SIZE_8);
+  channel_config_set_read_increment(&cfg_vreg_pop, true);
+  channel_config_set_write_increment(&cfg_vreg_pop, false);
+  channel_config_set_ring(&cfg_vreg_pop, false, VREG_RING_SHIFT);
+  channel_config_set_chain_to(&cfg_vreg_pop, dma_vreg_fill);
+  channel_config_set_transfer_data_size(&cfg_vreg_push, DMA_SIZE_8);
+  channel_config_set_read_increment(&cfg_vreg_push, false);
+  channel_config_set_write_increment(&cfg_vreg_push, true);
+  channel_config_set_ring(&cfg_vreg_push, true, VREG_RING_SHIFT);
+  channel_config_set_chain_to(&cfg_vreg_push, dma_vreg_fill);
+  dma_channel_configure(dma_vreg_addr, &cfg_vreg_addr,
+                        &pio_count->txf[sm_vreg],
+                        &dma_hw->ch[dma_data].read_addr,
+                        dma_encode_transfer_count(1), false);
+  dma_channel_configure(dma_vreg_pop, &cfg_vreg_pop, &vreg_next_value,
+                        vreg_read_fifo, dma_encode_transfer_count(1), false);
+  dma_channel_configure(dma_vreg_push, &cfg_vreg_push, vreg_write_fifo,
+                        mem /* set by mememu_vreg_enable */,
+                        dma_encode_transfer_count(1), false);
+  vreg_configure_fill(mem[0] /* set by mememu_vreg_enable */);
+  dma_channel_configure(dma_vreg_event, &cfg_vreg_event,
+                        &dma_hw->multi_channel_trigger,
+                        &pio_count->rxf[sm_vreg],
+                        dma_encode_endless_transfer_count(), true);
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  // Setup the memory map lookup: for each pointer emitted by sm_page,
+  // dma_page_addr triggers dma_page_data, which copies the instruction into
+  // pio_serve's memory (the halfword is replicated across the register, whose
+  // upper half is ignored) and then re-arms dma_page_addr. They are not part of
+  // the chain and have normal priority.
+  dma_channel_config_t cfg_page_addr =
+      dma_channel_get_default_config(dma_page_addr);
+  dma_channel_config_t cfg_page_data =
+      dma_channel_get_default_config(dma_page_data);
+  channel_config_set_transfer_data_size(&cfg_page_addr, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg_page_addr, false);
+  channel_config_set_write_increment(&cfg_page_addr, false);
+  channel_config_set_dreq(&cfg_page_addr,
+                          pio_get_dreq(pio_serve, sm_page, false));
+  channel_config_set_transfer_data_size(&cfg_page_data, DMA_SIZE_16);
+  channel_config_set_read_increment(&cfg_page_data, false);
+  channel_config_set_write_increment(&cfg_page_data, false);
+  channel_config_set_chain_to(&cfg_page_data, dma_page_addr);
+  dma_channel_configure(dma_page_data, &cfg_page_data,
+                        &pio_serve->instr_mem[pc_rd_drive],
+                        page_rd_instructions /* set at runtime */,
                         dma_encode_transfer_count(1), false);
+  dma_channel_configure(dma_page_addr, &cfg_page_addr,
+                        &dma_hw->ch[dma_page_data].al3_read_addr_trig,
+                        &pio_serve->rxf[sm_page], dma_encode_transfer_count(1),
+                        true);
+#endif
 
 #if ROM_EMULATOR_HAS_BUS_SWITCH == 1
 #if ROM_EMULATOR_HAS_NOPEN == 1
@@ -226,21 +1096,83 @@ void mememu_setup() {
   pio_sm_init(pio_serve, sm_dira, dir_entry_point, &cfg_dira);
   pio_sm_init(pio_serve, sm_dirb, dir_entry_point, &cfg_dirb);
   pio_sm_init(pio_sense, sm_latch, latch_entry_point, &cfg_latch);
+  uint deadline_entry_point =
+      prog_deadline + mememu_deadline_offset_entry_point;
+  pio_sm_init(pio_sense, sm_deadline, deadline_entry_point, &cfg_deadline);
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  uint write_entry_point = prog_write + mememu_write_offset_entry_point;
+  pio_sm_init(pio_sense, sm_write, write_entry_point, &cfg_write);
+  pio_sm_set_enabled(pio_sense, sm_write, true);
+#endif
   pio_serve->rxf_putget[sm_out][0] = 0x0000;  // must be done after pio_sm_init!
+
+  // Reset the bus counters and start the state machines that only maintain
+  // counters. They are kept negated (see the PIO programs), hence ~0.
+  pio_sm_exec(pio_serve, sm_dira, pio_encode_mov_not(pio_y, pio_null));
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  pio_sm_exec(pio_serve, sm_dira, pio_encode_mov_not(pio_x, pio_null));
+#endif
+  uint count_entry_point = prog_count + mememu_count_offset_entry_point;
+  pio_sm_init(pio_count, sm_count_ale, count_entry_point, &cfg_count_ale);
+  pio_sm_exec(pio_count, sm_count_ale, pio_encode_mov_not(pio_x, pio_null));
+  pio_sm_set_enabled(pio_count, sm_count_ale, true);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  pio_sm_init(pio_count, sm_count_wr, count_entry_point, &cfg_count_wr);
+  pio_sm_exec(pio_count, sm_count_wr, pio_encode_mov_not(pio_x, pio_null));
+  pio_sm_set_enabled(pio_count, sm_count_wr, true);
+#endif
+
+  // Start the missed-deadline detector. Until sm_latch emits the first
+  // address, there is nothing to check: pretend that the value was delivered.
+  pio_sense->irq_force = deadline_irq_force_value;
+  pio_sm_exec(pio_sense, sm_deadline, pio_encode_mov_not(pio_y, pio_null));
+  pio_sm_set_enabled(pio_sense, sm_deadline, true);
+
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+  mememu_reset_timing_stats();
+  uint timing_entry_point = prog_timing + mememu_timing_offset_entry_point;
+  pio_sm_init(pio_count, sm_timing, timing_entry_point, &cfg_timing);
+  pio_sm_set_enabled(pio_count, sm_timing, true);
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  // Load the address of the lookup table into sm_page's OSR, and start with
+  // the default memory map in both banks.
+  pio_sm_init(pio_serve, sm_page, pc_page_entry_point, &cfg_page);
+  pio_sm_put(pio_serve, sm_page,
+             (uintptr_t)page_rd_instructions >> PAGE_TABLE_SHIFT);
+  pio_sm_exec(pio_serve, sm_page, pio_encode_pull(false, true));
+  mememu_get_default_memory_map(memory_maps[0]);
+  mememu_get_default_memory_map(memory_maps[1]);
+  apply_memory_map();
+#endif
+
+#if MEMEMU_HAS_VREG == 1
+  // Start with the virtual register disabled.
+  pc_vreg_entry_point = prog_vreg + mememu_vreg_offset_entry_point;
+  pio_sm_init(pio_count, sm_vreg, pc_vreg_entry_point, &cfg_vreg);
+  vreg_set_offset(VREG_NO_OFFSET);
+#endif
+
   pio_enable_sm_mask_in_sync(pio_serve, 1 << sm_out);
   pio_enable_sm_mask_in_sync(pio_serve, (1 << sm_dira) | (1 << sm_dirb));
   pio_enable_sm_mask_in_sync(pio_sense, 1 << sm_latch);
 
   // Set prefix in sm_latch and wait until it starts spinning in the "paused"
   // loop.
-  pio_sm_put(pio_sense, sm_latch, (uintptr_t)mem >> MEMARRAY_SHIFT);
+  pio_sm_put(pio_sense, sm_latch, get_bank_prefix(active_bank));
   while (pio_sense->sm[sm_latch].addr != pc_latch_paused) {
     tight_loop_contents();
   }
 
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
   // Start the worker function on core 1, dedicated to processing writes to the
   // emulated RAM.
   multicore_launch_core1(core1_worker_task);
+#elif ROM_EMULATOR_PROVIDES_RAM == 1
+  // Start measuring the latency of the PIO+DMA write engine on core 1.
+  multicore_launch_core1(core1_write_monitor_task);
+#endif
 
 #if ROM_EMULATOR_HAS_BUS_SWITCH == 1 && ROM_EMULATOR_HAS_NOPEN == 1
   // With the state machines now running, we are now emitting NOPs (0x00) too.
@@ -266,6 +1198,18 @@ void mememu_stop() {
   // Save the current values of the CTRL register of both DMA channels.
   uint32_t old_ctrl_addr = dma_channel_hw_addr(dma_addr)->al1_ctrl;
   uint32_t old_ctrl_data = dma_channel_hw_addr(dma_data)->al1_ctrl;
+  uint32_t old_ctrl_deadline = dma_channel_hw_addr(dma_deadline)->al1_ctrl;
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  // dma_write_addr is part of the chain too, while dma_write_data keeps
+  // running.
+  uint32_t old_ctrl_write_addr = dma_channel_hw_addr(dma_write_addr)->al1_ctrl;
+#endif
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+  uint32_t old_ctrl_timing = dma_channel_hw_addr(dma_timing)->al1_ctrl;
+#endif
+#if MEMEMU_HAS_VREG == 1
+  uint32_t old_ctrl_vreg_addr = dma_channel_hw_addr(dma_vreg_addr)->al1_ctrl;
+#endif
 
   // Stop triggering.
   pio_sm_exec(pio_sense, sm_latch, pio_encode_jmp(pc_latch_paused));
@@ -276,36 +1220,560 @@ void mememu_stop() {
   // Stop the DMA engine (with workaround for errata RP2350-E5).
   dma_channel_hw_addr(dma_addr)->al1_ctrl = old_ctrl_addr & ~1;  // clear EN bit
   dma_channel_hw_addr(dma_data)->al1_ctrl = old_ctrl_data & ~1;  // clear EN bit
-  dma_hw->abort = (1 << dma_addr) | (1 << dma_data);
+  dma_channel_hw_addr(dma_deadline)->al1_ctrl = old_ctrl_deadline & ~1;
+  uint32_t abort_mask = (1 << dma_addr) | (1 << dma_data) | (1 << dma_deadline);
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  dma_channel_hw_addr(dma_write_addr)->al1_ctrl = old_ctrl_write_addr & ~1;
+  abort_mask |= 1 << dma_write_addr;
+#endif
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+  dma_channel_hw_addr(dma_timing)->al1_ctrl = old_ctrl_timing & ~1;
+  abort_mask |= 1 << dma_timing;
+#endif
+#if MEMEMU_HAS_VREG == 1
+  dma_channel_hw_addr(dma_vreg_addr)->al1_ctrl = old_ctrl_vreg_addr & ~1;
+  abort_mask |= 1 << dma_vreg_addr;
+#endif
+  dma_hw->abort = abort_mask;
   while (dma_hw->abort != 0) {
     tight_loop_contents();
   }
 
-  // Start emitting 0x00 again.
+  // Start emitting 0x00 again. There is nothing to check for sm_deadline until
+  // the next address is emitted.
   pio_serve->rxf_putget[sm_out][0] = 0x0000;
+  pio_sense->irq_force = deadline_irq_force_value;
 
   // Undo the workaround for errata RP2350-E5 and make the channels ready to
   // be re-triggered.
   dma_channel_hw_addr(dma_addr)->al1_ctrl = old_ctrl_addr;
   dma_channel_hw_addr(dma_data)->al1_ctrl = old_ctrl_data;
+  dma_channel_hw_addr(dma_deadline)->al1_ctrl = old_ctrl_deadline;
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+  dma_channel_hw_addr(dma_write_addr)->al1_ctrl = old_ctrl_write_addr;
+#endif
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+  dma_channel_hw_addr(dma_timing)->al1_ctrl = old_ctrl_timing;
+#endif
+#if MEMEMU_HAS_VREG == 1
+  dma_channel_hw_addr(dma_vreg_addr)->al1_ctrl = old_ctrl_vreg_addr;
+#endif
 }
 
-void mememu_write_rom(uint16_t address, uint8_t value) {
+void mememu_write_rom(uint16_t address, uint8_t value, MememuBank bank) {
   // Transform the logical address and value into the corresponding pin-mapped
   // permutation.
   uint16_t address_pin_values = pin_map_address(address);
   uint8_t value_pin_values = pin_map_data(value);
 
   // Atomically update the mem array.
-  mem[2 * address_pin_values + 1].store(value_pin_values);
+  get_bank(bank)[2 * address_pin_values + 1].store(value_pin_values);
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  // Keep the RAM of MememuRegion::Rom pages in sync.
+  if (memory_maps[get_bank_index(bank)][address / MEMEMU_PAGE_SIZE] ==
+      MememuRegion::Rom) {
+    get_bank(bank)[2 * address_pin_values + 0].store(value_pin_values);
+  }
+#endif
 }
 
-void mememu_write_ram(uint16_t address, uint8_t value) {
+uint8_t mememu_read_rom(uint16_t address, MememuBank bank) {
+  uint16_t address_pin_values = pin_map_address(address);
+  std::atomic<uint8_t> &value_pin_values =
+      get_bank(bank)[2 * address_pin_values + 1];
+  return pin_map_data_inverse(value_pin_values.load());
+}
+
+uint8_t mememu_read_ram(uint16_t address, MememuBank bank) {
+  uint16_t address_pin_values = pin_map_address(address);
+  std::atomic<uint8_t> &value_pin_values =
+      get_bank(bank)[2 * address_pin_values + 0];
+  return pin_map_data_inverse(value_pin_values.load());
+}
+
+void mememu_write_ram(uint16_t address, uint8_t value, MememuBank bank) {
   // Transform the logical address and value into the corresponding pin-mapped
   // permutation.
   uint16_t address_pin_values = pin_map_address(address);
   uint8_t value_pin_values = pin_map_data(value);
 
   // Atomically update the mem array.
-  mem[2 * address_pin_values + 0].store(value_pin_values);
+  get_bank(bank)[2 * address_pin_values + 0].store(value_pin_values);
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+  if (bank == MememuBank::Active) {
+    dirty_ram_pages[address / MEMEMU_PAGE_SIZE].store(
+        1, std::memory_order_relaxed);
+  }
+#endif
+}
+
+uint32_t mememu_load_rom_image(const uint8_t *data, size_t size,
+                               MememuBank bank) {
+  return bulk_load<1>(bank, 0, data, size, 0xFF, size);
+}
+
+uint32_t mememu_load_rom_window(uint16_t address, size_t size,
+                                const uint8_t *data, size_t data_size,
+                                MememuBank bank) {
+  return bulk_load<1>(bank, address, data, data_size, 0xFF, size);
+}
+
+uint32_t mememu_load_ram_image(const uint8_t *data, size_t size,
+                               MememuBank bank) {
+  return bulk_load<0>(bank, 0, data, size, 0xFF, size);
+}
+
+uint32_t mememu_load_rom_image_pin_order(const uint8_t *data,
+                                         MememuBank bank) {
+  return bulk_load<1, true>(bank, 0, data, MAX_MEM_SIZE, 0xFF, MAX_MEM_SIZE);
+}
+
+uint32_t mememu_load_ram_window(uint16_t address, size_t size,
+                                const uint8_t *data, size_t data_size,
+                                MememuBank bank) {
+  uint32_t duration = bulk_load<0>(bank, address, data, data_size, 0xFF, size);
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+  if (bank == MememuBank::Active) {
+    size_t end = std::min<size_t>(address + size, MAX_MEM_SIZE);
+    for (size_t page = address / MEMEMU_PAGE_SIZE;
+         page < (end + MEMEMU_PAGE_SIZE - 1) / MEMEMU_PAGE_SIZE; page++) {
+      dirty_ram_pages[page].store(1, std::memory_order_relaxed);
+    }
+  }
+#endif
+
+  return duration;
 }
+
+void mememu_read_ram(uint16_t address, uint8_t *data, size_t size) {
+  assert(address % 256 == 0);
+
+  const std::atomic<uint8_t> *src = &get_bank(MememuBank::Active)[0];
+  size_t end = std::min<size_t>(address + size, MAX_MEM_SIZE);
+  for (size_t base = address; base < end; base += 256) {
+    size_t block_size = std::min<size_t>(end - base, 256);
+    uint8_t *dest = data + (base - address);
+
+    uint16_t address_hi_pin_values = PIN_MAP_ADDRESS_TABLE_HI[base >> 8];
+    for (size_t i = 0; i < block_size; i++) {
+      uint16_t address_pin_values =
+          address_hi_pin_values | PIN_MAP_ADDRESS_TABLE_LO[i];
+      dest[i] = PIN_MAP_DATA_INVERSE_TABLE[src[2 * address_pin_values].load(
+          std::memory_order_relaxed)];
+    }
+  }
+}
+
+uint32_t mememu_fill_rom(uint8_t value, size_t size, MememuBank bank) {
+  return bulk_load<1>(bank, 0, nullptr, 0, value, size);
+}
+
+void mememu_clear_staging_bank() {
+  memset((void *)get_bank(MememuBank::Staging), 0xFF, MEMARRAY_SIZE);
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  mememu_get_default_memory_map(
+      memory_maps[get_bank_index(MememuBank::Staging)]);
+#endif
+}
+
+uint32_t mememu_switch_bank() {
+  uint32_t start_time = time_us_32();
+
+#if MEMEMU_HAS_VREG == 1
+  // The virtual register belongs to the old bank.
+  mememu_vreg_disable();
+#endif
+
+  // Make sure that all the writes into the staging bank have completed before
+  // the DMA can possibly start reading from it.
+  __dmb();
+
+  // Stop emitting new addresses. Note that the DMA channels stay armed: they
+  // simply stop receiving requests.
+  pio_sm_exec(pio_sense, sm_latch, pio_encode_jmp(pc_latch_paused));
+  while (pio_sense->sm[sm_latch].addr != pc_latch_paused) {
+    tight_loop_contents();
+  }
+
+  // Wait for any address that was latched before the pause to be fully served,
+  // i.e. until dma_addr is armed again and waiting for a new address.
+  while (!pio_sm_is_rx_fifo_empty(pio_sense, sm_latch) ||
+         dma_channel_is_busy(dma_data) || dma_channel_is_busy(dma_deadline) ||
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+         dma_channel_is_busy(dma_write_addr) ||
+#endif
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+         dma_channel_is_busy(dma_timing) ||
+#endif
+#if MEMEMU_HAS_VREG == 1
+         dma_channel_is_busy(dma_vreg_addr) ||
+#endif
+         dma_channel_hw_addr(dma_addr)->transfer_count != 1) {
+    tight_loop_contents();
+  }
+
+  // Emit NOPs until the CPU fetches address 0x0000. There is nothing to check
+  // for sm_deadline until then.
+  pio_serve->rxf_putget[sm_out][0] = 0x0000;
+  pio_sense->irq_force = deadline_irq_force_value;
+
+  // Load the new prefix into sm_latch's OSR.
+  active_bank = 1 - active_bank;
+  pio_sm_put(pio_sense, sm_latch, get_bank_prefix(active_bank));
+  pio_sm_exec(pio_sense, sm_latch, pio_encode_pull(false, true));
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  // Switch to the new bank's memory map too.
+  apply_memory_map();
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+  // The whole RAM has just been replaced.
+  for (std::atomic<uint8_t> &dirty : dirty_ram_pages) {
+    dirty.store(1, std::memory_order_relaxed);
+  }
+#elif ROM_EMULATOR_PROVIDES_RAM == 1
+  // Whatever the new bank contains is not a new request.
+  last_bank_select_value =
+      get_bank(MememuBank::Active)[BANK_SELECT_OFFSET].load(
+          std::memory_order_relaxed);
+#endif
+
+  // Resume. The "active" label waits for address 0x0000 before serving the new
+  // bank's contents.
+  pio_sm_exec(pio_sense, sm_latch, pio_encode_jmp(pc_latch_active));
+
+  return time_us_32() - start_time;
+}
+
+bool mememu_is_serving_new_bank() {
+  // The first phase of sm_latch ends when address 0x0000 is fetched.
+  return pio_sense->sm[sm_latch].addr >= pc_latch_operational;
+}
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+std::optional<uint8_t> mememu_take_bank_select_request() {
+#if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+  int request = bank_select_request.exchange(-1, std::memory_order_relaxed);
+  if (request != -1) {
+    return pin_map_data_inverse(request);
+  } else {
+    return std::nullopt;
+  }
+#else
+  uint8_t value = get_bank(MememuBank::Active)[BANK_SELECT_OFFSET].load(
+      std::memory_order_relaxed);
+  if (value != last_bank_select_value) {
+    last_bank_select_value = value;
+    return pin_map_data_inverse(value);
+  } else {
+    return std::nullopt;
+  }
+#endif
+}
+
+void mememu_take_dirty_ram_pages(uint32_t bitmap[MEMEMU_NUM_PAGES / 32]) {
+#if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+  memset(bitmap, 0, MEMEMU_NUM_PAGES / 8);
+  for (uint page = 0; page < MEMEMU_NUM_PAGES; page++) {
+    if (dirty_ram_pages[page].exchange(0, std::memory_order_relaxed) != 0) {
+      bitmap[page / 32] |= 1u << (page % 32);
+    }
+  }
+#else
+  // Writes performed by the PIO+DMA engine are not tracked: conservatively
+  // report all the pages as written.
+  memset(bitmap, 0xFF, MEMEMU_NUM_PAGES / 8);
+#endif
+}
+
+void mememu_get_default_memory_map(MememuRegion regions[MEMEMU_NUM_PAGES]) {
+  for (uint page = 0; page < MEMEMU_NUM_PAGES; page++) {
+    regions[page] =
+        page >= FIRST_RAM_PAGE ? MememuRegion::Ram : MememuRegion::Unmapped;
+  }
+}
+
+bool mememu_set_memory_map(const MememuRegion regions[MEMEMU_NUM_PAGES],
+                           MememuBank bank) {
+  for (uint page = 0; page < MEMEMU_NUM_PAGES; page++) {
+    assert(page >= FIRST_RAM_PAGE || regions[page] == MememuRegion::Unmapped);
+#if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+    // Writes performed by the PIO+DMA engine cannot be discarded.
+    if (regions[page] == MememuRegion::ReadOnlyRam ||
+        regions[page] == MememuRegion::Rom) {
+      return false;
+    }
+#endif
+  }
+
+  uint bank_index = get_bank_index(bank);
+  memcpy(memory_maps[bank_index], regions, sizeof(memory_maps[0]));
+  mirror_rom_pages(bank_index, 0, MEMEMU_NUM_PAGES);
+  if (bank == MememuBank::Active) {
+    apply_memory_map();
+  }
+  return true;
+}
+
+void mememu_get_memory_map(MememuRegion regions[MEMEMU_NUM_PAGES],
+                           MememuBank bank) {
+  memcpy(regions, memory_maps[get_bank_index(bank)], sizeof(memory_maps[0]));
+}
+
+#if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+size_t mememu_take_video_writes(MememuVideoWrite *dest, size_t max_count) {
+  uint32_t tail = video_writes_tail.load(std::memory_order_relaxed);
+  uint32_t head = video_writes_head.load(std::memory_order_acquire);
+  size_t count = std::min<size_t>(head - tail, max_count);
+  for (size_t i = 0; i < count; i++) {
+    uint16_t entry =
+        video_writes_ring[(tail + i) % VIDEO_WRITES_RING_SIZE].load(
+            std::memory_order_relaxed);
+    dest[i].reg = entry >> 8;
+    dest[i].value = pin_map_data_inverse(entry & 0xFF);
+  }
+  video_writes_tail.store(tail + count, std::memory_order_release);
+  return count;
+}
+
+uint32_t mememu_get_lost_video_writes() {
+  return video_writes_lost.load(std::memory_order_relaxed);
+}
+
+void mememu_set_ram_write_log(const MememuAddressRange *ranges,
+                              size_t num_ranges, bool with_timestamps) {
+  write_log_timestamps.store(with_timestamps, std::memory_order_relaxed);
+
+  // Note: core 1 only reads the filter, so there is no need for atomic
+  // read-modify-write operations.
+  for (std::atomic<uint32_t> &word : write_log_filter) {
+    word.store(0, std::memory_order_relaxed);
+  }
+  for (size_t i = 0; i < num_ranges; i++) {
+    for (uint32_t address = ranges[i].first; address <= ranges[i].last;
+         address++) {
+      std::atomic<uint32_t> &word = write_log_filter[address / 32];
+      word.store(word.load(std::memory_order_relaxed) | 1u << (address % 32),
+                 std::memory_order_relaxed);
+    }
+  }
+}
+
+size_t mememu_take_ram_writes(MememuRamWrite *dest, size_t max_count) {
+  uint32_t tail = write_log_tail.load(std::memory_order_relaxed);
+  uint32_t head = write_log_head.load(std::memory_order_acquire);
+  size_t count = std::min<size_t>(head - tail, max_count);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t index = (tail + i) % WRITE_LOG_RING_SIZE;
+    uint32_t entry = write_log_ring[index].load(std::memory_order_relaxed);
+    dest[i].cycles = write_log_cycles[index].load(std::memory_order_relaxed);
+    dest[i].address = entry >> 8;
+    dest[i].value = pin_map_data_inverse(entry & 0xFF);
+    dest[i].discarded = (entry >> 24) != 0;
+  }
+  write_log_tail.store(tail + count, std::memory_order_release);
+  return count;
+}
+
+uint32_t mememu_get_lost_ram_writes() {
+  return write_log_lost.load(std::memory_order_relaxed);
+}
+#endif
+
+uint32_t mememu_get_max_ram_write_cycles() {
+  return max_ram_write_cycles.load(std::memory_order_relaxed);
+}
+#endif
+
+MememuBusCounters mememu_get_bus_counters() {
+  // Each state machine stores its counters in its RX FIFO registers (see the
+  // PIO programs). Note that sm_dirb maintains the same counters as sm_dira.
+  MememuBusCounters result = {};
+  result.ale_cycles = pio_count->rxf_putget[sm_count_ale][0];
+  result.psen_fetches = pio_serve->rxf_putget[sm_dira][0];
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+  result.ram_reads = pio_serve->rxf_putget[sm_dira][1];
+  result.ram_writes = pio_count->rxf_putget[sm_count_wr][0];
+#endif
+  return result;
+}
+
+MememuMissedDeadlines mememu_get_missed_deadlines() {
+  MememuMissedDeadlines result = {};
+  result.count = missed_deadlines_count.load(std::memory_order_relaxed);
+
+  // dma_missed_log writes the pointers in order, wrapping around.
+  uint32_t num_logged =
+      std::min<uint32_t>(result.count, MEMEMU_MISSED_DEADLINES_LOG_SIZE);
+  for (uint32_t i = 0; i < num_logged; i++) {
+    uint32_t index = (result.count - 1 - i) % MEMEMU_MISSED_DEADLINES_LOG_SIZE;
+    uint32_t pointer =
+        missed_deadlines_log[index].load(std::memory_order_relaxed);
+
+    // Undo the transformation performed by sm_latch (see the mem array).
+    result.addresses[i] = pin_map_address_inverse((pointer >> 1) & 0xFFFF);
+  }
+
+  return result;
+}
+
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+void mememu_collect_timing_samples() {
+  while (!pio_sm_is_rx_fifo_empty(pio_count, sm_timing)) {
+    uint32_t sample = pio_sm_get(pio_count, sm_timing);
+
+    // Undo the negation and extract the three timestamps (see the PIO program),
+    // in loop iterations since the falling edge of ALE.
+    uint32_t data_ready = (~sample >> 20) & 0x3FF;
+    uint32_t psen_fall = (~sample >> 10) & 0x3FF;
+    uint32_t psen_rise = ~sample & 0x3FF;
+    uint32_t slack = psen_rise - data_ready;  // never negative, by construction
+
+    constexpr uint32_t k = MEMEMU_TIMING_RESOLUTION_CYCLES;
+    timing_stats.num_samples++;
+    timing_stats.min_data_ready =
+        std::min(timing_stats.min_data_ready, data_ready * k);
+    timing_stats.max_data_ready =
+        std::max(timing_stats.max_data_ready, data_ready * k);
+    timing_stats.min_psen_fall =
+        std::min(timing_stats.min_psen_fall, psen_fall * k);
+    timing_stats.max_psen_fall =
+        std::max(timing_stats.max_psen_fall, psen_fall * k);
+    timing_stats.min_psen_rise =
+        std::min(timing_stats.min_psen_rise, psen_rise * k);
+    timing_stats.max_psen_rise =
+        std::max(timing_stats.max_psen_rise, psen_rise * k);
+    timing_stats.slack_histogram[std::min<uint32_t>(
+        slack, MEMEMU_TIMING_HISTOGRAM_SIZE - 1)]++;
+  }
+}
+
+const MememuTimingStats &mememu_get_timing_stats() { return timing_stats; }
+
+void mememu_reset_timing_stats() {
+  timing_stats = {};
+  timing_stats.min_data_ready = UINT32_MAX;
+  timing_stats.min_psen_fall = UINT32_MAX;
+  timing_stats.min_psen_rise = UINT32_MAX;
+}
+#endif
+
+#if MEMEMU_HAS_VREG == 1
+// Returns the number of valid bytes in the read FIFO, including the one that is
+// currently returned by the virtual register.
+//
+// dma_vreg_pop always prefetches the byte that follows the one currently being
+// returned: if the latter is at our write position, it is not valid yet, i.e.
+// the FIFO is empty. If the Minitel CPU keeps reading anyway, the read position
+// moves beyond the write position, and the FIFO would appear to be almost full.
+// This is detected by comparing with the previous level (which can only
+// decrease between calls) and the missing bytes are skipped.
+static uint32_t vreg_read_fifo_level() {
+  uint32_t rpos =
+      (dma_hw->ch[dma_vreg_pop].read_addr - 1) % MEMEMU_VREG_FIFO_SIZE;
+  uint32_t level = (vreg_read_fifo_wpos - rpos) % MEMEMU_VREG_FIFO_SIZE;
+  if (level > vreg_read_fifo_last_level) {
+    vreg_read_fifo_wpos = rpos;
+    level = 0;
+  }
+  vreg_read_fifo_last_level = level;
+  return level;
+}
+
+void mememu_vreg_enable(uint16_t address) {
+  assert(address >= 0x8000);  // the emulated RAM is selected by A15
+  mememu_vreg_disable();
+
+  // Empty both FIFOs. dma_vreg_pop is positioned as if the byte before the
+  // first one had been prefetched, i.e. the current value is not valid.
+  uint32_t offset = 2 * pin_map_address(address) + 0;
+  std::atomic<uint8_t> *storage = &get_bank(MememuBank::Active)[offset];
+  dma_channel_set_read_addr(dma_vreg_pop, &vreg_read_fifo[1], false);
+  dma_channel_set_read_addr(dma_vreg_push, storage, false);
+  dma_channel_set_write_addr(dma_vreg_push, vreg_write_fifo, false);
+  vreg_configure_fill(storage);
+  vreg_read_fifo_wpos = 0;
+  vreg_read_fifo_last_level = 0;
+  vreg_write_fifo_rpos = 0;
+
+  vreg_enabled = true;
+  vreg_set_offset(offset);
+}
+
+void mememu_vreg_disable() {
+  // Nothing to wait for, and dma_vreg_fill may have been lent.
+  if (!vreg_enabled) {
+    return;
+  }
+
+  vreg_set_offset(VREG_NO_OFFSET);
+  vreg_enabled = false;
+
+  // Let the processing of the accesses that were already detected complete.
+  while (!pio_sm_is_rx_fifo_empty(pio_count, sm_vreg) ||
+         dma_channel_is_busy(dma_vreg_pop) ||
+         dma_channel_is_busy(dma_vreg_push) ||
+         dma_channel_is_busy(dma_vreg_fill)) {
+    tight_loop_contents();
+  }
+}
+
+bool mememu_vreg_is_enabled() { return vreg_enabled; }
+
+uint mememu_get_lendable_dma_channel() {
+  // dma_vreg_fill is only ever triggered by dma_vreg_pop and dma_vreg_push,
+  // which in turn are only triggered by sm_vreg's matches.
+  return dma_vreg_fill;
+}
+
+size_t mememu_vreg_enqueue(const uint8_t *data, size_t size) {
+  if (!vreg_enabled) {
+    return 0;
+  }
+
+  // One byte is always left unused, so that a full FIFO cannot be mistaken for
+  // an empty one.
+  uint32_t level = vreg_read_fifo_level();
+  size_t count = std::min<size_t>(size, MEMEMU_VREG_FIFO_SIZE - 1 - level);
+  uint32_t start = vreg_read_fifo_wpos;
+  for (size_t i = 0; i < count; i++) {
+    vreg_read_fifo[(start + i) % MEMEMU_VREG_FIFO_SIZE] = pin_map_data(data[i]);
+  }
+  vreg_read_fifo_wpos = (start + count) % MEMEMU_VREG_FIFO_SIZE;
+  vreg_read_fifo_last_level = level + count;
+
+  // If the first new byte may have been prefetched before we wrote it, i.e. if
+  // the FIFO was empty or the Minitel CPU has just read the last valid byte,
+  // fetch it again. Note that this is racy if the Minitel CPU reads from an
+  // empty FIFO, but that would return an unspecified value anyway.
+  __dmb();
+  uint32_t rpos =
+      (dma_hw->ch[dma_vreg_pop].read_addr - 1) % MEMEMU_VREG_FIFO_SIZE;
+  if (count != 0 && rpos == start) {
+    dma_channel_set_read_addr(dma_vreg_pop, &vreg_read_fifo[start], true);
+  }
+
+  return count;
+}
+
+size_t mememu_vreg_dequeue(uint8_t *data, size_t max_size) {
+  if (!vreg_enabled) {
+    return 0;
+  }
+
+  uint32_t wpos = dma_hw->ch[dma_vreg_push].write_addr % MEMEMU_VREG_FIFO_SIZE;
+  size_t count = std::min<size_t>(
+      max_size, (wpos - vreg_write_fifo_rpos) % MEMEMU_VREG_FIFO_SIZE);
+  for (size_t i = 0; i < count; i++) {
+    data[i] = pin_map_data_inverse(
+        vreg_write_fifo[(vreg_write_fifo_rpos + i) % MEMEMU_VREG_FIFO_SIZE]);
+  }
+  vreg_write_fifo_rpos = (vreg_write_fifo_rpos + count) % MEMEMU_VREG_FIFO_SIZE;
+
+  return count;
+}
+#endif
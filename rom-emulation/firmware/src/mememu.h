@@ -1,11 +1,35 @@
 #ifndef ROM_EMULATION_FIRMWARE_SRC_MEMEMU_H
 #define ROM_EMULATION_FIRMWARE_SRC_MEMEMU_H
 
+#include <pico/types.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include <optional>
+
 constexpr size_t MAX_MEM_SIZE = 0x10000;
 
+// Granularity of the tracking of RAM writes (see mememu_take_dirty_ram_pages).
+constexpr size_t MEMEMU_PAGE_SIZE = 256;
+constexpr size_t MEMEMU_NUM_PAGES = MAX_MEM_SIZE / MEMEMU_PAGE_SIZE;
+
+// How the accesses to each page of the data memory (i.e. MOVX instructions) are
+// served, if ROM_EMULATOR_PROVIDES_RAM is 1 (see mememu_set_memory_map). The
+// fetches from the program memory are always served from the emulated ROM.
+enum class MememuRegion : uint8_t {
+  Unmapped = 0,     // not answered, the bus is left in high impedance
+  Rom = 1,          // reads return the emulated ROM, writes are ignored
+  ReadOnlyRam = 2,  // reads return the emulated RAM, writes are ignored
+  Ram = 3,          // reads and writes access the emulated RAM
+};
+
+// The emulated ROM and RAM are double-buffered: while the active bank is being
+// served, the staging bank can be filled with the next contents.
+enum class MememuBank {
+  Active,
+  Staging,
+};
+
 // Initializes the GPIOs and PIO machines and starts responding with a fixed
 // value of 0x00 regardless of the requested address.
 void mememu_setup();
@@ -18,9 +42,314 @@ void mememu_start();
 void mememu_stop();
 
 // Sets one byte of the emulated ROM.
-void mememu_write_rom(uint16_t address, uint8_t value);
+void mememu_write_rom(uint16_t address, uint8_t value,
+                      MememuBank bank = MememuBank::Active);
+
+// Returns one byte of the emulated ROM.
+uint8_t mememu_read_rom(uint16_t address, MememuBank bank = MememuBank::Active);
 
 // Sets one byte of the emulated RAM.
-void mememu_write_ram(uint16_t address, uint8_t value);
+void mememu_write_ram(uint16_t address, uint8_t value,
+                      MememuBank bank = MememuBank::Active);
+
+// Returns one byte of the emulated RAM.
+uint8_t mememu_read_ram(uint16_t address, MememuBank bank = MememuBank::Active);
+
+// Sets the first `size` bytes of the emulated ROM from the given buffer.
+//
+// This is equivalent to calling mememu_write_rom for each byte, but much
+// faster. Returns the time it took, in microseconds.
+uint32_t mememu_load_rom_image(const uint8_t *data, size_t size,
+                               MememuBank bank = MememuBank::Active);
+
+// Sets `size` bytes of the emulated ROM, starting from the given address (that
+// must be a multiple of 256), from the first `data_size` bytes of the given
+// buffer. If `data_size` is smaller than `size`, the rest is filled with 0xFF.
+//
+// Returns the time it took, in microseconds.
+uint32_t mememu_load_rom_window(uint16_t address, size_t size,
+                                const uint8_t *data, size_t data_size,
+                                MememuBank bank = MememuBank::Active);
+
+// Sets the whole emulated ROM from the given MAX_MEM_SIZE-byte buffer, whose
+// contents must already be permuted in pin order (see PIN_MAP_SIGNATURE).
+//
+// Since no permutation is needed, this is faster than mememu_load_rom_image.
+// Returns the time it took, in microseconds.
+uint32_t mememu_load_rom_image_pin_order(
+    const uint8_t *data, MememuBank bank = MememuBank::Active);
+
+// Sets the first `size` bytes of the emulated RAM from the given buffer.
+//
+// This is equivalent to calling mememu_write_ram for each byte, but much
+// faster. Returns the time it took, in microseconds.
+uint32_t mememu_load_ram_image(const uint8_t *data, size_t size,
+                               MememuBank bank = MememuBank::Active);
+
+// Sets `size` bytes of the emulated RAM, starting from the given address (that
+// must be a multiple of 256), from the first `data_size` bytes of the given
+// buffer. If `data_size` is smaller than `size`, the rest is filled with 0xFF.
+//
+// Returns the time it took, in microseconds.
+uint32_t mememu_load_ram_window(uint16_t address, size_t size,
+                                const uint8_t *data, size_t data_size,
+                                MememuBank bank = MememuBank::Active);
+
+// Reads `size` bytes of the active emulated RAM, starting from the given
+// address (that must be a multiple of 256), into the given buffer.
+void mememu_read_ram(uint16_t address, uint8_t *data, size_t size);
+
+// Sets the first `size` bytes of the emulated ROM to the given value.
+//
+// Returns the time it took, in microseconds.
+uint32_t mememu_fill_rom(uint8_t value, size_t size,
+                         MememuBank bank = MememuBank::Active);
+
+// Fills both the ROM and the RAM of the staging bank with 0xFF and, if
+// ROM_EMULATOR_PROVIDES_RAM is 1, resets its memory map to the default one.
+void mememu_clear_staging_bank();
+
+// Swaps the staging bank with the active one, without stopping the DMA chain.
+//
+// Immediately after the switch, 0x00 (i.e. NOP) is served until the CPU
+// fetches address 0x0000. From then on, the contents of the new active bank are
+// served. Returns the time it took, in microseconds.
+uint32_t mememu_switch_bank();
+
+// Whether the CPU has fetched address 0x0000 since the last mememu_switch_bank
+// (or mememu_start), i.e. whether the contents of the active bank are being
+// served.
+bool mememu_is_serving_new_bank();
+
+// Number of bus cycles observed since mememu_setup, by type. They wrap around
+// at 2^32.
+struct MememuBusCounters {
+  uint32_t ale_cycles;
+  uint32_t psen_fetches;
+  uint32_t ram_reads;   // only if ROM_EMULATOR_PROVIDES_RAM is 1
+  uint32_t ram_writes;  // only if ROM_EMULATOR_PROVIDES_RAM is 1
+};
+
+// Returns the current values of the bus counters. They are maintained by the
+// PIO state machines alone, without any CPU involvement.
+MememuBusCounters mememu_get_bus_counters();
+
+// Number of missed deadlines whose address is remembered.
+constexpr size_t MEMEMU_MISSED_DEADLINES_LOG_SIZE = 16;
+
+// Bus cycles in which the value to be served was delivered by the DMA chain too
+// late, i.e. after the CPU latched the bus on the rising edge of PSEN or RD. If
+// ROM_EMULATOR_PROVIDES_RAM is 1, all the RD cycles are checked, including the
+// ones not directed at the emulated RAM, because the DMA chain serves them all
+// the same way.
+struct MememuMissedDeadlines {
+  uint32_t count;  // since mememu_setup, wraps around at 2^32
+
+  // The addresses being served in the most recent ones, newest first. Only the
+  // first min(count, MEMEMU_MISSED_DEADLINES_LOG_SIZE) are valid. If a value
+  // was so late that the next address had already been latched, the latter may
+  // be reported instead.
+  uint16_t addresses[MEMEMU_MISSED_DEADLINES_LOG_SIZE];
+};
+
+// Returns the missed deadlines. They are detected by a PIO state machine and
+// logged by DMA channels, without any CPU involvement.
+MememuMissedDeadlines mememu_get_missed_deadlines();
+
+#if ROM_EMULATOR_TIMING_DIAGNOSTICS == 1
+// Resolution of the timing measurements, in cycles of the system clock.
+constexpr uint32_t MEMEMU_TIMING_RESOLUTION_CYCLES = 3;
+constexpr size_t MEMEMU_TIMING_HISTOGRAM_SIZE = 32;
+
+// Timing of the sampled bus cycles, in cycles of the system clock since the
+// falling edge of ALE.
+struct MememuTimingStats {
+  uint32_t num_samples;
+
+  // When the value to be served was delivered by the DMA chain.
+  uint32_t min_data_ready, max_data_ready;
+
+  // When PSEN went low. If it happened before the value was delivered, the
+  // time of the latter is reported instead.
+  uint32_t min_psen_fall, max_psen_fall;
+
+  // When PSEN went high again, i.e. when the CPU latched the value.
+  uint32_t min_psen_rise, max_psen_rise;
+
+  // Histogram of the slack, i.e. how long the value had been delivered when
+  // PSEN went high again. Element N counts the slacks between N and N + 1 times
+  // MEMEMU_TIMING_RESOLUTION_CYCLES, except the last one, which also counts all
+  // the larger ones (including non-fetch bus cycles, for which the next PSEN
+  // pulse is measured).
+  uint32_t slack_histogram[MEMEMU_TIMING_HISTOGRAM_SIZE];
+};
+
+// Processes the samples taken since the previous call. It must be called
+// frequently, otherwise samples are skipped (which is harmless).
+void mememu_collect_timing_samples();
+
+// Returns the statistics of the samples processed since the previous reset.
+const MememuTimingStats &mememu_get_timing_stats();
+
+// Resets the statistics.
+void mememu_reset_timing_stats();
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+// Returns the bank number most recently written by the CPU into
+// BANKED_ROM_SELECT_ADDRESS, if any, since the previous call.
+std::optional<uint8_t> mememu_take_bank_select_request();
+
+// Sets bit N of the given bitmap if the logical RAM page N (i.e. the addresses
+// from N * MEMEMU_PAGE_SIZE) of the active bank has been written since the
+// previous call, and clears the bits of all the other pages. The whole RAM is
+// reported as written after mememu_switch_bank.
+//
+// Writes are only tracked if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 is 1. Otherwise,
+// all the pages are always reported as written.
+//
+// The set of written pages is global: there can only be one consumer.
+void mememu_take_dirty_ram_pages(uint32_t bitmap[MEMEMU_NUM_PAGES / 32]);
+
+// Fills the given map with the default one: the pages below 0x8000 (i.e. with
+// A15 low) are MememuRegion::Unmapped, and the other ones MememuRegion::Ram.
+void mememu_get_default_memory_map(MememuRegion regions[MEMEMU_NUM_PAGES]);
+
+// Sets the memory map of the given bank, i.e. the MememuRegion of each page of
+// the data memory. The pages below 0x8000 must be MememuRegion::Unmapped,
+// because they belong to the Minitel's own peripherals.
+//
+// The decision to answer a read is taken by looking up the page in a table
+// with DMA, without delaying the bus cycles, and only if the map contains both
+// mapped and unmapped pages in the upper half. The writes into read-only pages
+// are discarded by core 1: if ROM_EMULATOR_RAM_WRITES_VIA_CORE1 is 0, maps with
+// MememuRegion::ReadOnlyRam or MememuRegion::Rom pages are rejected (returning
+// false).
+//
+// The RAM of MememuRegion::Rom pages mirrors the ROM, which is copied into it
+// whenever either the map or the ROM changes.
+bool mememu_set_memory_map(const MememuRegion regions[MEMEMU_NUM_PAGES],
+                           MememuBank bank = MememuBank::Active);
+
+// Returns the memory map of the given bank.
+void mememu_get_memory_map(MememuRegion regions[MEMEMU_NUM_PAGES],
+                           MememuBank bank = MememuBank::Active);
+
+// Returns the maximum number of cycles spent processing a single write into the
+// emulated RAM, as measured by core 1 from when it detects the WR falling edge.
+// If ROM_EMULATOR_RAM_WRITES_VIA_CORE1 is 1, it ends when core 1 has processed
+// the write. Otherwise, it ends when the PIO+DMA write engine has dequeued the
+// sampled value (core 1 only observes it).
+uint32_t mememu_get_max_ram_write_cycles();
+#endif
+
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 1
+// Number of registers of the video chip, starting from
+// ROM_EMULATOR_VIDEO_BASE_ADDRESS (i.e. R0-R7 and ER0-ER7).
+constexpr size_t MEMEMU_VIDEO_NUM_REGISTERS = 16;
+
+struct MememuVideoWrite {
+  uint8_t reg;  // 0-15
+  uint8_t value;
+};
+
+// Takes up to `max_count` of the oldest writes into the registers of the video
+// chip that have not been taken yet. Returns how many were taken.
+//
+// They are captured by core 1 while it processes the writes into the emulated
+// RAM, without delaying them. If they are not taken fast enough, the newest
+// ones are dropped (see mememu_get_lost_video_writes).
+size_t mememu_take_video_writes(MememuVideoWrite *dest, size_t max_count);
+
+// Returns the number of writes into the registers of the video chip that have
+// been dropped since mememu_setup. It wraps around at 2^32.
+uint32_t mememu_get_lost_video_writes();
+
+struct MememuAddressRange {
+  uint16_t first, last;  // inclusive
+};
+
+struct [[gnu::packed]] MememuRamWrite {
+  uint32_t cycles;  // core 1's cycle counter at the WR falling edge, or 0
+  uint16_t address;
+  uint8_t value;
+  bool discarded;  // the page was not writable (see mememu_set_memory_map)
+};
+
+// Selects which writes into the emulated RAM core 1 logs, by address (none
+// initially), and whether it also records when they happened, in system clock
+// cycles. The entries that are already in the log are kept.
+void mememu_set_ram_write_log(const MememuAddressRange *ranges,
+                              size_t num_ranges, bool with_timestamps);
+
+// Takes up to `max_count` of the oldest logged writes into the emulated RAM.
+// Returns how many were taken.
+//
+// Like the writes into the registers of the video chip, they are logged by core
+// 1 without delaying the emulated RAM, and the newest ones are dropped if they
+// are not taken fast enough (see mememu_get_lost_ram_writes).
+size_t mememu_take_ram_writes(MememuRamWrite *dest, size_t max_count);
+
+// Returns the number of logged writes into the emulated RAM that have been
+// dropped since mememu_setup. It wraps around at 2^32.
+uint32_t mememu_get_lost_ram_writes();
+#endif
+
+// The virtual register needs the PIO resources that are otherwise used by the
+// timing diagnostics, hence it is not available together with them.
+#if ROM_EMULATOR_PROVIDES_RAM == 1 && ROM_EMULATOR_TIMING_DIAGNOSTICS == 0
+#define MEMEMU_HAS_VREG 1
+#else
+#define MEMEMU_HAS_VREG 0
+#endif
+
+// The DMA channels of the PIO write engine and of the virtual register, plus
+// the trace ring buffer's and the CYW43 driver's (two), would be 17. In that
+// case, one of the virtual register's channels is lent to the trace ring buffer
+// while the virtual register is disabled (see mememu_get_lendable_dma_channel).
+#if MEMEMU_HAS_VREG == 1 && ROM_EMULATOR_WITH_WIRELESS == 1 && \
+    ROM_EMULATOR_RAM_WRITES_VIA_CORE1 == 0
+#define MEMEMU_LENDS_VREG_DMA_CHANNEL 1
+#else
+#define MEMEMU_LENDS_VREG_DMA_CHANNEL 0
+#endif
+
+#if MEMEMU_HAS_VREG == 1
+// Size of each of the two FIFOs of the virtual register.
+constexpr size_t MEMEMU_VREG_FIFO_SIZE = 4096;
+
+// Turns the given address of the emulated RAM (that must be at least 0x8000)
+// into a virtual data register, discarding the contents of its FIFOs:
+// - each read by the Minitel CPU returns the next byte of the read FIFO (see
+//   mememu_vreg_enqueue), or an unspecified value if it is empty.
+// - each write by the Minitel CPU appends the byte to the write FIFO (see
+//   mememu_vreg_dequeue). Bytes are lost if it is not drained fast enough.
+//
+// Accesses are detected by a PIO state machine, and the FIFOs are advanced by
+// DMA channels, without any CPU involvement. Therefore, the Minitel CPU can
+// stream data with a single MOVX instruction per byte, without handshakes.
+//
+// Only one address can be a virtual register at any given time. It reverts to
+// a plain RAM byte when mememu_vreg_disable or mememu_switch_bank is called.
+void mememu_vreg_enable(uint16_t address);
+
+// Turns the virtual register back into a plain RAM byte.
+void mememu_vreg_disable();
+
+// Whether an address is currently a virtual register.
+bool mememu_vreg_is_enabled();
+
+// Returns a DMA channel of the virtual register that is idle, and can be used
+// for something else, while the virtual register is disabled. It must be given
+// back before calling mememu_vreg_enable, which reconfigures it.
+uint mememu_get_lendable_dma_channel();
+
+// Appends up to `size` bytes to the read FIFO. Returns how many of them fit.
+size_t mememu_vreg_enqueue(const uint8_t *data, size_t size);
+
+// Takes up to `max_size` bytes from the write FIFO. Returns how many of them
+// were taken.
+size_t mememu_vreg_dequeue(uint8_t *data, size_t max_size);
+#endif
 
 #endif
@@ -0,0 +1,101 @@
+#include "nvram.h"
+
+#include <string.h>
+
+#include "mememu.h"
+
+Nvram::Nvram(ConfigurationPartition &partition)
+    : partition(partition),
+      slot_num(std::nullopt),
+      pending_sectors(0),
+      next_sector_index(0),
+      next_poll_time(nil_time) {}
+
+void Nvram::begin(uint slot_num) {
+  if (partition.is_nvram_enabled(slot_num)) {
+    mememu_load_ram_window(ConfigurationPartition::NVRAM_BASE_ADDRESS,
+                           ConfigurationPartition::NVRAM_SIZE,
+                           partition.get_nvram_contents(slot_num),
+                           ConfigurationPartition::NVRAM_SIZE,
+                           MememuBank::Staging);
+    this->slot_num = slot_num;
+  } else {
+    this->slot_num = std::nullopt;
+  }
+
+  // Note: the bank switch will mark the whole RAM as dirty.
+  pending_sectors = 0;
+  next_sector_index = 0;
+  next_poll_time = make_timeout_time_ms(POLL_INTERVAL_MS);
+}
+
+void Nvram::end() { slot_num = std::nullopt; }
+
+void Nvram::poll() {
+  if (!slot_num.has_value() ||
+      absolute_time_diff_us(next_poll_time, get_absolute_time()) < 0) {
+    return;
+  }
+  next_poll_time = make_timeout_time_ms(POLL_INTERVAL_MS);
+
+  collect_dirty_pages();
+
+  // Resume scanning from where the previous call stopped, so that a sector
+  // that keeps changing cannot starve the other ones.
+  for (uint i = 0; i < NUM_SECTORS && pending_sectors != 0; i++) {
+    uint sector_index = next_sector_index;
+    next_sector_index = (next_sector_index + 1) % NUM_SECTORS;
+    if ((pending_sectors & (1u << sector_index)) != 0 &&
+        flush_sector(sector_index)) {
+      return;
+    }
+  }
+}
+
+uint Nvram::flush() {
+  uint num_written = 0;
+  if (slot_num.has_value()) {
+    collect_dirty_pages();
+    for (uint sector_index = 0; sector_index < NUM_SECTORS; sector_index++) {
+      if ((pending_sectors & (1u << sector_index)) != 0) {
+        num_written += flush_sector(sector_index);
+      }
+    }
+  }
+  return num_written;
+}
+
+void Nvram::collect_dirty_pages() {
+  uint32_t dirty_pages[MEMEMU_NUM_PAGES / 32];
+  mememu_take_dirty_ram_pages(dirty_pages);
+
+  constexpr uint first_page =
+      ConfigurationPartition::NVRAM_BASE_ADDRESS / MEMEMU_PAGE_SIZE;
+  constexpr uint pages_per_sector = FLASH_SECTOR_SIZE / MEMEMU_PAGE_SIZE;
+  for (uint i = 0; i < NUM_SECTORS * pages_per_sector; i++) {
+    uint page = first_page + i;
+    if ((dirty_pages[page / 32] & (1u << (page % 32))) != 0) {
+      pending_sectors |= 1u << (i / pages_per_sector);
+    }
+  }
+}
+
+bool Nvram::flush_sector(uint sector_index) {
+  pending_sectors &= ~(1u << sector_index);
+
+  uint32_t offset = sector_index * FLASH_SECTOR_SIZE;
+  mememu_read_ram(ConfigurationPartition::NVRAM_BASE_ADDRESS + offset,
+                  sector_buffer, FLASH_SECTOR_SIZE);
+
+  if (memcmp(sector_buffer, partition.get_nvram_contents(*slot_num) + offset,
+             FLASH_SECTOR_SIZE) == 0) {
+    return false;  // Unchanged.
+  }
+
+  if (!partition.write_nvram_sector(*slot_num, sector_index, sector_buffer)) {
+    pending_sectors |= 1u << sector_index;  // Try again later.
+    return false;
+  }
+
+  return true;
+}
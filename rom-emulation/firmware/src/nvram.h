@@ -0,0 +1,63 @@
+#ifndef ROM_EMULATION_FIRMWARE_SRC_NVRAM_H
+#define ROM_EMULATION_FIRMWARE_SRC_NVRAM_H
+
+#include <hardware/flash.h>
+#include <pico/time.h>
+#include <pico/types.h>
+
+#include <optional>
+
+#include "partition.h"
+
+// Emulates a battery-backed RAM by persisting the emulated RAM of the running
+// ROM into the NVRAM image of its slot (see ConfigurationPartition).
+//
+// Changes are not written immediately: poll() periodically collects the pages
+// written by the CPU (see mememu_take_dirty_ram_pages) and writes at most one
+// of the sectors containing them each time, so that repeated writes to the same
+// area are coalesced and each call stalls the main loop for a bounded time.
+// flush() writes all the pending changes at once.
+//
+// This class is only available if ROM_EMULATOR_PROVIDES_RAM is 1.
+class Nvram {
+ public:
+  static constexpr uint32_t POLL_INTERVAL_MS = 1000;
+  static constexpr uint NUM_SECTORS =
+      ConfigurationPartition::NVRAM_SIZE / FLASH_SECTOR_SIZE;
+  static_assert(NUM_SECTORS <= 32);
+
+  explicit Nvram(ConfigurationPartition &partition);
+
+  // Loads the NVRAM image of the given slot, if enabled, into the emulated RAM
+  // of the staging bank and starts tracking its changes after the next bank
+  // switch. If not enabled, stops tracking changes.
+  void begin(uint slot_num);
+
+  // Stops tracking changes, e.g. because the next ROM has no slot.
+  void end();
+
+  // Writes at most one changed sector, if POLL_INTERVAL_MS have elapsed since
+  // the previous time. It's meant to be called periodically.
+  void poll();
+
+  // Writes all the changed sectors. Returns how many have been written.
+  uint flush();
+
+ private:
+  // Adds the sectors containing the pages written by the CPU to
+  // pending_sectors.
+  void collect_dirty_pages();
+
+  // Writes the given pending sector if it has changed. Returns whether it was
+  // written.
+  bool flush_sector(uint sector_index);
+
+  ConfigurationPartition &partition;
+  std::optional<uint> slot_num;  // nullopt = not tracking
+  uint32_t pending_sectors;      // bitmask of sectors that may have changed
+  uint next_sector_index;
+  absolute_time_t next_poll_time;
+  alignas(uint32_t) uint8_t sector_buffer[FLASH_SECTOR_SIZE];
+};
+
+#endif
@@ -213,15 +213,33 @@ const uint8_t *ConfigurationPartition::get_rom_contents(uint slot_num) const {
       data_partition.get_contents(ROM_BASE_OFFSET + slot_num * MAX_MEM_SIZE));
 }
 
+uint64_t ConfigurationPartition::get_rom_pin_order_signature(
+    uint slot_num) const {
+  assert(slot_num < 16);
+  return superblock_contents.pin_order_signatures[slot_num];
+}
+
+bool ConfigurationPartition::is_rom_loadable(
+    uint slot_num, uint64_t pin_map_signature) const {
+  const RomInfo &info = get_rom_info(slot_num);
+  if (!info.is_present() || info.is_continuation()) {
+    return false;
+  } else if (info.is_pin_order()) {
+    return get_rom_pin_order_signature(slot_num) == pin_map_signature;
+  } else {
+    return true;
+  }
+}
+
 void ConfigurationPartition::write_begin(uint slot_num, uint8_t name_length,
                                          const char *name) {
   assert(slot_num < 16);
 
-  RomInfo &rom_slot = superblock_contents.rom_slots[slot_num];
-  memset(&rom_slot, 0xFF, sizeof(rom_slot));
+  release_slots(slot_num);
 
   // Set the name, but leave the size to all 1's (i.e. not present): the real
   // size will be written at the end, to commit the ROM.
+  RomInfo &rom_slot = superblock_contents.rom_slots[slot_num];
   rom_slot.name_length = std::min<uint8_t>(name_length, sizeof(rom_slot.name));
   memcpy(rom_slot.name, name, rom_slot.name_length);
 
@@ -234,7 +252,9 @@ void ConfigurationPartition::write_begin(uint slot_num, uint8_t name_length,
 }
 
 void ConfigurationPartition::write_data(uint8_t value) {
-  if (write_status && write_status->write_cursor < MAX_MEM_SIZE) {
+  // ROMs larger than MAX_MEM_SIZE can continue into the following slots.
+  if (write_status && write_status->write_cursor <
+                          (16 - write_status->slot_num) * MAX_MEM_SIZE) {
     // Are we about to write to a different block than before?
     if (write_status->write_cursor % FLASH_SECTOR_SIZE == 0) {
       // Flush the previous block, unless we are just starting.
@@ -246,6 +266,21 @@ void ConfigurationPartition::write_data(uint8_t value) {
             rom_block_num * FLASH_SECTOR_SIZE);
       }
 
+      // Are we about to write into the next slot? If so, take it over. Note
+      // that this must be done while the buffer is not in use.
+      if (write_status->write_cursor != 0 &&
+          write_status->write_cursor % MAX_MEM_SIZE == 0) {
+        uint next_slot_num =
+            write_status->slot_num + write_status->write_cursor / MAX_MEM_SIZE;
+        release_slots(next_slot_num);
+
+        RomInfo &rom_slot = superblock_contents.rom_slots[next_slot_num];
+        rom_slot.size = 0;
+        rom_slot.format = RomInfo::FormatContinuation;
+        rom_slot.name_length = 0;
+        flush_superblock_contents();
+      }
+
       // Initialize the buffer for new block.
       memset(data_partition.buffer, 0xFF, FLASH_SECTOR_SIZE);
     }
@@ -266,6 +301,7 @@ void ConfigurationPartition::write_end() {
 
     RomInfo &rom_slot = superblock_contents.rom_slots[write_status->slot_num];
     rom_slot.size = write_status->write_cursor;
+    rom_slot.format = RomInfo::FormatLogical;
 
     write_status = std::nullopt;
 
@@ -276,12 +312,41 @@ void ConfigurationPartition::write_end() {
 void ConfigurationPartition::erase(uint slot_num) {
   assert(slot_num < 16);
 
-  RomInfo &rom_slot = superblock_contents.rom_slots[slot_num];
-  memset(&rom_slot, 0xFF, sizeof(rom_slot));
+  release_slots(slot_num);
 
   flush_superblock_contents();
 }
 
+void ConfigurationPartition::release_slots(uint slot_num) {
+  RomInfo *rom_slots = superblock_contents.rom_slots;
+
+  // If the slot was a continuation, truncate the ROM it belongs to.
+  if (rom_slots[slot_num].is_continuation()) {
+    uint first_slot_num = slot_num;
+    while (first_slot_num != 0 && rom_slots[first_slot_num].is_continuation()) {
+      first_slot_num--;
+    }
+
+    RomInfo &first_slot = rom_slots[first_slot_num];
+    if (first_slot.is_present() && !first_slot.is_continuation()) {
+      first_slot.size = std::min<uint32_t>(
+          first_slot.size, (slot_num - first_slot_num) * MAX_MEM_SIZE);
+    }
+  }
+
+  // Release the slot and all the continuation slots that follow it.
+  memset(&rom_slots[slot_num], 0xFF, sizeof(RomInfo));
+  superblock_contents.nvram_modes[slot_num] = NvramDisabled;
+  superblock_contents.patch_sizes[slot_num] = 0xFFFF;
+  memset(superblock_contents.memory_maps[slot_num], 0xFF, MEMORY_MAP_SIZE);
+  for (uint i = slot_num + 1; i < 16 && rom_slots[i].is_continuation(); i++) {
+    memset(&rom_slots[i], 0xFF, sizeof(RomInfo));
+    superblock_contents.nvram_modes[i] = NvramDisabled;
+    superblock_contents.patch_sizes[i] = 0xFFFF;
+    memset(superblock_contents.memory_maps[i], 0xFF, MEMORY_MAP_SIZE);
+  }
+}
+
 void ConfigurationPartition::set_wireless_config(const WirelessConfig &cfg) {
   superblock_contents.wireless = cfg;
 
@@ -295,6 +360,127 @@ ConfigurationPartition::get_wireless_config() const {
   return superblock_contents.wireless;
 }
 
+bool ConfigurationPartition::has_nvram_area() const {
+  return data_partition.get_size() >= NVRAM_BASE_OFFSET + 16 * NVRAM_SIZE;
+}
+
+bool ConfigurationPartition::is_nvram_enabled(uint slot_num) const {
+  assert(slot_num < 16);
+  return has_nvram_area() &&
+         superblock_contents.nvram_modes[slot_num] == NvramEnabled;
+}
+
+void ConfigurationPartition::set_nvram_enabled(uint slot_num, bool enabled) {
+  assert(slot_num < 16 && has_nvram_area());
+
+  if (enabled && !is_nvram_enabled(slot_num)) {
+    // Start from a blank image.
+    for (uint32_t offset = 0; offset < NVRAM_SIZE;
+         offset += FLASH_SECTOR_SIZE) {
+      data_partition.erase(NVRAM_BASE_OFFSET + slot_num * NVRAM_SIZE + offset);
+    }
+  }
+
+  superblock_contents.nvram_modes[slot_num] =
+      enabled ? NvramEnabled : NvramDisabled;
+
+  // We are about to clobber the buffer, so abort any ongoing flash operation.
+  write_status = std::nullopt;
+  flush_superblock_contents();
+}
+
+const uint8_t *ConfigurationPartition::get_nvram_contents(uint slot_num) const {
+  assert(slot_num < 16);
+  return static_cast<const uint8_t *>(data_partition.get_contents(
+      NVRAM_BASE_OFFSET + slot_num * NVRAM_SIZE));
+}
+
+bool ConfigurationPartition::write_nvram_sector(uint slot_num,
+                                                uint sector_index,
+                                                const uint8_t *data) {
+  assert(sector_index < NVRAM_SIZE / FLASH_SECTOR_SIZE);
+  if (!is_nvram_enabled(slot_num) || write_status) {
+    return false;
+  }
+
+  memcpy(data_partition.buffer, data, FLASH_SECTOR_SIZE);
+  data_partition.erase_and_write_from_buffer(
+      NVRAM_BASE_OFFSET + slot_num * NVRAM_SIZE +
+      sector_index * FLASH_SECTOR_SIZE);
+  return true;
+}
+
+bool ConfigurationPartition::has_patch_area() const {
+  return data_partition.get_size() >= PATCH_BASE_OFFSET + 16 * PATCH_MAX_SIZE;
+}
+
+uint32_t ConfigurationPartition::get_patch_size(uint slot_num) const {
+  assert(slot_num < 16);
+  uint16_t size = superblock_contents.patch_sizes[slot_num];
+  if (!has_patch_area() || size > PATCH_MAX_SIZE) {
+    return 0;
+  }
+  return size;
+}
+
+const uint8_t *ConfigurationPartition::get_patch_contents(
+    uint slot_num) const {
+  assert(slot_num < 16);
+  return static_cast<const uint8_t *>(data_partition.get_contents(
+      PATCH_BASE_OFFSET + slot_num * PATCH_MAX_SIZE));
+}
+
+void ConfigurationPartition::set_patch(uint slot_num, const uint8_t *data,
+                                       uint32_t size) {
+  assert(slot_num < 16 && has_patch_area() && size <= PATCH_MAX_SIZE);
+
+  // We are about to clobber the buffer, so abort any ongoing flash operation.
+  write_status = std::nullopt;
+
+  if (size != 0) {
+    memset(data_partition.buffer, 0xFF, FLASH_SECTOR_SIZE);
+    memcpy(data_partition.buffer, data, size);
+    data_partition.erase_and_write_from_buffer(PATCH_BASE_OFFSET +
+                                               slot_num * PATCH_MAX_SIZE);
+  }
+
+  superblock_contents.patch_sizes[slot_num] = size != 0 ? size : 0xFFFF;
+  flush_superblock_contents();
+}
+
+void ConfigurationPartition::get_memory_map(
+    uint slot_num, MememuRegion regions[MEMEMU_NUM_PAGES]) const {
+  assert(slot_num < 16);
+  const uint8_t *packed = superblock_contents.memory_maps[slot_num];
+
+  constexpr uint first_page = NVRAM_BASE_ADDRESS / MEMEMU_PAGE_SIZE;
+  for (uint page = 0; page < MEMEMU_NUM_PAGES; page++) {
+    if (page < first_page) {
+      regions[page] = MememuRegion::Unmapped;
+    } else {
+      uint i = page - first_page;
+      regions[page] = (MememuRegion)((packed[i / 4] >> (i % 4 * 2)) & 0b11);
+    }
+  }
+}
+
+void ConfigurationPartition::set_memory_map(
+    uint slot_num, const MememuRegion regions[MEMEMU_NUM_PAGES]) {
+  assert(slot_num < 16);
+  uint8_t *packed = superblock_contents.memory_maps[slot_num];
+
+  constexpr uint first_page = NVRAM_BASE_ADDRESS / MEMEMU_PAGE_SIZE;
+  memset(packed, 0, MEMORY_MAP_SIZE);
+  for (uint page = first_page; page < MEMEMU_NUM_PAGES; page++) {
+    uint i = page - first_page;
+    packed[i / 4] |= ((uint8_t)regions[page] & 0b11) << (i % 4 * 2);
+  }
+
+  // We are about to clobber the buffer, so abort any ongoing flash operation.
+  write_status = std::nullopt;
+  flush_superblock_contents();
+}
+
 OtaPartition::OtaPartition() {}
 
 bool OtaPartition::open() {
@@ -6,6 +6,8 @@
 
 #include <optional>
 
+#include "mememu.h"
+
 // Raw partition access.
 class Partition {
  public:
@@ -62,6 +64,32 @@ class Partition {
 //   MAX_MEM_SIZE of bytes reserved for it, even if the slot if currently empty
 //   or its stored ROM is smaller than that.
 //
+// ROMs can be stored in two formats:
+// - RomInfo::FormatLogical: the ROM's bytes are stored in order, as seen by the
+//   CPU. They need to be permuted while loading them.
+// - RomInfo::FormatPinOrder: the ROM's bytes are stored already permuted for
+//   the pinout identified by the slot's pin_order_signature (see
+//   PIN_MAP_SIGNATURE). The whole MAX_MEM_SIZE of the slot is always used,
+//   because the permutation scatters the bytes across the whole address space.
+//
+// ROMs larger than MAX_MEM_SIZE (i.e. banked ROMs, see
+// banked-rom-definitions.h) are always stored in RomInfo::FormatLogical and
+// continue into the following slots, which are marked as
+// RomInfo::FormatContinuation.
+//
+// After the ROM slots, if the partition is big enough (i.e. it was created by a
+// recent enough generate-full-install.py), each slot has NVRAM_SIZE bytes
+// reserved for persisting the contents of the emulated RAM ("NVRAM") while its
+// ROM runs, if enabled in the slot's nvram_modes. NVRAM images are stored in
+// logical order, like FormatLogical ROMs.
+//
+// Then, if the partition is big enough, each slot has PATCH_MAX_SIZE bytes
+// reserved for an IPS or BPS patch that is applied every time its ROM is
+// loaded (see rom-patch.h). Its size is stored in the Superblock.
+//
+// The memory map of the emulated RAM of each slot (see mememu_set_memory_map)
+// is stored in the Superblock too.
+//
 // In order to 1) tolerate power cuts during updates and 2) implement a very
 // minimal form of wear levelling, new versions of the Superblock are written
 // into a sector (within the first NUM_SUPERBLOCKS) different from the current
@@ -69,13 +97,44 @@ class Partition {
 class ConfigurationPartition {
  public:
   struct [[gnu::packed]] RomInfo {
-    uint32_t size;  // UINT32_MAX = not present
+    enum : uint8_t {
+      FormatLogical = 0,
+      FormatPinOrder = 1,
+      FormatContinuation = 2,  // Holds the tail of a previous slot's ROM.
+    };
+
+    // Note: ROMs stored by older firmware versions have format = 0, because
+    // their size was stored in all 32 bits.
+    uint32_t size : 24;   // 0xFFFFFF = not present
+    uint32_t format : 8;  // one of the Format* values
     uint8_t name_length;
     char name[126];
 
-    inline bool is_present() const { return size != UINT32_MAX; }
+    inline bool is_present() const { return size != 0xFFFFFF; }
+    inline bool is_pin_order() const { return format == FormatPinOrder; }
+    inline bool is_continuation() const {
+      return format == FormatContinuation;
+    }
   };
 
+  enum NvramMode : uint8_t {
+    NvramEnabled = 0x01,
+    NvramDisabled = 0xFF,  // Also found in superblocks from older firmware.
+  };
+
+  // Size of the NVRAM image of each slot, i.e. the whole emulated RAM (which is
+  // selected by A15 and, therefore, spans the upper half of the address space).
+  static constexpr uint32_t NVRAM_BASE_ADDRESS = 0x8000;
+  static constexpr uint32_t NVRAM_SIZE = 0x8000;
+
+  // Maximum size of the patch stored for each slot.
+  static constexpr uint32_t PATCH_MAX_SIZE = FLASH_SECTOR_SIZE;
+
+  // Size of the memory map stored for each slot, with 2 bits per page of the
+  // emulated RAM.
+  static constexpr uint32_t MEMORY_MAP_SIZE =
+      NVRAM_SIZE / MEMEMU_PAGE_SIZE * 2 / 8;
+
   struct [[gnu::packed]] WirelessConfig {
     enum : uint8_t {
       OpenNetwork = 0,
@@ -98,6 +157,14 @@ class ConfigurationPartition {
   const RomInfo &get_rom_info(uint slot_num) const;
   const uint8_t *get_rom_contents(uint slot_num) const;
 
+  // Only meaningful for ROMs stored in RomInfo::FormatPinOrder.
+  uint64_t get_rom_pin_order_signature(uint slot_num) const;
+
+  // Whether the given slot contains a ROM that can be loaded by a firmware
+  // built with the given PIN_MAP_SIGNATURE. ROMs stored in pin order for a
+  // different pinout cannot be loaded.
+  bool is_rom_loadable(uint slot_num, uint64_t pin_map_signature) const;
+
   void write_begin(uint slot_num, uint8_t name_length, const char *name);
   void write_data(uint8_t value);
   void write_end();
@@ -107,10 +174,64 @@ class ConfigurationPartition {
   void set_wireless_config(const WirelessConfig &cfg);
   const WirelessConfig &get_wireless_config() const;
 
+  // Whether the partition has room for the NVRAM images.
+  bool has_nvram_area() const;
+
+  bool is_nvram_enabled(uint slot_num) const;
+
+  // Enables or disables the NVRAM for the given slot. When enabling it, its
+  // NVRAM image is erased (i.e. filled with 0xFF).
+  void set_nvram_enabled(uint slot_num, bool enabled);
+
+  // Only meaningful if is_nvram_enabled(slot_num).
+  const uint8_t *get_nvram_contents(uint slot_num) const;
+
+  // Stores one FLASH_SECTOR_SIZE-sized block of the NVRAM image of the given
+  // slot, skipping the flash operations if the stored contents are already
+  // equal.
+  //
+  // Returns false, without writing anything, if the NVRAM is not enabled for
+  // the slot or if a ROM write is in progress.
+  bool write_nvram_sector(uint slot_num, uint sector_index,
+                          const uint8_t *data);
+
+  // Whether the partition has room for the stored patches.
+  bool has_patch_area() const;
+
+  // Returns the size of the patch stored for the given slot (0 if none).
+  uint32_t get_patch_size(uint slot_num) const;
+
+  // Only meaningful if get_patch_size(slot_num) != 0.
+  const uint8_t *get_patch_contents(uint slot_num) const;
+
+  // Stores the patch for the given slot, replacing the previous one, if any. If
+  // `size` is 0, the stored patch is removed.
+  void set_patch(uint slot_num, const uint8_t *data, uint32_t size);
+
+  // Returns the memory map stored for the given slot. The pages below
+  // NVRAM_BASE_ADDRESS are always MememuRegion::Unmapped, and the default
+  // (also for superblocks from older firmware) is MememuRegion::Ram for all
+  // the others.
+  void get_memory_map(uint slot_num,
+                      MememuRegion regions[MEMEMU_NUM_PAGES]) const;
+
+  // Stores the memory map for the given slot. Only the pages starting from
+  // NVRAM_BASE_ADDRESS are stored.
+  void set_memory_map(uint slot_num,
+                      const MememuRegion regions[MEMEMU_NUM_PAGES]);
+
  private:
   // Persists the value of superblock_contents to flash.
   void flush_superblock_contents();
 
+  // Marks the given slot and its continuation slots, if any, as not present,
+  // and disables their NVRAM and patches and resets their memory maps.
+  // If the given slot is itself a continuation slot, the ROM it belongs to is
+  // truncated.
+  //
+  // Note: it does not flush superblock_contents.
+  void release_slots(uint slot_num);
+
   // Handle to the underlying partition.
   Partition data_partition;
 
@@ -119,6 +240,11 @@ class ConfigurationPartition {
     uint32_t generation_counter;  // less is newer, 0xFFFFFFFF = invalid.
     RomInfo rom_slots[16];
     WirelessConfig wireless;
+    uint64_t pin_order_signatures[16];  // appended later, so it's at the end.
+    NvramMode nvram_modes[16];          // appended later too.
+    uint16_t patch_sizes[16];           // 0xFFFF = none, appended later too.
+    // 0xFF = all RAM, appended later too.
+    uint8_t memory_maps[16][MEMORY_MAP_SIZE];
   };
   Superblock superblock_contents;
   uint superblock_write_index;  // where to write the next superblock update.
@@ -135,6 +261,12 @@ class ConfigurationPartition {
   static constexpr uint32_t NUM_SUPERBLOCKS = 16;
   static constexpr uint32_t ROM_BASE_OFFSET =
       FLASH_SECTOR_SIZE * NUM_SUPERBLOCKS;
+  static constexpr uint32_t NVRAM_BASE_OFFSET =
+      ROM_BASE_OFFSET + 16 * MAX_MEM_SIZE;
+  static_assert(NVRAM_SIZE % FLASH_SECTOR_SIZE == 0);
+  static constexpr uint32_t PATCH_BASE_OFFSET =
+      NVRAM_BASE_OFFSET + 16 * NVRAM_SIZE;
+  static_assert(PATCH_MAX_SIZE % FLASH_SECTOR_SIZE == 0);
 };
 
 // Mediates access to the A/B partitions containing the Pico's own firmware.
@@ -0,0 +1,176 @@
+#include "rom-cache.h"
+
+#include <assert.h>
+#include <hardware/flash.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "pin-map.h"
+
+RomCache::RomCache(const ConfigurationPartition &partition)
+    : partition(partition), use_counter(0), hits(0), misses(0) {
+  for (Entry &entry : entries) {
+    entry.slot_num = std::nullopt;
+    entry.fill_cursor = 0;
+  }
+}
+
+uint32_t RomCache::load(uint slot_num, MememuBank bank) {
+  assert(partition.is_rom_loadable(slot_num, PIN_MAP_SIGNATURE));
+
+  if constexpr (NUM_ENTRIES == 0) {
+    misses++;
+
+    const ConfigurationPartition::RomInfo &info =
+        partition.get_rom_info(slot_num);
+    const uint8_t *src = partition.get_rom_contents(slot_num);
+    if (info.is_pin_order()) {
+      return mememu_load_rom_image_pin_order(src, bank);
+    } else {
+      return mememu_load_rom_image(
+          src, std::min<uint32_t>(info.size, MAX_MEM_SIZE), bank);
+    }
+  }
+
+  // Look for an existing entry (possibly still being warmed up).
+  Entry *found = nullptr;
+  for (Entry &entry : entries) {
+    if (entry.slot_num == slot_num) {
+      found = &entry;
+      break;
+    }
+  }
+
+  if (found != nullptr && found->fill_cursor == MAX_MEM_SIZE) {
+    hits++;
+  } else {
+    misses++;
+
+    if (found == nullptr) {
+      // Pick a free entry or, if none, the least recently used one.
+      found = &entries[0];
+      for (Entry &entry : entries) {
+        if (is_free(entry)) {
+          found = &entry;
+          break;
+        } else if (entry.last_used < found->last_used) {
+          found = &entry;
+        }
+      }
+      assign(*found, slot_num);
+    }
+
+    fill(*found, MAX_MEM_SIZE);
+  }
+
+  found->last_used = ++use_counter;
+  return mememu_load_rom_image_pin_order(found->data, bank);
+}
+
+void RomCache::invalidate(uint slot_num) {
+  for (Entry &entry : entries) {
+    if (entry.slot_num == slot_num) {
+      entry.slot_num = std::nullopt;
+    }
+  }
+}
+
+void RomCache::warm_up_step() {
+  // Continue filling the entry that is being warmed up, if any.
+  for (Entry &entry : entries) {
+    if (entry.slot_num.has_value() && entry.fill_cursor != MAX_MEM_SIZE) {
+      fill(entry, FLASH_SECTOR_SIZE);
+      return;
+    }
+  }
+
+  // Otherwise, start warming up a free entry, if any.
+  for (Entry &entry : entries) {
+    if (!is_free(entry)) {
+      continue;
+    }
+
+    for (uint slot_num = 0; slot_num < 16; slot_num++) {
+      bool is_cached = false;
+      for (const Entry &other : entries) {
+        is_cached |= !is_free(other) && other.slot_num == slot_num;
+      }
+
+      if (!is_cached &&
+          partition.is_rom_loadable(slot_num, PIN_MAP_SIGNATURE)) {
+        assign(entry, slot_num);
+        return;
+      }
+    }
+
+    return;  // Nothing else to cache.
+  }
+}
+
+uint32_t RomCache::get_hits() const { return hits; }
+
+uint32_t RomCache::get_misses() const { return misses; }
+
+std::optional<uint> RomCache::get_entry_slot_num(uint entry_index) const {
+  assert(entry_index < NUM_ENTRIES);
+  const Entry &entry = entries[entry_index];
+  if (!is_free(entry) && entry.fill_cursor == MAX_MEM_SIZE) {
+    return entry.slot_num;
+  } else {
+    return std::nullopt;
+  }
+}
+
+bool RomCache::is_free(const Entry &entry) const {
+  // Entries whose slot has become a continuation slot (see write_data in
+  // partition.cpp) are not explicitly invalidated, but they are no longer
+  // useful.
+  return !entry.slot_num.has_value() ||
+         !partition.is_rom_loadable(*entry.slot_num, PIN_MAP_SIGNATURE);
+}
+
+void RomCache::assign(Entry &entry, uint slot_num) {
+  entry.slot_num = slot_num;
+  entry.fill_cursor = 0;
+  entry.last_used = use_counter;
+
+  // Bytes that are not covered by the ROM will stay at 0xFF, which is not
+  // affected by the pin permutation.
+  memset(entry.data, 0xFF, sizeof(entry.data));
+}
+
+void RomCache::fill(Entry &entry, uint32_t length) {
+  const ConfigurationPartition::RomInfo &info =
+      partition.get_rom_info(*entry.slot_num);
+  const uint8_t *src = partition.get_rom_contents(*entry.slot_num);
+
+  uint32_t end = std::min<uint32_t>(entry.fill_cursor + length, MAX_MEM_SIZE);
+  if (info.is_pin_order()) {
+    // Already in the right format.
+    memcpy(entry.data + entry.fill_cursor, src + entry.fill_cursor,
+           end - entry.fill_cursor);
+  } else {
+    // Process one block of 256 bytes at a time, so that the high half of the
+    // permuted address stays constant in the inner loop.
+    alignas(uint32_t) uint8_t block[256];
+    uint32_t size = std::min<uint32_t>(info.size, MAX_MEM_SIZE);
+    for (uint32_t base = entry.fill_cursor; base < std::min(end, size);
+         base += sizeof(block)) {
+      uint32_t block_size = std::min<uint32_t>(size - base, sizeof(block));
+
+      // The source is in uncached flash memory: fetching it with a single
+      // memcpy lets it be read in words instead of individual bytes.
+      memcpy(block, src + base, block_size);
+
+      uint16_t address_hi_pin_values = PIN_MAP_ADDRESS_TABLE_HI[base >> 8];
+      for (uint32_t i = 0; i < block_size; i++) {
+        uint16_t address_pin_values =
+            address_hi_pin_values | PIN_MAP_ADDRESS_TABLE_LO[i];
+        entry.data[address_pin_values] = PIN_MAP_DATA_TABLE[block[i]];
+      }
+    }
+  }
+
+  entry.fill_cursor = end;
+}
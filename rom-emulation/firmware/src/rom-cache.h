@@ -0,0 +1,72 @@
+#ifndef ROM_EMULATION_FIRMWARE_SRC_ROM_CACHE_H
+#define ROM_EMULATION_FIRMWARE_SRC_ROM_CACHE_H
+
+#include <pico/types.h>
+
+#include <array>
+#include <optional>
+
+#include "mememu.h"
+#include "partition.h"
+
+// Keeps the contents of the most recently used ROM slots in SRAM, already
+// permuted in pin order, so that booting them does not require reading from
+// flash.
+//
+// Entries are filled either on demand, by get(), or in the background, by
+// calling warm_up_step() periodically. When all the entries are in use, the
+// least recently used one is evicted.
+//
+// Each entry takes MAX_MEM_SIZE bytes, which only fit beside the two memory
+// banks and the capture and trace buffers if the emulator does not provide the
+// RAM. On the other models, there are no entries and every load is a miss.
+class RomCache {
+ public:
+  static constexpr uint NUM_ENTRIES = ROM_EMULATOR_PROVIDES_RAM == 1 ? 0 : 1;
+
+  explicit RomCache(const ConfigurationPartition &partition);
+
+  // Loads the contents of the given slot into the emulated ROM of the given
+  // bank, reading them from flash if not cached yet. Returns the time it took
+  // to fill the bank, like the mememu_load_* functions.
+  //
+  // The slot must be loadable (see ConfigurationPartition::is_rom_loadable).
+  uint32_t load(uint slot_num, MememuBank bank);
+
+  // Forgets the cached contents of the given slot, if any. This must be called
+  // whenever a slot is about to be modified.
+  void invalidate(uint slot_num);
+
+  // If there is a free entry, fills a small part of it with the contents of a
+  // slot that is not cached yet. It's meant to be called while the CPU is idle.
+  void warm_up_step();
+
+  uint32_t get_hits() const;
+  uint32_t get_misses() const;
+
+  // Returns the slot number held by the given entry, if it is complete.
+  std::optional<uint> get_entry_slot_num(uint entry_index) const;
+
+ private:
+  struct Entry {
+    std::optional<uint> slot_num;  // nullopt = free
+    uint32_t fill_cursor;          // MAX_MEM_SIZE = complete
+    uint32_t last_used;
+    alignas(uint32_t) uint8_t data[MAX_MEM_SIZE];
+  };
+
+  bool is_free(const Entry &entry) const;
+
+  // Assigns the given slot to the entry, starting an empty fill.
+  void assign(Entry &entry, uint slot_num);
+
+  // Fills up to `length` more bytes of the entry.
+  void fill(Entry &entry, uint32_t length);
+
+  const ConfigurationPartition &partition;
+  std::array<Entry, NUM_ENTRIES> entries;
+  uint32_t use_counter;
+  uint32_t hits, misses;
+};
+
+#endif
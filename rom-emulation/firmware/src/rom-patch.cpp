@@ -0,0 +1,469 @@
+#include "rom-patch.h"
+
+#include <pico/platform.h>
+#include <string.h>
+
+#include "debug-monitor.h"
+
+// Decoding steps. Multi-byte IPS fields are big-endian, BPS numbers are
+// variable-length encoded (see push_varint).
+enum class Step {
+  Magic,
+  IpsOffset,
+  IpsSize,
+  IpsRleSize,
+  IpsRleValue,
+  IpsData,
+  IpsEnd,  // after "EOF", possibly followed by a truncation size (ignored).
+  BpsSourceSize,
+  BpsTargetSize,
+  BpsMetadataSize,
+  BpsMetadata,
+  BpsAction,
+  BpsCopyOffset,
+  BpsTargetRead,
+  BpsFooter,
+};
+
+static constexpr uint32_t IPS_EOF_OFFSET = 0x454F46;  // "EOF"
+static constexpr uint BPS_FOOTER_SIZE = 12;  // source, target and patch CRC32
+
+enum BpsCommand : uint {
+  BPS_SOURCE_READ,
+  BPS_TARGET_READ,
+  BPS_SOURCE_COPY,
+  BPS_TARGET_COPY,
+};
+
+static MememuBank target_bank;
+static uint32_t patch_length, position;
+static RomPatchResult result = RomPatchResult::Ok;
+static Step step;
+static uint8_t header[12];  // magic number, or BPS footer
+
+// Value being decoded and, for IPS fields, how many bytes are still missing.
+// For BPS numbers, the weight of the next 7 bits.
+static uint64_t field;
+static uint field_bytes_left;
+static uint64_t varint_weight;
+
+// Current IPS record or BPS action.
+static uint32_t record_offset, record_left;
+static uint bps_command;
+
+static uint32_t bps_source_size, bps_target_size, bps_output_offset;
+static int64_t bps_source_offset, bps_target_offset;
+static uint32_t patch_crc;
+
+// Previous values of the changed bytes, in the order they were changed. Only
+// the first num_changes entries are meaningful, so they are not zeroed at boot
+// (see mem in mememu.cpp).
+static uint16_t __uninitialized_ram(change_addresses)[ROM_PATCH_MAX_CHANGES];
+static uint8_t __uninitialized_ram(change_originals)[ROM_PATCH_MAX_CHANGES];
+static uint num_changes = 0;
+
+static uint32_t crc32_step(uint8_t value, uint32_t crc) {
+  crc ^= value;
+  for (int i = 0; i < 8; i++) {
+    bool do_xor = (crc & 1) != 0;
+    crc = crc >> 1;
+    if (do_xor) {
+      crc ^= 0xEDB88320;
+    }
+  }
+  return crc;
+}
+
+static uint8_t read_rom(uint16_t address) {
+  if (target_bank == MememuBank::Active) {
+    return debug_monitor_read_rom(address);
+  } else {
+    return mememu_read_rom(address, target_bank);
+  }
+}
+
+static void write_rom(uint16_t address, uint8_t value, MememuBank bank) {
+  if (bank == MememuBank::Active) {
+    debug_monitor_write_rom(address, value);
+  } else {
+    mememu_write_rom(address, value, bank);
+  }
+}
+
+// Returns the value that the given byte had before the patch.
+static uint8_t read_source(uint16_t address) {
+  // BPS patches write the target in increasing order of address, so the
+  // changes are sorted.
+  uint lo = 0, hi = num_changes;
+  while (lo < hi) {
+    uint mid = (lo + hi) / 2;
+    if (change_addresses[mid] < address) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < num_changes && change_addresses[lo] == address) {
+    return change_originals[lo];
+  } else {
+    return read_rom(address);
+  }
+}
+
+static bool change(uint16_t address, uint8_t value) {
+  uint8_t original = read_rom(address);
+  if (original == value) {
+    return true;  // Nothing to do.
+  }
+  if (num_changes == ROM_PATCH_MAX_CHANGES) {
+    return false;
+  }
+  change_addresses[num_changes] = address;
+  change_originals[num_changes] = original;
+  num_changes++;
+  write_rom(address, value, target_bank);
+  return true;
+}
+
+static void revert_changes(MememuBank bank) {
+  // Going backwards, bytes changed more than once (by IPS patches) end up with
+  // their oldest value.
+  while (num_changes != 0) {
+    num_changes--;
+    write_rom(change_addresses[num_changes], change_originals[num_changes],
+              bank);
+  }
+}
+
+static void begin_field(Step next_step, uint num_bytes) {
+  step = next_step;
+  field = 0;
+  field_bytes_left = num_bytes;
+}
+
+// Accumulates one byte of a big-endian IPS field. Returns whether the field is
+// complete.
+static bool push_field(uint8_t byte) {
+  field = (field << 8) | byte;
+  return --field_bytes_left == 0;
+}
+
+static void begin_varint(Step next_step) {
+  step = next_step;
+  field = 0;
+  varint_weight = 1;
+}
+
+// Accumulates one byte of a BPS number. Returns whether the number is complete.
+static bool push_varint(uint8_t byte) {
+  field += (byte & 0x7F) * varint_weight;
+  if ((byte & 0x80) != 0) {
+    return true;
+  }
+  varint_weight <<= 7;
+  field += varint_weight;
+  return false;
+}
+
+static void begin_bps_action() {
+  if (position == patch_length - BPS_FOOTER_SIZE) {
+    step = Step::BpsFooter;
+  } else {
+    begin_varint(Step::BpsAction);
+  }
+}
+
+// Executes the current BPS action, except TargetRead, whose data comes from
+// the patch itself.
+static RomPatchResult run_bps_action() {
+  for (; record_left != 0; record_left--) {
+    uint8_t value;
+    switch (bps_command) {
+      case BPS_SOURCE_READ: {
+        value = read_source(bps_output_offset);
+        break;
+      }
+      case BPS_SOURCE_COPY: {
+        if (bps_source_offset < 0 || bps_source_offset >= bps_source_size) {
+          return RomPatchResult::Malformed;
+        }
+        value = read_source(bps_source_offset++);
+        break;
+      }
+      default: {  // BPS_TARGET_COPY
+        if (bps_target_offset < 0 || bps_target_offset >= bps_output_offset) {
+          return RomPatchResult::Malformed;
+        }
+        value = read_rom(bps_target_offset++);
+        break;
+      }
+    }
+    if (!change(bps_output_offset++, value)) {
+      return RomPatchResult::TooManyChanges;
+    }
+  }
+
+  begin_bps_action();
+  return RomPatchResult::Ok;
+}
+
+static RomPatchResult push_byte(uint8_t byte) {
+  if (position == patch_length) {
+    return RomPatchResult::Malformed;  // Longer than announced.
+  }
+
+  uint32_t index = position++;
+  if (index + 4 < patch_length) {
+    patch_crc = crc32_step(byte, patch_crc);
+  }
+
+  switch (step) {
+    case Step::Magic: {
+      header[index] = byte;
+      if (index == 3 && memcmp(header, "BPS1", 4) == 0) {
+        if (patch_length < 4 + 3 + BPS_FOOTER_SIZE) {
+          return RomPatchResult::Malformed;
+        }
+        begin_varint(Step::BpsSourceSize);
+      } else if (index == 4) {
+        if (memcmp(header, "PATCH", 5) != 0) {
+          return RomPatchResult::Malformed;
+        }
+        begin_field(Step::IpsOffset, 3);
+      }
+      break;
+    }
+    case Step::IpsOffset: {
+      if (push_field(byte)) {
+        if (field == IPS_EOF_OFFSET) {
+          step = Step::IpsEnd;
+        } else {
+          record_offset = field;
+          begin_field(Step::IpsSize, 2);
+        }
+      }
+      break;
+    }
+    case Step::IpsSize: {
+      if (push_field(byte)) {
+        record_left = field;
+        if (record_left == 0) {  // RLE record
+          begin_field(Step::IpsRleSize, 2);
+        } else if (record_offset + record_left > MAX_MEM_SIZE) {
+          return RomPatchResult::Malformed;
+        } else {
+          step = Step::IpsData;
+        }
+      }
+      break;
+    }
+    case Step::IpsRleSize: {
+      if (push_field(byte)) {
+        record_left = field;
+        if (record_offset + record_left > MAX_MEM_SIZE) {
+          return RomPatchResult::Malformed;
+        }
+        step = Step::IpsRleValue;
+      }
+      break;
+    }
+    case Step::IpsRleValue: {
+      for (; record_left != 0; record_left--) {
+        if (!change(record_offset++, byte)) {
+          return RomPatchResult::TooManyChanges;
+        }
+      }
+      begin_field(Step::IpsOffset, 3);
+      break;
+    }
+    case Step::IpsData: {
+      if (!change(record_offset++, byte)) {
+        return RomPatchResult::TooManyChanges;
+      }
+      if (--record_left == 0) {
+        begin_field(Step::IpsOffset, 3);
+      }
+      break;
+    }
+    case Step::IpsEnd: {
+      break;
+    }
+    case Step::BpsSourceSize: {
+      if (push_varint(byte)) {
+        if (field > MAX_MEM_SIZE) {
+          return RomPatchResult::Malformed;
+        }
+        bps_source_size = field;
+        begin_varint(Step::BpsTargetSize);
+      }
+      break;
+    }
+    case Step::BpsTargetSize: {
+      if (push_varint(byte)) {
+        if (field > MAX_MEM_SIZE) {
+          return RomPatchResult::Malformed;
+        }
+        bps_target_size = field;
+        begin_varint(Step::BpsMetadataSize);
+      }
+      break;
+    }
+    case Step::BpsMetadataSize: {
+      if (push_varint(byte)) {
+        if (field > patch_length - position - BPS_FOOTER_SIZE) {
+          return RomPatchResult::Malformed;
+        }
+        record_left = field;
+        if (record_left == 0) {
+          begin_bps_action();
+        } else {
+          step = Step::BpsMetadata;
+        }
+      }
+      break;
+    }
+    case Step::BpsMetadata: {
+      if (--record_left == 0) {
+        begin_bps_action();
+      }
+      break;
+    }
+    case Step::BpsAction: {
+      if (push_varint(byte)) {
+        if ((field >> 2) + 1 > bps_target_size - bps_output_offset) {
+          return RomPatchResult::Malformed;
+        }
+        bps_command = field & 3;
+        record_left = (field >> 2) + 1;
+        if (bps_command == BPS_TARGET_READ) {
+          step = Step::BpsTargetRead;
+        } else if (bps_command == BPS_SOURCE_READ) {
+          if (RomPatchResult r = run_bps_action(); r != RomPatchResult::Ok) {
+            return r;
+          }
+        } else {
+          begin_varint(Step::BpsCopyOffset);
+        }
+      }
+      break;
+    }
+    case Step::BpsCopyOffset: {
+      if (push_varint(byte)) {
+        int64_t delta = (int64_t)(field >> 1);
+        if ((field & 1) != 0) {
+          delta = -delta;
+        }
+        if (bps_command == BPS_SOURCE_COPY) {
+          bps_source_offset += delta;
+        } else {
+          bps_target_offset += delta;
+        }
+        if (RomPatchResult r = run_bps_action(); r != RomPatchResult::Ok) {
+          return r;
+        }
+      }
+      break;
+    }
+    case Step::BpsTargetRead: {
+      if (!change(bps_output_offset++, byte)) {
+        return RomPatchResult::TooManyChanges;
+      }
+      if (--record_left == 0) {
+        begin_bps_action();
+      }
+      break;
+    }
+    case Step::BpsFooter: {
+      header[index - (patch_length - BPS_FOOTER_SIZE)] = byte;
+      break;
+    }
+  }
+
+  // Reject numbers longer than needed (so that they cannot overflow) and
+  // actions extending into the footer.
+  if (varint_weight > (1ull << 35)) {
+    return RomPatchResult::Malformed;
+  }
+  if (step >= Step::BpsSourceSize && step != Step::BpsFooter &&
+      position >= patch_length - BPS_FOOTER_SIZE) {
+    return RomPatchResult::Malformed;
+  }
+
+  return RomPatchResult::Ok;
+}
+
+// Verifies the checksums stored in the BPS footer.
+static bool verify_bps_checksums() {
+  uint32_t expected[3];
+  memcpy(expected, header, sizeof(expected));
+
+  uint32_t source_crc = 0xFFFFFFFF;
+  for (uint32_t i = 0; i < bps_source_size; i++) {
+    source_crc = crc32_step(read_source(i), source_crc);
+  }
+
+  uint32_t target_crc = 0xFFFFFFFF;
+  for (uint32_t i = 0; i < bps_target_size; i++) {
+    target_crc = crc32_step(read_rom(i), target_crc);
+  }
+
+  return ~source_crc == expected[0] && ~target_crc == expected[1] &&
+         ~patch_crc == expected[2];
+}
+
+void rom_patch_begin(uint32_t length, MememuBank bank) {
+  rom_patch_revert();
+
+  target_bank = bank;
+  patch_length = length;
+  position = 0;
+  result = RomPatchResult::Ok;
+  step = Step::Magic;
+  field = 0;
+  varint_weight = 1;
+  bps_source_size = bps_target_size = bps_output_offset = 0;
+  bps_source_offset = bps_target_offset = 0;
+  patch_crc = 0xFFFFFFFF;
+}
+
+RomPatchResult rom_patch_push(const uint8_t *data, uint size) {
+  for (uint i = 0; i < size && result == RomPatchResult::Ok; i++) {
+    result = push_byte(data[i]);
+  }
+
+  if (result != RomPatchResult::Ok) {
+    revert_changes(target_bank);
+  }
+  return result;
+}
+
+RomPatchResult rom_patch_end() {
+  if (result == RomPatchResult::Ok) {
+    if (position != patch_length) {
+      result = RomPatchResult::Malformed;  // Truncated.
+    } else if (step == Step::BpsFooter) {
+      if (bps_output_offset != bps_target_size) {
+        result = RomPatchResult::Malformed;
+      } else if (!verify_bps_checksums()) {
+        result = RomPatchResult::WrongChecksum;
+      }
+    } else if (step != Step::IpsEnd) {
+      result = RomPatchResult::Malformed;
+    }
+  }
+
+  if (result != RomPatchResult::Ok) {
+    revert_changes(target_bank);
+  }
+  return result;
+}
+
+uint rom_patch_revert() {
+  uint count = num_changes;
+  revert_changes(MememuBank::Active);
+  return count;
+}
+
+void rom_patch_reset() { num_changes = 0; }
+
+uint rom_patch_get_num_changes() { return num_changes; }
@@ -0,0 +1,56 @@
+#ifndef ROM_EMULATION_FIRMWARE_SRC_ROM_PATCH_H
+#define ROM_EMULATION_FIRMWARE_SRC_ROM_PATCH_H
+
+#include <pico/types.h>
+#include <stdint.h>
+
+#include "mememu.h"
+
+// Applies IPS or BPS patches to the emulated ROM, without reloading it.
+//
+// The patch is decoded while it is received, and only the bytes it changes are
+// written into the emulated ROM. Their previous values are remembered, so that
+// the patch can be reverted later. Only one patch can be applied at a time:
+// beginning a new one reverts the previous one.
+//
+// BPS patches are applied to the emulated ROM as it was before the patch (the
+// "source") and must produce a ROM of at most MAX_MEM_SIZE bytes (the
+// "target"). Their checksums are verified at the end, reverting the patch if
+// they do not match. IPS patches have no checksums.
+//
+// Note that the CPU keeps running while the bytes change.
+
+// Maximum number of bytes that a patch can change.
+constexpr uint ROM_PATCH_MAX_CHANGES = 4096;
+
+enum class RomPatchResult {
+  Ok,
+  Malformed,       // Not a valid IPS or BPS patch, or it is truncated.
+  TooManyChanges,  // More than ROM_PATCH_MAX_CHANGES bytes would change.
+  WrongChecksum,   // The source or the resulting ROM do not match (BPS only).
+};
+
+// Reverts the current patch, if any, and prepares to apply a new patch of the
+// given total length to the given bank.
+void rom_patch_begin(uint32_t length, MememuBank bank = MememuBank::Active);
+
+// Applies the next part of the patch. If the patch turns out to be invalid, it
+// is reverted and the error is returned by this and by any following call.
+RomPatchResult rom_patch_push(const uint8_t *data, uint size);
+
+// Verifies that the whole patch has been received and, if it is a BPS patch,
+// its checksums. Otherwise, the patch is reverted.
+RomPatchResult rom_patch_end();
+
+// Restores the bytes changed by the current patch, if any. Returns how many
+// they were.
+uint rom_patch_revert();
+
+// Forgets the current patch without touching the emulated ROM. It must be
+// called when a new ROM is loaded.
+void rom_patch_reset();
+
+// Returns how many bytes have been changed by the current patch.
+uint rom_patch_get_num_changes();
+
+#endif
@@ -0,0 +1,347 @@
+#include "screen-mirror.h"
+
+#include <assert.h>
+#include <pico/time.h>
+#include <string.h>
+#include <video/commands.h>
+
+#if ROM_EMULATOR_WITH_WIRELESS == 1
+#include <lwip/tcp.h>
+#endif
+
+#include <algorithm>
+#include <iterator>
+
+#include "mememu.h"
+
+// Parameters of the commands that we interpret, in addition to those in
+// lib/video/include/video/commands.h.
+static constexpr uint8_t CMD_GROUP_MASK = 0xF0;
+static constexpr uint8_t CMD_IND_REGISTER_MASK = 0x07;
+static constexpr uint8_t CMD_MOVE_DIR_MASK = 0x0C;
+static constexpr uint8_t CMD_MOVE_STOP_MASK = 0x03;
+
+// Values of the 5-bit Y pointers. Rows 1-24 of the screen are mapped to Y
+// values from 8 to 31, starting from the origin set in the ROR register.
+static constexpr uint NUM_Y_VALUES = 32;
+static constexpr uint FIRST_SCROLLING_Y = 8;
+static constexpr uint NUM_SCROLLING_ROWS = SCREEN_MIRROR_ROWS - 1;
+static_assert(FIRST_SCROLLING_Y + NUM_SCROLLING_ROWS == NUM_Y_VALUES);
+
+// Shadow copy of the video memory, indexed by (Y, X).
+static ScreenMirrorCell vram[NUM_Y_VALUES][SCREEN_MIRROR_COLUMNS];
+
+// Shadow copies of the R0-R7 registers and of the ROR indirect register.
+static uint8_t regs[8];
+static uint8_t ror = FIRST_SCROLLING_Y;
+
+static ScreenMirrorCounters counters = {};
+
+// Returns the Y value that is displayed in the given row of the screen.
+static uint y_of_row(uint row) {
+  if (row == 0) {
+    return 0;  // service row
+  }
+
+  uint origin = std::max<uint>(ror & 0x1F, FIRST_SCROLLING_Y);
+  return FIRST_SCROLLING_Y +
+         (origin - FIRST_SCROLLING_Y + row - 1) % NUM_SCROLLING_ROWS;
+}
+
+// Registers holding the Y and X values of the main pointer (MP) and of the
+// auxiliary pointer (AP).
+static constexpr uint REG_MP_Y = 6, REG_MP_X = 7;
+static constexpr uint REG_AP_Y = 4, REG_AP_X = 5;
+
+// Returns the cell pointed to by the given pointer.
+static ScreenMirrorCell &cell_at(uint reg_y, uint reg_x) {
+  uint y = regs[reg_y] & 0x1F;
+  uint x = std::min<uint>(regs[reg_x] & 0x3F, SCREEN_MIRROR_COLUMNS - 1);
+  return vram[y][x];
+}
+
+// Returns the value of a cell in the 24-bit (TLM, CLL) or in the 16-bit (TSM,
+// CLS) format.
+static ScreenMirrorCell cell_value(bool is_16_bits) {
+  // In the 24-bit formats, R1 is the character code and R3 the attributes.
+  // In the 16-bit ones, R2 is the character code and R1 the attributes.
+  if (is_16_bits) {
+    return {regs[2], regs[1]};
+  } else {
+    return {regs[1], regs[3]};
+  }
+}
+
+// Executes a write or read of a whole cell through the given pointer.
+static void transfer(uint8_t cmd, bool is_16_bits, uint reg_y, uint reg_x) {
+  if ((cmd & VIDEO_MEM_READ) == 0) {
+    cell_at(reg_y, reg_x) = cell_value(is_16_bits);
+  }
+  if ((cmd & VIDEO_MEM_POSTINCR) != 0) {
+    uint x = ((regs[reg_x] & 0x3F) + 1) % SCREEN_MIRROR_COLUMNS;
+    regs[reg_x] = (regs[reg_x] & 0xC0) | x;
+  }
+}
+
+// Executes MVB, MVD or MVT. Returns false if the parameters are not supported.
+static bool move(uint8_t cmd) {
+  uint src_y, src_x, dst_y, dst_x;
+  switch (cmd & CMD_MOVE_DIR_MASK) {
+    case VIDEO_MOVE_DIR_MP_TO_AP: {
+      src_y = regs[REG_MP_Y] & 0x1F, src_x = regs[REG_MP_X] & 0x3F;
+      dst_y = regs[REG_AP_Y] & 0x1F, dst_x = regs[REG_AP_X] & 0x3F;
+      break;
+    }
+    case VIDEO_MOVE_DIR_AP_TO_MP: {
+      src_y = regs[REG_AP_Y] & 0x1F, src_x = regs[REG_AP_X] & 0x3F;
+      dst_y = regs[REG_MP_Y] & 0x1F, dst_x = regs[REG_MP_X] & 0x3F;
+      break;
+    }
+    default: {
+      return false;
+    }
+  }
+  if (src_x >= SCREEN_MIRROR_COLUMNS || dst_x >= SCREEN_MIRROR_COLUMNS) {
+    return false;
+  }
+
+  switch (cmd & CMD_MOVE_STOP_MASK) {
+    case VIDEO_MOVE_STOP_EOB: {
+      // Stop as soon as either pointer has gone past the end of the row.
+      while (src_x < SCREEN_MIRROR_COLUMNS && dst_x < SCREEN_MIRROR_COLUMNS) {
+        vram[dst_y][dst_x++] = vram[src_y][src_x++];
+      }
+      return true;
+    }
+    case VIDEO_MOVE_STOP_NO: {
+      // The pointers wrap around within the row, until the next command
+      // interrupts the move: assume that it took at least one whole lap, after
+      // which each further lap copies the same values again.
+      for (uint i = 0; i < SCREEN_MIRROR_COLUMNS; i++) {
+        vram[dst_y][dst_x] = vram[src_y][src_x];
+        src_x = (src_x + 1) % SCREEN_MIRROR_COLUMNS;
+        dst_x = (dst_x + 1) % SCREEN_MIRROR_COLUMNS;
+      }
+      return true;
+    }
+    default: {
+      return false;
+    }
+  }
+}
+
+static void execute(uint8_t cmd) {
+  // Commands without variants.
+  switch (cmd) {
+    case VIDEO_CMD_CLF_NP:
+    case VIDEO_CMD_CLG_NP: {
+      ScreenMirrorCell value = cell_value(cmd == VIDEO_CMD_CLG_NP);
+      std::fill(&vram[0][0], &vram[NUM_Y_VALUES][0], value);
+      return;
+    }
+    case VIDEO_CMD_NOP_NP:
+    case VIDEO_CMD_VSM_NP:
+    case VIDEO_CMD_VRM_NP: {
+      return;
+    }
+    case VIDEO_CMD_INY_NP: {
+      uint y = regs[REG_MP_Y] & 0x1F;
+      y = y == NUM_Y_VALUES - 1 ? FIRST_SCROLLING_Y : y + 1;
+      regs[REG_MP_Y] = (regs[REG_MP_Y] & 0xE0) | y;
+      return;
+    }
+  }
+
+  // Transfers of whole cells, optionally reading and/or post-incrementing X.
+  switch (cmd & ~(VIDEO_MEM_READ | VIDEO_MEM_POSTINCR)) {
+#if defined(VIDEO_EF9345)
+    case VIDEO_CMD_KRF_NP: {
+      transfer(cmd, false, REG_MP_Y, REG_MP_X);
+      return;
+    }
+    case VIDEO_CMD_KRG_NP: {
+      transfer(cmd, true, REG_MP_Y, REG_MP_X);
+      return;
+    }
+#elif defined(VIDEO_TS9347)
+    case VIDEO_CMD_TLM_NP: {
+      transfer(cmd, false, REG_MP_Y, REG_MP_X);
+      return;
+    }
+    case VIDEO_CMD_TLA_NP: {
+      transfer(cmd, false, REG_AP_Y, REG_AP_X);
+      return;
+    }
+    case VIDEO_CMD_TSM_NP:
+    case VIDEO_CMD_TSM: {  // what the library sends instead (see commands.h)
+      transfer(cmd, true, REG_MP_Y, REG_MP_X);
+      return;
+    }
+    case VIDEO_CMD_TSA_NP: {
+      transfer(cmd, true, REG_AP_Y, REG_AP_X);
+      return;
+    }
+#endif
+  }
+
+  switch (cmd & CMD_GROUP_MASK) {
+    case VIDEO_CMD_IND_NP: {
+      if ((cmd & VIDEO_MEM_READ) == 0 &&
+          (cmd & CMD_IND_REGISTER_MASK) == VIDEO_IND_ROR) {
+        ror = regs[1];
+      }
+      return;
+    }
+    case VIDEO_CMD_MVB_NP:
+    case VIDEO_CMD_MVD_NP:
+    case VIDEO_CMD_MVT_NP: {
+      if (move(cmd)) {
+        return;
+      }
+      break;
+    }
+  }
+
+  counters.unsupported_commands++;
+}
+
+#if ROM_EMULATOR_WITH_WIRELESS == 1
+// The connected TCP client, if any.
+static tcp_pcb *client_pcb = nullptr;
+
+// What the client has been sent so far, and whether it needs a full update.
+static ScreenMirrorCell sent[SCREEN_MIRROR_ROWS][SCREEN_MIRROR_COLUMNS];
+static bool client_needs_full_update;
+static absolute_time_t next_update_time;
+
+// Large enough for a full update. Diff updates that would not fit are replaced
+// by full updates.
+static uint8_t update_buf[1 + sizeof(sent)];
+
+static void on_client_error(void *arg, err_t err) {
+  // The PCB has already been freed.
+  client_pcb = nullptr;
+}
+
+static err_t on_client_recv(void *arg, tcp_pcb *pcb, pbuf *p, err_t err) {
+  if (p != nullptr) {
+    // Incoming data is ignored.
+    tcp_recved(pcb, p->tot_len);
+    pbuf_free(p);
+    return ERR_OK;
+  }
+
+  // The client has closed the connection.
+  client_pcb = nullptr;
+  tcp_abort(pcb);
+  return ERR_ABRT;
+}
+
+static err_t on_client_accepted(void *arg, tcp_pcb *pcb, err_t err) {
+  if (client_pcb != nullptr) {
+    tcp_abort(client_pcb);  // calls on_client_error
+  }
+
+  client_pcb = pcb;
+  tcp_recv(pcb, on_client_recv);
+  tcp_err(pcb, on_client_error);
+  client_needs_full_update = true;
+  next_update_time = get_absolute_time();
+  return ERR_OK;
+}
+
+void screen_mirror_listen() {
+  tcp_pcb *pcb = tcp_new_ip_type(IPADDR_TYPE_ANY);
+  assert(pcb != nullptr);
+  tcp_bind(pcb, IP4_ADDR_ANY, SCREEN_MIRROR_TCP_PORT);
+  pcb = tcp_listen(pcb);
+  assert(pcb != nullptr);
+  tcp_accept(pcb, on_client_accepted);
+}
+
+// Sends the changes to the TCP client, as a diff update or, if that would be
+// larger, as a full update. If there is not enough space in the send buffer,
+// nothing is sent, and the changes will be sent again next time.
+static void send_update() {
+  ScreenMirrorCell screen[SCREEN_MIRROR_ROWS][SCREEN_MIRROR_COLUMNS];
+  screen_mirror_get(screen);
+
+  uint length = 0;
+  if (!client_needs_full_update) {
+    update_buf[0] = 'D';
+    length = 3;
+    uint16_t num_changes = 0;
+    for (uint row = 0; row < SCREEN_MIRROR_ROWS; row++) {
+      for (uint col = 0; col < SCREEN_MIRROR_COLUMNS; col++) {
+        const ScreenMirrorCell &cell = screen[row][col];
+        const ScreenMirrorCell &old_cell = sent[row][col];
+        if (cell.code == old_cell.code &&
+            cell.attributes == old_cell.attributes) {
+          continue;
+        }
+        if (length + 4 > sizeof(update_buf)) {
+          client_needs_full_update = true;
+          break;
+        }
+        update_buf[length++] = row;
+        update_buf[length++] = col;
+        update_buf[length++] = cell.code;
+        update_buf[length++] = cell.attributes;
+        num_changes++;
+      }
+    }
+    if (num_changes == 0) {
+      return;
+    }
+    memcpy(&update_buf[1], &num_changes, sizeof(num_changes));
+  }
+  if (client_needs_full_update) {
+    update_buf[0] = 'F';
+    memcpy(&update_buf[1], screen, sizeof(screen));
+    length = 1 + sizeof(screen);
+  }
+
+  if (tcp_sndbuf(client_pcb) < length) {
+    return;
+  }
+  tcp_write(client_pcb, update_buf, length, TCP_WRITE_FLAG_COPY);
+  tcp_output(client_pcb);
+  memcpy(sent, screen, sizeof(screen));
+  client_needs_full_update = false;
+}
+#endif
+
+void screen_mirror_poll() {
+  MememuVideoWrite writes[64];
+  while (size_t count = mememu_take_video_writes(writes, std::size(writes))) {
+    for (size_t i = 0; i < count; i++) {
+      // ER0-ER7 are aliases of R0-R7 that also execute the command in R0.
+      regs[writes[i].reg % 8] = writes[i].value;
+      if (writes[i].reg >= 8) {
+        execute(regs[0]);
+      }
+    }
+    counters.decoded_writes += count;
+  }
+
+#if ROM_EMULATOR_WITH_WIRELESS == 1
+  if (client_pcb != nullptr &&
+      absolute_time_diff_us(next_update_time, get_absolute_time()) >= 0) {
+    next_update_time = make_timeout_time_ms(SCREEN_MIRROR_STREAM_INTERVAL_MS);
+    send_update();
+  }
+#endif
+}
+
+void screen_mirror_get(
+    ScreenMirrorCell dest[SCREEN_MIRROR_ROWS][SCREEN_MIRROR_COLUMNS]) {
+  for (uint row = 0; row < SCREEN_MIRROR_ROWS; row++) {
+    memcpy(dest[row], vram[y_of_row(row)], sizeof(vram[0]));
+  }
+}
+
+ScreenMirrorCounters screen_mirror_get_counters() {
+  ScreenMirrorCounters result = counters;
+  result.lost_writes = mememu_get_lost_video_writes();
+  return result;
+}
@@ -0,0 +1,66 @@
+#ifndef ROM_EMULATION_FIRMWARE_SRC_SCREEN_MIRROR_H
+#define ROM_EMULATION_FIRMWARE_SRC_SCREEN_MIRROR_H
+
+#include <pico/types.h>
+#include <stdint.h>
+
+// Shadow copy of the Minitel's screen, reconstructed by decoding the commands
+// sent by the CPU to the video chip (TS9347 or EF9345), as captured from the
+// bus by core 1 (see mememu_take_video_writes).
+//
+// Commands are decoded according to the video chip of the Minitel model that
+// the firmware is built for (see lib/video/include/video/commands.h). Only
+// those that change what is displayed in the 40-column modes are interpreted:
+// TLM, TLA, TSM and TSA, or KRF and KRG (writes), CLL and CLS, or CLF and CLG
+// (clears), MVB, MVD and MVT (moves, within a single row, with either stop
+// condition), INY and the ROR indirect register (vertical scrolling).
+// District/page bits are ignored, i.e. all the commands are assumed to target
+// the displayed page.
+//
+// The screen can also be streamed to a TCP client, connected to
+// SCREEN_MIRROR_TCP_PORT. The stream consists of the following messages:
+// - 'F', followed by all the cells, row by row, as pairs of (character code,
+//   attributes) bytes. It is sent when the client connects.
+// - 'D', followed by the number of changed cells (16-bit little endian), and
+//   then by (row, column, character code, attributes) for each of them. It is
+//   sent at most every SCREEN_MIRROR_STREAM_INTERVAL_MS, if anything changed.
+// Only one client is served at a time: a new connection replaces the old one.
+//
+// These functions are only available if ROM_EMULATOR_PROVIDES_RAM and
+// ROM_EMULATOR_RAM_WRITES_VIA_CORE1 are both 1.
+
+// Size of the screen. Row 0 is the service row.
+constexpr uint SCREEN_MIRROR_ROWS = 25;
+constexpr uint SCREEN_MIRROR_COLUMNS = 40;
+
+constexpr uint16_t SCREEN_MIRROR_TCP_PORT = 3760;
+constexpr uint32_t SCREEN_MIRROR_STREAM_INTERVAL_MS = 100;
+
+struct ScreenMirrorCell {
+  uint8_t code;        // character code
+  uint8_t attributes;  // R3 for TLM/CLL, R1 for TSM/CLS
+};
+
+struct ScreenMirrorCounters {
+  uint32_t decoded_writes;        // register writes that have been decoded
+  uint32_t lost_writes;           // register writes that were dropped
+  uint32_t unsupported_commands;  // executed commands that were ignored
+};
+
+// Decodes the register writes captured since the previous call and, if a TCP
+// client is connected, sends it the changes. It must be called frequently.
+void screen_mirror_poll();
+
+// Returns the current contents of the screen.
+void screen_mirror_get(
+    ScreenMirrorCell dest[SCREEN_MIRROR_ROWS][SCREEN_MIRROR_COLUMNS]);
+
+// Returns the current values of the counters. They wrap around at 2^32.
+ScreenMirrorCounters screen_mirror_get_counters();
+
+#if ROM_EMULATOR_WITH_WIRELESS == 1
+// Starts accepting TCP clients on SCREEN_MIRROR_TCP_PORT.
+void screen_mirror_listen();
+#endif
+
+#endif
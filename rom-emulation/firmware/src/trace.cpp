@@ -1,7 +1,13 @@
 #include "trace.h"
 
+#include <hardware/dma.h>
 #include <hardware/pio.h>
-#include <pico/time.h>
+#include <hardware/timer.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <iterator>
 
 #include "pin-map.h"
 #include "trace.pio.h"
@@ -13,10 +19,92 @@ static_assert(PIN_PSEN == PIN_ALE + 1, "PSEN and ALE must be consecutive");
 static const PIO pio = pio2;
 static constexpr uint sm = 0;
 
-void trace_setup() {
-  // Claim the state machine.
-  pio_sm_claim(pio, sm);
+// Offset of the trace_capture program while the logic analyzer mode is armed.
+// It takes the place of trace_ale_then_psen, because the instruction memory
+// could not fit both.
+static uint prog_capture;
+
+// DMA channel that drains the state machine into trace_ring or, while the
+// logic analyzer mode is armed, into capture_buf. In both cases, it retriggers
+// itself after each lap of the ring buffer, which also sets its (raw) interrupt
+// flag, telling that the ring has wrapped around. It has normal priority, so
+// that it never delays the emulation.
+static uint dma_trace;
+static bool dma_trace_lent = false;  // see trace_suspend
+
+// Ring buffer of raw trace_ale_then_psen samples. Samples are only read after
+// the DMA channel has written them (see trace_valid_index), so the ring is not
+// zeroed at boot, which lets it sit below mem (see mememu.cpp).
+static constexpr uint TRACE_RING_SHIFT = 14;
+static uint32_t __uninitialized_ram(trace_ring)[TRACE_RING_SIZE]
+    [[gnu::aligned(1 << TRACE_RING_SHIFT)]];
+static_assert(sizeof(trace_ring) == 1 << TRACE_RING_SHIFT);
+
+// Number of samples written into trace_ring as of the last call to
+// trace_get_write_index, and the index of the first one written after the
+// address trace was last (re)started.
+static uint32_t trace_write_index;
+static uint32_t trace_valid_index;
+
+// Index of the next address to be encoded into the compressed stream, and the
+// previous one (if any) that it will be encoded relative to.
+static uint32_t stream_index;
+static std::optional<uint16_t> stream_prev;
+
+// Whether the stream has already reported that the address trace is suspended.
+static bool stream_suspended;
+
+// Ring buffer of the logic analyzer mode. It is separate from trace_ring, so
+// that a completed capture is kept while the address trace resumes.
+//
+// On models in which the emulator provides the RAM, it is not zeroed at boot
+// either, like trace_ring. On the other ones, the space below mem is taken by
+// the ROM cache instead, and the alignment of this buffer would not fit there.
+static constexpr uint CAPTURE_RING_SHIFT = 15;
+#if ROM_EMULATOR_PROVIDES_RAM == 1
+static uint32_t __uninitialized_ram(capture_buf)[TRACE_CAPTURE_MAX_SAMPLES]
+    [[gnu::aligned(1 << CAPTURE_RING_SHIFT)]];
+#else
+static uint32_t capture_buf[TRACE_CAPTURE_MAX_SAMPLES]
+    [[gnu::aligned(1 << CAPTURE_RING_SHIFT)]];
+#endif
+static_assert(sizeof(capture_buf) == 1 << CAPTURE_RING_SHIFT);
+
+static TraceCaptureStatus capture_status = {TraceCaptureState::Idle};
+static uint capture_num_post_samples;
+static uint capture_oldest_index;  // position of the first sample in the ring
 
+// Whether the address trace is not running, because the logic analyzer mode is
+// armed or the DMA channel is lent.
+static bool is_address_trace_stopped() {
+  return capture_status.state == TraceCaptureState::Armed || dma_trace_lent;
+}
+
+// Starts dma_trace, filling the given ring buffer from its beginning.
+static void start_dma(uint32_t *ring, uint ring_shift) {
+  dma_channel_config_t cfg = dma_channel_get_default_config(dma_trace);
+  channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+  channel_config_set_read_increment(&cfg, false);
+  channel_config_set_write_increment(&cfg, true);
+  channel_config_set_ring(&cfg, true, ring_shift);
+  channel_config_set_dreq(&cfg, pio_get_dreq(pio, sm, false));
+  dma_hw->intr = 1u << dma_trace;
+  dma_channel_configure(dma_trace, &cfg, ring, &pio->rxf[sm],
+                        dma_encode_transfer_count_with_self_trigger(
+                            (1u << ring_shift) / sizeof(uint32_t)),
+                        true);
+}
+
+// Starts filling trace_ring from its beginning: skip the write index to the
+// next lap, and ignore the older (stale) samples.
+static void restart_ring() {
+  trace_write_index += TRACE_RING_SIZE - trace_write_index % TRACE_RING_SIZE;
+  trace_valid_index = trace_write_index;
+  start_dma(trace_ring, TRACE_RING_SHIFT);
+}
+
+// Loads and starts the trace_ale_then_psen program.
+static void start_address_trace() {
   // Load the program into the PIO engine.
   uint prog = pio_add_program(pio, &trace_ale_then_psen_program);
   pio_sm_config cfg = trace_ale_then_psen_program_get_default_config(prog);
@@ -28,33 +116,288 @@ void trace_setup() {
   // Start the state machine.
   uint pc_entry_point = prog + trace_ale_then_psen_offset_entry_point;
   pio_sm_init(pio, sm, pc_entry_point, &cfg);
+  restart_ring();
   pio_sm_set_enabled(pio, sm, true);
 }
 
-uint trace_collect(uint max_samples, absolute_time_t deadline, uint16_t *buf) {
-  uint count = 0;
+// Stops the logic analyzer mode and goes back to the address trace.
+static void end_capture() {
+  pio_sm_set_enabled(pio, sm, false);
+  dma_channel_abort(dma_trace);
+
+  pio_remove_program(pio, &trace_capture_program, prog_capture);
+  start_address_trace();
+}
+
+void trace_setup(uint dma_channel) {
+  // Claim the state machine.
+  pio_sm_claim(pio, sm);
+  dma_trace = dma_channel;
+
+  start_address_trace();
+}
+
+void trace_suspend() {
+  if (dma_trace_lent) {
+    return;
+  }
+
+  // The logic analyzer mode needs the DMA channel too.
+  trace_capture_stop();
 
-  // Discard any enqueued old data.
+  // Bring the write index up to date, as the ring will stop advancing.
+  trace_get_write_index();
+  dma_channel_abort(dma_trace);
+  dma_trace_lent = true;
+}
+
+void trace_resume() {
+  if (!dma_trace_lent) {
+    return;
+  }
+
+  // Meanwhile, the FIFO has overflowed with stale addresses.
+  dma_trace_lent = false;
   pio_sm_clear_fifos(pio, sm);
+  restart_ring();
+}
 
-  // Collect fresh samples.
-  while (absolute_time_diff_us(deadline, get_absolute_time()) < 0 &&
-         count < max_samples) {
-    if (!pio_sm_is_rx_fifo_empty(pio, sm)) {
-      // Counter the rotation due to:
-      // - sm_config_set_in_pin_base (PIN_ALE bits right)
-      // - the PIO program itself (2 more bits right)
-      buf[count++] = pio_sm_get(pio, sm) >> (32 - PIN_ALE - 2);
-    }
+bool trace_is_suspended() { return dma_trace_lent; }
+
+uint32_t trace_get_write_index() {
+  if (is_address_trace_stopped()) {
+    return trace_write_index;
+  }
+
+  // Check the lap flag before reading the position, so that a wrap-around in
+  // between is still detected by the position going backwards.
+  uint32_t lap_mask = 1u << dma_trace;
+  bool lapped = (dma_hw->intr & lap_mask) != 0;
+  uint pos = (dma_hw->ch[dma_trace].write_addr - (uintptr_t)trace_ring) /
+             sizeof(uint32_t);
+  uint last_pos = trace_write_index % TRACE_RING_SIZE;
+
+  if (pos < last_pos) {
+    // Wrapped around once (or more, but only one lap can be accounted for).
+    trace_write_index += TRACE_RING_SIZE - last_pos + pos;
+    dma_hw->intr = lap_mask;
+  } else if (lapped) {
+    // A whole lap has been written since the previous call.
+    trace_write_index += TRACE_RING_SIZE + pos - last_pos;
+    dma_hw->intr = lap_mask;
+  } else {
+    trace_write_index += pos - last_pos;
   }
+  return trace_write_index;
+}
 
-  // Compiler barrier to ensure that the slow code below doesn't get moved into
-  // the performance-critical loop above.
-  asm volatile("" ::: "memory");
+bool trace_read(uint32_t first, uint count, uint16_t *buf) {
+  uint32_t end = trace_get_write_index();
+  if (first - trace_valid_index > end - trace_valid_index ||
+      count > end - first) {
+    return false;  // not traced yet, or from before the last restart
+  }
 
   for (uint i = 0; i < count; i++) {
-    buf[i] = pin_map_address_inverse(buf[i]);
+    // Counter the rotation due to:
+    // - sm_config_set_in_pin_base (PIN_ALE bits right)
+    // - the PIO program itself (2 more bits right)
+    uint32_t raw = trace_ring[(first + i) % TRACE_RING_SIZE];
+    buf[i] = pin_map_address_inverse(raw >> (32 - PIN_ALE - 2));
+  }
+
+  // Check that none of the samples have been overwritten in the meantime.
+  return trace_get_write_index() - first <= TRACE_RING_SIZE;
+}
+
+void trace_stream_restart() {
+  stream_index = trace_get_write_index();
+  stream_prev.reset();
+  stream_suspended = false;
+}
+
+uint trace_stream_read(uint8_t *buf, uint max_length) {
+  uint length = 0;
+  uint run = 0;  // sequential fetches that have not been encoded yet
+  uint16_t chunk[32];
+
+  // Report the suspension once, when it is first noticed: either while it is
+  // still in progress or, if it ended in the meantime, from the ring having
+  // been restarted past the next address to be encoded.
+  uint32_t end = trace_get_write_index();
+  bool stopped = is_address_trace_stopped();
+  if (stopped || stream_index - trace_valid_index > end - trace_valid_index) {
+    if (!stream_suspended) {
+      buf[length++] = TRACE_STREAM_SUSPENDED;
+    }
+    stream_suspended = stopped;
+    if (stopped) {
+      return length;
+    }
+
+    // Continue from the first address traced after the suspension.
+    stream_index = trace_valid_index;
+    stream_prev.reset();
+  }
+
+  // Each step appends at most a run, a lost count and an absolute address.
+  constexpr uint MAX_STEP_LENGTH = 1 + 5 + 3;
+  while (length + MAX_STEP_LENGTH <= max_length) {
+    uint32_t end = trace_get_write_index();
+    uint32_t available =
+        std::min<uint32_t>(end - trace_valid_index, TRACE_RING_SIZE);
+
+    // If the oldest addresses that have not been encoded yet are gone, skip
+    // ahead, leaving enough headroom to catch up before the DMA channel laps
+    // again.
+    if (end - stream_index > available) {
+      uint32_t resume =
+          end - std::min<uint32_t>(available, TRACE_RING_SIZE / 2);
+      uint32_t lost = resume - stream_index;
+      if (run != 0) {
+        buf[length++] = run - 1;
+        run = 0;
+      }
+      buf[length++] = TRACE_STREAM_LOST;
+      memcpy(&buf[length], &lost, sizeof(lost));
+      length += sizeof(lost);
+      stream_index = resume;
+      stream_prev.reset();
+    }
+
+    uint count = std::min<uint32_t>(std::size(chunk), end - stream_index);
+    if (count == 0) {
+      break;  // all caught up
+    } else if (!trace_read(stream_index, count, chunk)) {
+      continue;  // overwritten in the meantime: skip them as lost
+    }
+
+    for (uint i = 0; i < count && length + MAX_STEP_LENGTH <= max_length; i++) {
+      uint16_t address = chunk[i];
+      int16_t delta = stream_prev.has_value() ? address - *stream_prev : 0;
+      if (stream_prev.has_value() && delta == 1) {
+        if (run == 128) {
+          buf[length++] = run - 1;
+          run = 0;
+        }
+        run++;
+      } else {
+        if (run != 0) {
+          buf[length++] = run - 1;
+          run = 0;
+        }
+        if (stream_prev.has_value() && delta >= -32 && delta < 32) {
+          buf[length++] = 0x80 | (delta + 32);
+        } else {
+          buf[length++] = TRACE_STREAM_ABSOLUTE;
+          memcpy(&buf[length], &address, sizeof(address));
+          length += sizeof(address);
+        }
+      }
+      stream_prev = address;
+      stream_index++;
+    }
+  }
+
+  if (run != 0) {
+    buf[length++] = run - 1;
+  }
+  return length;
+}
+
+bool trace_capture_start(uint clkdiv, uint num_post_samples,
+                         std::optional<uint16_t> trigger_address) {
+  trace_capture_stop();
+  capture_status = {TraceCaptureState::Idle};
+  if (dma_trace_lent) {
+    return false;
+  }
+
+  // Bring the write index up to date, as the ring will stop advancing.
+  trace_get_write_index();
+
+  // Replace the address trace with the trace_capture program.
+  pio_sm_set_enabled(pio, sm, false);
+  dma_channel_abort(dma_trace);
+  pio_remove_program(pio, &trace_ale_then_psen_program, 0);
+  prog_capture = pio_add_program(pio, &trace_capture_program);
+  pio_sm_config cfg = trace_capture_program_get_default_config(prog_capture);
+  sm_config_set_in_pin_base(&cfg, 0);
+  sm_config_set_jmp_pin(&cfg, PIN_ALE);
+  sm_config_set_clkdiv_int_frac8(&cfg, clkdiv, 0);
+
+  // Without a trigger address, start directly from the post-trigger samples.
+  uint pc_start = trigger_address.has_value()
+                      ? prog_capture + trace_capture_offset_entry_point
+                      : prog_capture + trace_capture_offset_triggered;
+  pio_sm_init(pio, sm, pc_start, &cfg);
+
+  // Load the trigger address into Y and enqueue the number of post-trigger
+  // samples.
+  pio_sm_put(pio, sm, pin_map_address(trigger_address.value_or(0)));
+  pio_sm_exec(pio, sm, pio_encode_pull(false, true));
+  pio_sm_exec(pio, sm, pio_encode_mov(pio_y, pio_osr));
+  pio_sm_put(pio, sm, num_post_samples - 2);
+  pio->fdebug = (1u << (PIO_FDEBUG_TXSTALL_LSB + sm)) |
+                (1u << (PIO_FDEBUG_RXSTALL_LSB + sm));
+
+  start_dma(capture_buf, CAPTURE_RING_SHIFT);
+
+  capture_num_post_samples = num_post_samples;
+  capture_status.state = TraceCaptureState::Armed;
+  capture_status.clkdiv = clkdiv;
+  pio_sm_set_enabled(pio, sm, true);
+  return true;
+}
+
+void trace_capture_stop() {
+  if (capture_status.state == TraceCaptureState::Armed) {
+    end_capture();
+    capture_status.state = TraceCaptureState::Idle;
   }
+}
 
+TraceCaptureStatus trace_capture_poll() {
+  if (capture_status.state != TraceCaptureState::Armed) {
+    return capture_status;
+  }
+
+  // The capture is complete once the state machine is waiting for another
+  // post-trigger count and the DMA channel has emptied the FIFO.
+  uint32_t fdebug = pio->fdebug;
+  if ((fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + sm))) == 0 ||
+      !pio_sm_is_rx_fifo_empty(pio, sm)) {
+    return capture_status;
+  }
+
+  // Let the last write complete, then locate the samples in the ring.
+  busy_wait_us_32(1);
+  uint end_index =
+      (dma_hw->ch[dma_trace].write_addr - (uintptr_t)capture_buf) /
+      sizeof(uint32_t);
+  bool wrapped = (dma_hw->intr & (1u << dma_trace)) != 0;
+  end_capture();
+
+  uint num_samples = wrapped ? TRACE_CAPTURE_MAX_SAMPLES : end_index;
+  capture_oldest_index = wrapped ? end_index : 0;
+  capture_status.state = TraceCaptureState::Complete;
+  capture_status.stalled =
+      (fdebug & (1u << (PIO_FDEBUG_RXSTALL_LSB + sm))) != 0;
+  capture_status.num_samples = num_samples;
+  capture_status.trigger_index = num_samples - capture_num_post_samples;
+  return capture_status;
+}
+
+uint trace_capture_read(uint first, uint max_count, uint32_t *buf) {
+  if (capture_status.state != TraceCaptureState::Complete ||
+      first >= capture_status.num_samples) {
+    return 0;
+  }
+
+  uint count = std::min<uint>(max_count, capture_status.num_samples - first);
+  for (uint i = 0; i < count; i++) {
+    uint index = (capture_oldest_index + first + i) % TRACE_CAPTURE_MAX_SAMPLES;
+    buf[i] = capture_buf[index];
+  }
   return count;
 }
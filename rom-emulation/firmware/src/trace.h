@@ -4,12 +4,98 @@
 #include <pico/types.h>
 #include <stdint.h>
 
+#include <optional>
+
+// Number of addresses held by the ring buffer of the address trace.
+constexpr uint TRACE_RING_SIZE = 4096;
+
+// Number of samples held by the ring buffer of the logic analyzer mode.
+constexpr uint TRACE_CAPTURE_MAX_SAMPLES = 8192;
+
+// The compressed stream of traced addresses is a sequence of records, each
+// starting with a byte that tells its kind:
+// - 0x00-0x7F: N+1 sequential fetches, each at the previous address + 1.
+// - 0x80-0xBF: a fetch at the previous address + (the low 6 bits - 32).
+// - TRACE_STREAM_ABSOLUTE, followed by the address (u16): a fetch at it.
+// - TRACE_STREAM_LOST, followed by a count (u32): that many addresses were
+//   overwritten before being read. The next record is absolute.
+// - TRACE_STREAM_SUSPENDED: the address trace was suspended (see trace_suspend
+//   and trace_capture_start), and the fetches in the meantime are unknown. The
+//   next record is absolute.
+constexpr uint8_t TRACE_STREAM_ABSOLUTE = 0xC0;
+constexpr uint8_t TRACE_STREAM_LOST = 0xC1;
+constexpr uint8_t TRACE_STREAM_SUSPENDED = 0xC2;
+
+enum class TraceCaptureState : uint8_t {
+  Idle,      // Never started, or stopped before completing.
+  Armed,     // Waiting for the trigger or for the post-trigger samples.
+  Complete,  // The samples can be read.
+};
+
+struct [[gnu::packed]] TraceCaptureStatus {
+  TraceCaptureState state;
+  bool stalled;            // samples were delayed, because the DMA fell behind
+  uint16_t clkdiv;         // as passed to trace_capture_start
+  uint16_t num_samples;    // only if Complete
+  uint16_t trigger_index;  // of the first sample after the trigger
+};
+
 // Starts the PIO machine that captures the address of every access to program
-// memory.
-void trace_setup();
+// memory, and the given DMA channel that continuously stores them into a ring
+// buffer.
+void trace_setup(uint dma_channel);
+
+// Stops using the DMA channel (and stops any logic analyzer capture), so that
+// it can be lent to something else. Meanwhile, no addresses are traced.
+void trace_suspend();
+
+// Takes the DMA channel back, after trace_suspend, and resumes the trace.
+void trace_resume();
+
+// Whether the DMA channel is lent, i.e. between trace_suspend and trace_resume.
+bool trace_is_suspended();
+
+// Returns the number of addresses traced so far (wrapping around at 2^32),
+// i.e. the index that the next one will have. If not called at least once every
+// TRACE_RING_SIZE addresses, the returned value may lag behind by multiples of
+// TRACE_RING_SIZE, which is harmless for readers of the most recent ones.
+uint32_t trace_get_write_index();
+
+// Copies the `count` addresses starting from the one at index `first`, without
+// blocking. Returns false if any of them has not been traced yet, has already
+// been overwritten, or is from before the last logic analyzer capture.
+bool trace_read(uint32_t first, uint count, uint16_t *buf);
+
+// Restarts the compressed stream from the next traced address.
+void trace_stream_restart();
+
+// Encodes the addresses traced since the previous call into `buf`, as many as
+// they fit in `max_length` bytes (at least 9). Returns the number of bytes.
+//
+// While the address trace is suspended, a single TRACE_STREAM_SUSPENDED record
+// is returned, followed by nothing until it resumes.
+uint trace_stream_read(uint8_t *buf, uint max_length);
+
+// Starts the logic analyzer mode, in which the state machine of the address
+// trace samples all the GPIOs (bit N of each sample is GPIO N) every 4 *
+// `clkdiv` system clock cycles into a ring buffer. Until it is stopped or
+// complete, the address trace is suspended.
+//
+// The capture ends `num_post_samples` (at least 2) after the trigger, i.e. ALE
+// latching `trigger_address` or, if not set, the start itself. Any previous
+// capture is discarded. Returns false if the DMA channel is lent.
+bool trace_capture_start(uint clkdiv, uint num_post_samples,
+                         std::optional<uint16_t> trigger_address);
+
+// Stops the capture, if armed, and resumes the address trace.
+void trace_capture_stop();
+
+// Returns the status of the capture, resuming the address trace if it has just
+// completed.
+TraceCaptureStatus trace_capture_poll();
 
-// Collects addresses until either the given number of samples if reached, or
-// the deadline expires. Returns the number of collected samples.
-uint trace_collect(uint max_samples, absolute_time_t deadline, uint16_t *buf);
+// Copies up to `max_count` samples of the completed capture, in chronological
+// order, starting from the one at index `first`. Returns how many were copied.
+uint trace_capture_read(uint first, uint max_count, uint32_t *buf);
 
 #endif